@@ -92,6 +92,8 @@ case CRT_NONE:
 case CRT_ALL:
   domain_name->value("");
   domain_engines->clear();
+  domain_max_depth->value(100);
+  domain_adaptive_depth->value(0);
   {
     using namespace ranktracker::controller::domain::settings;
     auto engines = ranktracker::engine::search_engines();
@@ -384,22 +386,21 @@ if(selected_kwd != nullptr) {
   progress_bar->minimum(0);
   progress_bar->maximum(d->engines().size() * 100);
   progress_bar->value(0);
+  progress_bar->label("working...");
   progress_wnd->show();
   std::thread updater_thread(&RankTrackerUI::refresh_keyword, this);
   updater_thread.detach();
 } else if(selected_domain != nullptr) {
   if(selected_domain == tree->root()) {
-    // update all domains in the crt category
+    // update all domains in the crt category; the refresh is queued
+    // together with whatever was left by an interrupted refresh
     try {
-      create_transaction trans(&db, MDB_RDONLY);
-      size_t max = 0;
-      for(auto &d: domains_list) {
-        max += 100 * d.engines().size() * db.countKeywords(d);
-      }
-      trans.commit();
+      ranking_service.enqueue_refresh(domains_list);
+      size_t max = 100 * ranking_service.refresh_queue().remaining();
       progress_bar->minimum(0);
       progress_bar->maximum(max);
       progress_bar->value(0);
+      progress_bar->label("working...");
       progress_wnd->show();
       std::thread updater_thread(&RankTrackerUI::refresh_crt_domain_list, this);
       updater_thread.detach();
@@ -418,6 +419,7 @@ if(selected_kwd != nullptr) {
       progress_bar->minimum(0);
       progress_bar->maximum(ks * d->engines().size() * 100);
       progress_bar->value(0);
+      progress_bar->label("working...");
       progress_wnd->show();
       std::thread updater_thread(&RankTrackerUI::refresh_domain, this);
       updater_thread.detach();
@@ -2347,7 +2349,9 @@ case ACTION_NONE:
   break;
 case ACTION_ADD:
   {
-    domains_list.emplace_back(dname, std::move(selected_engines));
+    domains_list.emplace_back(dname, std::move(selected_engines),
+                              (unsigned)domain_max_depth->value(),
+                              domain_adaptive_depth->value() != 0);
     const ranktracker::data::Domain& d = domains_list.back();
     Fl_Tree_Item* item = tree->add(tree->root(), d.name().c_str()) ;
     item->user_data((void *)&d);
@@ -2710,6 +2714,18 @@ RankTrackerUI::RankTrackerUI() {
     { Fl_Button* o = new Fl_Button(305, 265, 110, 25, "Remove engine");
       o->callback((Fl_Callback*)cb_Remove);
     } // Fl_Button* o
+    { domain_max_depth = new Fl_Spinner(305, 315, 110, 25, "Search depth");
+      domain_max_depth->tooltip("Number of results searched for the domain");
+      domain_max_depth->minimum(10);
+      domain_max_depth->maximum(100);
+      domain_max_depth->step(10);
+      domain_max_depth->value(100);
+      domain_max_depth->align(Fl_Align(FL_ALIGN_TOP_LEFT));
+    } // Fl_Spinner* domain_max_depth
+    { domain_adaptive_depth = new Fl_Check_Button(305, 345, 110, 20, "Adaptive");
+      domain_adaptive_depth->tooltip("Start searching on the page of the last rank");
+      domain_adaptive_depth->down_box(FL_DOWN_BOX);
+    } // Fl_Check_Button* domain_adaptive_depth
     { Fl_Return_Button* o = new Fl_Return_Button(350, 375, 65, 25, "Ok");
       o->callback((Fl_Callback*)cb_Ok1);
     } // Fl_Return_Button* o
@@ -3090,30 +3106,28 @@ void RankTrackerUI::refresh_crt_domain_list() {
   BOOST_LOG_TRIVIAL(trace) << "refresh_crt_domain_list() enter\n";
   
   ranktracker::controller::progress_bar_updater<Fl_Progress> bar_updater(progress_bar);
-  ranktracker::progress::progress_updater bar_updater_f(bar_updater);
+  ranktracker::progress::progress_updater bar_updater_f = [this, bar_updater](int progress) mutable {
+    bar_updater(progress);
+  
+    // show the remaining time of the queued refresh
+    auto st = ranking_service.refresh_queue().stats();
+    std::ostringstream label;
+    label << st.remaining() << " rankings left";
+    if(!st.eta.is_not_a_date_time()) {
+      label << ", about " << st.eta.hours() << "h " << st.eta.minutes() << "m to go";
+    }
+    Fl::lock();
+    progress_bar->copy_label(label.str().c_str());
+    Fl::unlock();
+    Fl::awake();
+  };
   
-  bool resize_retried = false;
-  retry_refresh:
   try {
-    ranktracker::persistence::create_transaction trans(&db);
+    // the queue commits every ranking on its own, so no transaction
+    // is opened here
     BOOST_LOG_TRIVIAL(trace) << "refresh_crt_domain_list() calling ranking service\n";
-    ranking_service.refresh_ranking(domains_list, bar_updater_f);
+    ranking_service.run_refresh_pipeline(bar_updater_f);
     BOOST_LOG_TRIVIAL(trace) << "refresh_crt_domain_list() ranking service returned\n";
-    trans.commit();
-  } catch (ranktracker::persistence::DatabaseMapFullException e) {
-    if(resize_retried) {
-      BOOST_LOG_TRIVIAL(error) << "DatabaseMapFullException raised after resizing on refresh domains list operation; giving up.";
-    } else {
-      try {
-        BOOST_LOG_TRIVIAL(warning) << "Database map is full on refresh operation. Resizing the database and than retrying the refresh domains list operation.";
-        db.increase_mapsize();
-        resize_retried = true;
-        BOOST_LOG_TRIVIAL(info) << "Database map resized successfully. Retrying the refresh domain operation.";
-        goto retry_refresh;
-      } catch (...) {
-        BOOST_LOG_TRIVIAL(error) << "Failed to increase database map size. Giving up on refresh domains list operation.";
-      }
-    }
   } catch (...) {
     BOOST_LOG_TRIVIAL(error) << "ERROR: updating domains list failed";
   }
@@ -31,6 +31,8 @@ extern void chart_click_cb(ranktracker::ui::RanksChart<ranktracker::data::Rankin
 #include <FL/Fl_Text_Editor.H>
 #include <FL/Fl_Browser.H>
 #include <FL/Fl_Menu_Button.H>
+#include <FL/Fl_Spinner.H>
+#include <FL/Fl_Check_Button.H>
 #include <memory>
 #include <cstdlib>
 #include <boost/algorithm/string/trim.hpp>
@@ -108,6 +110,8 @@ public:
 private:
   inline void cb_Remove_i(Fl_Button*, void*);
   static void cb_Remove(Fl_Button*, void*);
+  Fl_Spinner *domain_max_depth;
+  Fl_Check_Button *domain_adaptive_depth;
   inline void cb_Ok1_i(Fl_Return_Button*, void*);
   static void cb_Ok1(Fl_Return_Button*, void*);
   inline void cb_Cancel1_i(Fl_Button*, void*);
@@ -0,0 +1,43 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// app_support_folder_posix.cc
+// application data folder for Linux and other POSIX systems; the
+// folder is $RANKTRACKER_DATA_DIR if set, otherwise
+// $XDG_DATA_HOME/GoogleRankTracker or ~/.local/share/GoogleRankTracker
+
+#include "app_support_folder.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <boost/filesystem.hpp>
+
+static std::string app_data_folder() {
+  const char *dir = std::getenv("RANKTRACKER_DATA_DIR");
+  std::string folder;
+  if(dir && *dir) {
+    folder = dir;
+  } else {
+    const char *data_home = std::getenv("XDG_DATA_HOME");
+    if(data_home && *data_home) {
+      folder = std::string(data_home) + "/GoogleRankTracker";
+    } else {
+      const char *home = std::getenv("HOME");
+      folder = std::string(home ? home : ".") + "/.local/share/GoogleRankTracker";
+    }
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(folder, ec);
+  return folder;
+}
+
+int open_app_db_environment(MDB_env *env) {
+  return mdb_env_open(env, app_data_folder().c_str(), 0, 0640);
+}
+
+char *app_support_folder() {
+  std::string folder = app_data_folder();
+  char *buf = (char *)std::malloc(folder.size() + 1);
+  std::strcpy(buf, folder.c_str());
+  return buf;
+}
@@ -0,0 +1,195 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// bounded_queue.hh
+// fixed capacity lock-free queue connecting the stages of the refresh
+// pipeline
+
+#ifndef RANKTRACKER_BOUNDED_QUEUE_HH
+#define RANKTRACKER_BOUNDED_QUEUE_HH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace ranktracker {
+  namespace ranking {
+
+    /**
+     * Waiting strategy of the blocking queue operations: spins first,
+     * then yields the processor, then sleeps for growing intervals, up
+     * to 2ms.
+     */
+    class queue_backoff {
+      unsigned _step;
+    public:
+      queue_backoff() : _step(0) {}
+
+      void wait() {
+        if(_step < 64) {
+          // busy spin
+        } else if(_step < 128) {
+          std::this_thread::yield();
+        } else {
+          unsigned shift = std::min(_step - 128, 4u);
+          std::this_thread::sleep_for(std::chrono::microseconds(125 << shift));
+        }
+        _step++;
+      }
+    };
+
+    /**
+     * Multi producer, multi consumer queue with a fixed capacity, rounded
+     * up to a power of two (D. Vyukov's bounded queue). Every cell has a
+     * sequence number telling whether it waits for a producer or for a
+     * consumer, so pushing and popping only take a compare and swap on
+     * the queue position; no lock is held while a value is moved.
+     *
+     * `push` waits while the queue is full, which is the backpressure
+     * slowing down a stage feeding a slower one. `pop` waits while the
+     * queue is empty, until the queue is closed.
+     */
+    template<class T>
+    class bounded_queue {
+      struct cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+      };
+
+      std::unique_ptr<cell[]> _cells;
+      std::size_t _mask;
+      alignas(64) std::atomic<std::size_t> _push_pos;
+      alignas(64) std::atomic<std::size_t> _pop_pos;
+      alignas(64) std::atomic<bool> _closed;
+
+      static std::size_t round_capacity(std::size_t n) {
+        std::size_t capacity = 2;
+        while(capacity < n) capacity <<= 1;
+        return capacity;
+      }
+
+    public:
+      explicit bounded_queue(std::size_t capacity) :
+        _cells(new cell[round_capacity(capacity)]),
+        _mask(round_capacity(capacity) - 1),
+        _push_pos(0),
+        _pop_pos(0),
+        _closed(false)
+      {
+        for(std::size_t i = 0; i <= _mask; i++) {
+          _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+      }
+
+      bounded_queue(const bounded_queue&) = delete;
+      bounded_queue& operator= (const bounded_queue&) = delete;
+
+      std::size_t capacity() const { return _mask + 1; }
+
+      /**
+       * Number of values in the queue; only a hint while other threads
+       * use the queue.
+       */
+      std::size_t size() const {
+        std::size_t pushed = _push_pos.load(std::memory_order_relaxed);
+        std::size_t popped = _pop_pos.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+      }
+
+      /**
+       * Moves the value into the queue; returns false, leaving the value
+       * untouched, if the queue is full.
+       */
+      bool try_push(T& value) {
+        cell *c;
+        std::size_t pos = _push_pos.load(std::memory_order_relaxed);
+        for(;;) {
+          c = &_cells[pos & _mask];
+          std::size_t seq = c->sequence.load(std::memory_order_acquire);
+          std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+          if(diff == 0) {
+            if(_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+          } else if(diff < 0) {
+            return false;
+          } else {
+            pos = _push_pos.load(std::memory_order_relaxed);
+          }
+        }
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+
+      /**
+       * Moves the oldest value out of the queue; returns false if the
+       * queue is empty.
+       */
+      bool try_pop(T& value) {
+        cell *c;
+        std::size_t pos = _pop_pos.load(std::memory_order_relaxed);
+        for(;;) {
+          c = &_cells[pos & _mask];
+          std::size_t seq = c->sequence.load(std::memory_order_acquire);
+          std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
+          if(diff == 0) {
+            if(_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+          } else if(diff < 0) {
+            return false;
+          } else {
+            pos = _pop_pos.load(std::memory_order_relaxed);
+          }
+        }
+        value = std::move(c->value);
+        c->sequence.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+      }
+
+      /**
+       * Pushes the value, waiting while the queue is full; returns the
+       * time spent waiting.
+       */
+      std::chrono::microseconds push(T value) {
+        if(try_push(value)) return std::chrono::microseconds(0);
+        auto start = std::chrono::steady_clock::now();
+        queue_backoff backoff;
+        while(!try_push(value)) {
+          backoff.wait();
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+      }
+
+      /**
+       * Pops a value, waiting while the queue is empty. Returns false
+       * when the queue is closed and empty. The time spent waiting is
+       * added to `waited`.
+       */
+      bool pop(T& value, std::chrono::microseconds& waited) {
+        if(try_pop(value)) return true;
+        auto start = std::chrono::steady_clock::now();
+        queue_backoff backoff;
+        bool popped;
+        for(;;) {
+          if((popped = try_pop(value))) break;
+          if(_closed.load(std::memory_order_acquire)) {
+            // values pushed before the queue was closed are still popped
+            popped = try_pop(value);
+            break;
+          }
+          backoff.wait();
+        }
+        waited += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        return popped;
+      }
+
+      /**
+       * Wakes up the consumers waiting on an empty queue, to return
+       * false. Nothing may be pushed after the queue is closed.
+       */
+      void close() { _closed.store(true, std::memory_order_release); }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,108 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// byte_scan.cc
+// searches of bytes and strings in the raw html of the pages, several
+// bytes at a time with the vector instructions of the processor
+
+#include "byte_scan.hh"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+// the functions using the instructions are compiled for them, whatever
+// the flags of the build, and called only when the processor has them
+#define RANKTRACKER_BYTE_SCAN_X86
+#include <immintrin.h>
+#endif
+
+namespace ranktracker {
+  namespace engine {
+
+    static const char *find_bytes_scalar(const char *first, const char *last, const char *needle, std::size_t size) {
+      while(last - first >= (std::ptrdiff_t)size) {
+        const char *p = (const char *)std::memchr(first, needle[0], last - first - size + 1);
+        if(!p) break;
+        if(std::memcmp(p + 1, needle + 1, size - 1) == 0) return p;
+        first = p + 1;
+      }
+      return last;
+    }
+
+#ifdef RANKTRACKER_BYTE_SCAN_X86
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+
+    // the place of the first byte of the set in the blocks of 16 bytes;
+    // the bytes after the last full block are left to the caller
+    __attribute__((target("sse4.2")))
+    static const char *find_sse42(const char *bytes, int size, const char *first, const char *last) {
+      const __m128i set = _mm_loadu_si128((const __m128i *)bytes);
+      while(last - first >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)first);
+        int i = _mm_cmpestri(set, size, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(i < 16) return first + i;
+        first += 16;
+      }
+      return first;
+    }
+
+    // the places where the first and the last byte of the needle are,
+    // 32 at a time; only those are compared with the whole needle
+    __attribute__((target("avx2")))
+    static const char *find_bytes_avx2(const char *first, const char *last, const char *needle, std::size_t size) {
+      const __m256i head = _mm256_set1_epi8(needle[0]);
+      const __m256i tail = _mm256_set1_epi8(needle[size - 1]);
+      while(last - first >= (std::ptrdiff_t)(size - 1 + 32)) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)first);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(first + size - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, head), _mm256_cmpeq_epi8(b, tail)));
+        while(mask) {
+          int i = __builtin_ctz(mask);
+          if(std::memcmp(first + i + 1, needle + 1, size - 2) == 0) return first + i;
+          mask &= mask - 1;
+        }
+        first += 32;
+      }
+      return find_bytes_scalar(first, last, needle, size);
+    }
+#endif
+
+    byte_set::byte_set(const char *bytes) : _size(0) {
+      std::memset(_bytes, 0, sizeof(_bytes));
+      std::memset(_member, 0, sizeof(_member));
+      for(; *bytes && _size < 16; bytes++) {
+        _bytes[_size++] = *bytes;
+        _member[(unsigned char)*bytes] = true;
+      }
+    }
+
+    const char *byte_set::find(const char *first, const char *last) const {
+#ifdef RANKTRACKER_BYTE_SCAN_X86
+      if(has_sse42 && last - first >= 16) {
+        first = find_sse42(_bytes, _size, first, last);
+      }
+#endif
+      while(first < last && !contains(*first)) first++;
+      return first;
+    }
+
+    const char *find_bytes(const char *first, const char *last, const char *needle, std::size_t size) {
+      if(size == 0) return first;
+      if(size == 1) {
+        const char *p = (const char *)std::memchr(first, needle[0], last - first);
+        return p ? p : last;
+      }
+#ifdef RANKTRACKER_BYTE_SCAN_X86
+      if(has_avx2) return find_bytes_avx2(first, last, needle, size);
+#endif
+      return find_bytes_scalar(first, last, needle, size);
+    }
+
+    const char *byte_scan_instructions() {
+#ifdef RANKTRACKER_BYTE_SCAN_X86
+      if(has_avx2) return "avx2";
+      if(has_sse42) return "sse4.2";
+#endif
+      return "scalar";
+    }
+  }
+}
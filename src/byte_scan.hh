@@ -0,0 +1,52 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// byte_scan.hh
+// searches of bytes and strings in the raw html of the pages, several
+// bytes at a time with the vector instructions of the processor
+
+#ifndef RANKTRACKER_BYTE_SCAN_HH
+#define RANKTRACKER_BYTE_SCAN_HH
+
+#include <cstddef>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * A set of up to 16 bytes, looked for 16 bytes at a time with the
+     * SSE4.2 string instructions, or a byte at a time on the processors
+     * without them. The instructions are chosen when the program
+     * starts, so the same binary runs everywhere.
+     */
+    class byte_set {
+      char _bytes[16];
+      int _size;
+      bool _member[256];
+
+    public:
+      /**
+       * The bytes of a C string; the ones past the 16th are ignored.
+       */
+      explicit byte_set(const char *bytes);
+
+      bool contains(char c) const { return _member[(unsigned char)c]; }
+
+      /**
+       * The first byte of [first, last) in the set, or `last`.
+       */
+      const char *find(const char *first, const char *last) const;
+    };
+
+    /**
+     * The first occurrence of [needle, needle + size) in [first, last),
+     * or `last`; with AVX2 32 places are tried at a time.
+     */
+    const char *find_bytes(const char *first, const char *last, const char *needle, std::size_t size);
+
+    /**
+     * The instructions the searches use: "avx2", "sse4.2" or "scalar".
+     */
+    const char *byte_scan_instructions();
+  }
+}
+
+#endif
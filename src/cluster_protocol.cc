@@ -0,0 +1,190 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// cluster_protocol.cc
+// messages exchanged by the lease coordinator and the crawl workers
+
+#include "cluster_protocol.hh"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+
+namespace ranktracker {
+  namespace cluster {
+
+    namespace message {
+      const char * const HELLO = "HELLO";
+      const char * const LEASE = "LEASE";
+      const char * const UNIT = "UNIT";
+      const char * const WAIT = "WAIT";
+      const char * const RESULT = "RESULT";
+      const char * const FAIL = "FAIL";
+      const char * const STATS = "STATS";
+      const char * const WORKER = "WORKER";
+      const char * const END = "END";
+      const char * const BYE = "BYE";
+      const char * const OK = "OK";
+      const char * const EXPIRED = "EXPIRED";
+      const char * const ERROR = "ERROR";
+
+      const char * const THROTTLED = "throttled";
+      const char * const FAILED = "error";
+    }
+
+    std::string escape_field(const std::string& field) {
+      std::string escaped;
+      escaped.reserve(field.size());
+      for(char c: field) {
+        if(c == '%' || c == '\t' || c == '\r' || c == '\n') {
+          char code[4];
+          std::snprintf(code, sizeof(code), "%%%02X", (unsigned char)c);
+          escaped += code;
+        } else {
+          escaped += c;
+        }
+      }
+      return escaped;
+    }
+
+    std::string unescape_field(const std::string& field) {
+      std::string value;
+      value.reserve(field.size());
+      for(std::size_t i = 0; i < field.size(); i++) {
+        if(field[i] == '%' && i + 2 < field.size() &&
+           std::isxdigit((unsigned char)field[i + 1]) && std::isxdigit((unsigned char)field[i + 2])) {
+          char hex[3] = {field[i + 1], field[i + 2], 0};
+          value += (char)std::strtol(hex, NULL, 16);
+          i += 2;
+          continue;
+        }
+        value += field[i];
+      }
+      return value;
+    }
+
+    std::string format_message(const std::string& command, const std::vector<std::string>& fields) {
+      std::string line = command;
+      for(auto& f: fields) {
+        line += '\t';
+        line += escape_field(f);
+      }
+      line += '\n';
+      return line;
+    }
+
+    std::string format_query_cost(const ranktracker::engine::rank_query_result& result) {
+      using std::chrono::microseconds;
+      using std::chrono::duration_cast;
+      auto const& traffic = result.traffic;
+      std::vector<long long> values = {
+        (long long)traffic.pages,
+        (long long)traffic.http_status,
+        (long long)traffic.wire_bytes,
+        (long long)traffic.decoded_bytes,
+        (long long)traffic.name_lookup_time.count(),
+        (long long)traffic.connect_time.count(),
+        (long long)traffic.tls_time.count(),
+        (long long)traffic.first_byte_time.count(),
+        (long long)traffic.transfer_time.count(),
+        (long long)traffic.decode_time.count(),
+        (long long)duration_cast<microseconds>(result.fetch_time).count(),
+        (long long)duration_cast<microseconds>(result.extract_time).count(),
+        (long long)duration_cast<microseconds>(result.wait_time).count(),
+        (long long)duration_cast<microseconds>(result.total_time).count()
+      };
+      std::string field;
+      for(auto v: values) {
+        if(!field.empty()) field += ',';
+        field += std::to_string(v);
+      }
+      return field;
+    }
+
+    bool parse_query_cost(const std::string& field, ranktracker::engine::rank_query_result& result) {
+      using std::chrono::microseconds;
+      using std::chrono::milliseconds;
+      using std::chrono::duration_cast;
+      std::vector<long long> values;
+      const char *p = field.c_str();
+      for(;;) {
+        char *end;
+        long long v = std::strtoll(p, &end, 10);
+        if(end == p || v < 0) return false;
+        values.push_back(v);
+        if(*end == 0) break;
+        if(*end != ',') return false;
+        p = end + 1;
+      }
+      if(values.size() != 14) return false;
+
+      auto& traffic = result.traffic;
+      traffic.pages = values[0];
+      traffic.http_status = values[1];
+      traffic.wire_bytes = values[2];
+      traffic.decoded_bytes = values[3];
+      traffic.name_lookup_time = microseconds(values[4]);
+      traffic.connect_time = microseconds(values[5]);
+      traffic.tls_time = microseconds(values[6]);
+      traffic.first_byte_time = microseconds(values[7]);
+      traffic.transfer_time = microseconds(values[8]);
+      traffic.decode_time = microseconds(values[9]);
+      result.fetch_time = duration_cast<milliseconds>(microseconds(values[10]));
+      result.extract_time = duration_cast<milliseconds>(microseconds(values[11]));
+      result.wait_time = duration_cast<milliseconds>(microseconds(values[12]));
+      result.total_time = duration_cast<milliseconds>(microseconds(values[13]));
+      return true;
+    }
+
+    std::string format_serp(const std::vector<ranktracker::engine::serp_result>& serp) {
+      std::string field;
+      for(auto& r: serp) {
+        if(!field.empty()) field += '\n';
+        field += std::to_string(r.position);
+        field += ' ';
+        field += r.url;
+      }
+      return field;
+    }
+
+    bool parse_serp(const std::string& field, std::vector<ranktracker::engine::serp_result>& serp) {
+      serp.clear();
+      std::size_t start = 0;
+      while(start < field.size()) {
+        auto end = field.find('\n', start);
+        if(end == std::string::npos) end = field.size();
+        const char *p = field.c_str() + start;
+        char *sep;
+        long position = std::strtol(p, &sep, 10);
+        if(sep == p || *sep != ' ' || position < 1 || position > 100) return false;
+        std::size_t url = sep + 1 - field.c_str();
+        if(url >= end) return false;
+        serp.push_back({(ranktracker::engine::rank_result_type)position, field.substr(url, end - url)});
+        start = end + 1;
+      }
+      return true;
+    }
+
+    bool parse_message(const std::string& line, std::string& command, std::vector<std::string>& fields) {
+      std::string l = line;
+      while(!l.empty() && (l.back() == '\n' || l.back() == '\r')) l.pop_back();
+      command.clear();
+      fields.clear();
+      if(l.empty()) return false;
+
+      std::size_t start = 0;
+      bool first = true;
+      for(;;) {
+        std::size_t tab = l.find('\t', start);
+        std::string part = l.substr(start, tab == std::string::npos ? std::string::npos : tab - start);
+        if(first) {
+          command = part;
+          first = false;
+        } else {
+          fields.push_back(unescape_field(part));
+        }
+        if(tab == std::string::npos) break;
+        start = tab + 1;
+      }
+      return true;
+    }
+  }
+}
@@ -0,0 +1,114 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// cluster_protocol.hh
+// messages exchanged by the lease coordinator and the crawl workers
+
+#ifndef RANKTRACKER_CLUSTER_PROTOCOL_HH
+#define RANKTRACKER_CLUSTER_PROTOCOL_HH
+
+#include <string>
+#include <vector>
+
+#include "engines.hh"
+
+namespace ranktracker {
+  namespace cluster {
+
+    /**
+     * The workers talk to the coordinator over a TCP connection, one
+     * message per line. A message is a command followed by its fields,
+     * separated by tabs; '%', tabs and line ends inside the fields are
+     * percent encoded. Every request gets one reply:
+     *
+     *   HELLO <worker name>                 -> OK
+     *   LEASE [<paused engine id> ...]      -> UNIT <lease> <engine id> <domain> <keywords>
+     *                                                <max depth> <last rank>
+     *                                        | WAIT <seconds>
+     *   RESULT <lease> <rank> <page url> [<cost> [<results>]]
+     *                                       -> OK | EXPIRED
+     *   FAIL <lease> throttled|error        -> OK | EXPIRED
+     *   STATS                               -> WORKER <name> <address> <leased> <completed>
+     *                                                 <failed> <expired> <units per hour>
+     *                                          ... END
+     *   BYE                                 (closes the connection)
+     *
+     * A malformed request is answered with `ERROR <message>`. The
+     * engines a worker lists in LEASE are paused by its circuit
+     * breakers, so no units of those engines are leased to it. A lease
+     * not answered in time is given to another worker; the late answer
+     * is refused with EXPIRED, and so is the answer to a lease given on
+     * another connection. The optional cost of a RESULT is the
+     * telemetry of the query (see `format_query_cost`), followed by
+     * the results the query found (see `format_serp`).
+     */
+    namespace message {
+      extern const char * const HELLO;
+      extern const char * const LEASE;
+      extern const char * const UNIT;
+      extern const char * const WAIT;
+      extern const char * const RESULT;
+      extern const char * const FAIL;
+      extern const char * const STATS;
+      extern const char * const WORKER;
+      extern const char * const END;
+      extern const char * const BYE;
+      extern const char * const OK;
+      extern const char * const EXPIRED;
+      extern const char * const ERROR;
+
+      extern const char * const THROTTLED;
+      extern const char * const FAILED;
+    }
+
+    std::string escape_field(const std::string& field);
+    std::string unescape_field(const std::string& field);
+
+    /**
+     * Formats a message, with the line end.
+     */
+    std::string format_message(const std::string& command,
+                               const std::vector<std::string>& fields = std::vector<std::string>());
+
+    /**
+     * Splits a received line, with or without the line end, into the
+     * command and the decoded fields. Returns false for an empty line.
+     */
+    bool parse_message(const std::string& line, std::string& command, std::vector<std::string>& fields);
+
+    /**
+     * The cost of a ranking query as a RESULT field: comma separated
+     * pages, HTTP status, received and decoded bytes, then the times in
+     * microseconds: name lookup, connect, TLS, first byte, transfer,
+     * decode, fetch, extract, wait and total.
+     */
+    std::string format_query_cost(const ranktracker::engine::rank_query_result& result);
+
+    /**
+     * Reads the cost sent with a RESULT into `result`; returns false if
+     * the field is malformed.
+     */
+    bool parse_query_cost(const std::string& field, ranktracker::engine::rank_query_result& result);
+
+    /**
+     * The results found by a ranking query as a RESULT field: one line
+     * for each result, with its position and its url separated by a
+     * space.
+     */
+    std::string format_serp(const std::vector<ranktracker::engine::serp_result>& serp);
+
+    /**
+     * Reads the results sent with a RESULT into `serp`; returns false if
+     * the field is malformed.
+     */
+    bool parse_serp(const std::string& field, std::vector<ranktracker::engine::serp_result>& serp);
+
+    class protocol_exception {
+      std::string _message;
+    public:
+      protocol_exception(std::string message) : _message(message) {}
+
+      const std::string& message() const { return _message; }
+    };
+  }
+}
+
+#endif
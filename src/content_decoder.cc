@@ -0,0 +1,252 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// content_decoder.cc
+// streaming decompression of the compressed HTTP responses
+
+#include "content_decoder.hh"
+#include "logging.hh"
+
+#include <mutex>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+namespace ranktracker {
+  namespace engine {
+
+    // size of the decompressed chunks passed to the parser
+    static const std::size_t decoded_chunk_size = 16 * 1024;
+
+    transfer_stats& transfer_stats::operator+=(const transfer_stats& other) {
+      pages += other.pages;
+      wire_bytes += other.wire_bytes;
+      decoded_bytes += other.decoded_bytes;
+      decode_time += other.decode_time;
+      name_lookup_time += other.name_lookup_time;
+      connect_time += other.connect_time;
+      tls_time += other.tls_time;
+      first_byte_time += other.first_byte_time;
+      transfer_time += other.transfer_time;
+      if(other.http_status != 0) {
+        http_status = other.http_status;
+      }
+      return *this;
+    }
+
+    static std::mutex totals_mutex;
+    static transfer_stats totals;
+
+    void record_transfer(const transfer_stats& stats) {
+      std::lock_guard<std::mutex> lock(totals_mutex);
+      totals += stats;
+    }
+
+    transfer_stats transfer_totals() {
+      std::lock_guard<std::mutex> lock(totals_mutex);
+      return totals;
+    }
+
+    content_decoder::content_decoder(curl_write_callback target, void *target_data) :
+      _target(target),
+      _target_data(target_data),
+      _encoding(IDENTITY),
+      _started(false),
+      _finished(false),
+      _failed(false),
+      _zstream_init(false)
+#ifdef RT_WITH_BROTLI
+      , _brotli(NULL)
+#endif
+    {}
+
+    content_decoder::~content_decoder() {
+      reset();
+    }
+
+    void content_decoder::reset() {
+      if(_zstream_init) {
+        inflateEnd(&_zstream);
+        _zstream_init = false;
+      }
+#ifdef RT_WITH_BROTLI
+      if(_brotli) {
+        BrotliDecoderDestroyInstance(_brotli);
+        _brotli = NULL;
+      }
+#endif
+      _encoding = IDENTITY;
+      _started = false;
+      _finished = false;
+    }
+
+    const char *content_decoder::accepted_encodings() {
+#ifdef RT_WITH_BROTLI
+      return "br, gzip, deflate";
+#else
+      return "gzip, deflate";
+#endif
+    }
+
+    bool content_decoder::content_encoding(const std::string& value) {
+      reset();
+      std::string encoding = boost::algorithm::trim_copy(value);
+      if(encoding.empty() || boost::algorithm::iequals(encoding, "identity")) {
+        _encoding = IDENTITY;
+      } else if(boost::algorithm::iequals(encoding, "gzip") || boost::algorithm::iequals(encoding, "x-gzip")) {
+        _encoding = GZIP;
+      } else if(boost::algorithm::iequals(encoding, "deflate")) {
+        _encoding = DEFLATE;
+#ifdef RT_WITH_BROTLI
+      } else if(boost::algorithm::iequals(encoding, "br")) {
+        _encoding = BROTLI;
+#endif
+      } else {
+        BOOST_LOG_TRIVIAL(error) << "content_decoder: unsupported content encoding '" << encoding << "'\n";
+        _failed = true;
+        return false;
+      }
+      return true;
+    }
+
+    bool content_decoder::forward(const char *data, std::size_t len) {
+      _stats.decoded_bytes += len;
+      if(_target((char *)data, 1, len, _target_data) != len) {
+        _failed = true;
+        return false;
+      }
+      return true;
+    }
+
+    bool content_decoder::inflate_chunk(const char *data, std::size_t len) {
+      if(!_zstream_init) {
+        _zstream = z_stream();
+        // gzip and zlib streams are told apart by their header; "deflate"
+        // is sometimes sent as a raw deflate stream, without the zlib header
+        int window_bits = 15 + 32;
+        if(_encoding == DEFLATE) {
+          unsigned char b0 = data[0];
+          bool zlib_header = (b0 & 0x0f) == 8 &&
+            (len < 2 || ((b0 << 8) | (unsigned char)data[1]) % 31 == 0);
+          if(!zlib_header) window_bits = -15;
+        }
+        if(inflateInit2(&_zstream, window_bits) != Z_OK) {
+          BOOST_LOG_TRIVIAL(error) << "content_decoder: failed to init zlib\n";
+          return false;
+        }
+        _zstream_init = true;
+      }
+
+      unsigned char out[decoded_chunk_size];
+      _zstream.next_in = (Bytef *)data;
+      _zstream.avail_in = len;
+      while(_zstream.avail_in > 0 && !_finished) {
+        _zstream.next_out = out;
+        _zstream.avail_out = sizeof(out);
+
+        auto start = std::chrono::steady_clock::now();
+        int result = inflate(&_zstream, Z_NO_FLUSH);
+        _stats.decode_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+          BOOST_LOG_TRIVIAL(error) << "content_decoder: corrupted compressed body (zlib error " << result << ")\n";
+          return false;
+        }
+        std::size_t produced = sizeof(out) - _zstream.avail_out;
+        if(produced > 0 && !forward((const char *)out, produced)) return false;
+        if(result == Z_STREAM_END) _finished = true;
+        if(result == Z_BUF_ERROR && produced == 0) break;
+      }
+      return true;
+    }
+
+#ifdef RT_WITH_BROTLI
+    bool content_decoder::brotli_chunk(const char *data, std::size_t len) {
+      if(!_brotli) {
+        _brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+        if(!_brotli) {
+          BOOST_LOG_TRIVIAL(error) << "content_decoder: failed to init brotli\n";
+          return false;
+        }
+      }
+
+      unsigned char out[decoded_chunk_size];
+      const uint8_t *next_in = (const uint8_t *)data;
+      size_t avail_in = len;
+      for(;;) {
+        uint8_t *next_out = out;
+        size_t avail_out = sizeof(out);
+
+        auto start = std::chrono::steady_clock::now();
+        auto result = BrotliDecoderDecompressStream(_brotli, &avail_in, &next_in, &avail_out, &next_out, NULL);
+        _stats.decode_time += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        if(result == BROTLI_DECODER_RESULT_ERROR) {
+          BOOST_LOG_TRIVIAL(error) << "content_decoder: corrupted brotli body: "
+                                   << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(_brotli)) << std::endl;
+          return false;
+        }
+        std::size_t produced = sizeof(out) - avail_out;
+        if(produced > 0 && !forward((const char *)out, produced)) return false;
+        if(result == BROTLI_DECODER_RESULT_SUCCESS) {
+          _finished = true;
+          return true;
+        }
+        if(result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) return true;
+        // BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT: drain the decoder
+      }
+    }
+#else
+    bool content_decoder::brotli_chunk(const char *, std::size_t) {
+      return false;
+    }
+#endif
+
+    bool content_decoder::write(const char *data, std::size_t len) {
+      if(_failed) return false;
+      if(len == 0) return true;
+      _started = true;
+      _stats.wire_bytes += len;
+
+      bool ok;
+      switch(_encoding) {
+      case GZIP:
+      case DEFLATE:
+        ok = inflate_chunk(data, len);
+        break;
+      case BROTLI:
+        ok = brotli_chunk(data, len);
+        break;
+      default:
+        return forward(data, len);
+      }
+      if(!ok) _failed = true;
+      return ok;
+    }
+
+    bool content_decoder::finish() {
+      _stats.pages++;
+      if(_failed) return false;
+      if(_encoding != IDENTITY && _started && !_finished) {
+        BOOST_LOG_TRIVIAL(error) << "content_decoder: the compressed body is truncated\n";
+        return false;
+      }
+      return true;
+    }
+
+    size_t content_decoder::curl_write(char *ptr, size_t size, size_t nmemb, void *decoder) {
+      size_t len = size * nmemb;
+      return ((content_decoder *)decoder)->write(ptr, len) ? len : 0;
+    }
+
+    size_t content_decoder::curl_header(char *ptr, size_t size, size_t nmemb, void *decoder) {
+      size_t len = size * nmemb;
+      std::string line(ptr, len);
+      auto d = (content_decoder *)decoder;
+      if(boost::algorithm::starts_with(line, "HTTP/")) {
+        // status line of a new response: interim responses have no body
+        d->reset();
+      } else if(boost::algorithm::istarts_with(line, "content-encoding:")) {
+        d->content_encoding(line.substr(17));
+      }
+      return len;
+    }
+  }
+}
@@ -0,0 +1,143 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// content_decoder.hh
+// streaming decompression of the compressed HTTP responses, between
+// curl and the html parser
+
+#ifndef RANKTRACKER_CONTENT_DECODER_HH
+#define RANKTRACKER_CONTENT_DECODER_HH
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <curl/curl.h>
+#include <zlib.h>
+
+#ifdef RT_WITH_BROTLI
+#include <brotli/decode.h>
+#endif
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * Traffic of one or more page fetches. The network times are the
+     * ones measured by curl for each request, from the start of the
+     * request, added up over the pages.
+     */
+    struct transfer_stats {
+      std::size_t pages;
+      std::size_t wire_bytes;                 // response body bytes as received
+      std::size_t decoded_bytes;              // bytes passed to the parser
+      std::chrono::microseconds decode_time;  // time spent decompressing
+      std::chrono::microseconds name_lookup_time;
+      std::chrono::microseconds connect_time;
+      std::chrono::microseconds tls_time;     // until the TLS handshake was done
+      std::chrono::microseconds first_byte_time;
+      std::chrono::microseconds transfer_time; // until the last byte was received
+      long http_status;                       // of the last page
+
+      transfer_stats() :
+        pages(0),
+        wire_bytes(0),
+        decoded_bytes(0),
+        decode_time(0),
+        name_lookup_time(0),
+        connect_time(0),
+        tls_time(0),
+        first_byte_time(0),
+        transfer_time(0),
+        http_status(0)
+      {}
+
+      transfer_stats& operator+=(const transfer_stats& other);
+    };
+
+    /**
+     * Adds the traffic of a query to the totals of the application.
+     */
+    void record_transfer(const transfer_stats& stats);
+
+    /**
+     * The traffic of all the queries since the application start.
+     */
+    transfer_stats transfer_totals();
+
+    /**
+     * Decompresses a response body as it is received and passes the
+     * decompressed chunks to a curl write callback, without keeping the
+     * body in memory. The encoding is taken from the Content-Encoding
+     * header of the response; identity, gzip and deflate are supported,
+     * and brotli when built with RT_WITH_BROTLI.
+     *
+     * Use `curl_write` and `curl_header` as CURLOPT_WRITEFUNCTION and
+     * CURLOPT_HEADERFUNCTION, with the decoder as their data, and turn
+     * off curl's own decoding (CURLOPT_HTTP_CONTENT_DECODING).
+     */
+    class content_decoder {
+    public:
+      enum encoding_t {
+        IDENTITY,
+        GZIP,
+        DEFLATE,
+        BROTLI
+      };
+
+    private:
+      curl_write_callback _target;
+      void *_target_data;
+      encoding_t _encoding;
+      bool _started;
+      bool _finished;
+      bool _failed;
+      z_stream _zstream;
+      bool _zstream_init;
+#ifdef RT_WITH_BROTLI
+      BrotliDecoderState *_brotli;
+#endif
+      transfer_stats _stats;
+
+      bool forward(const char *data, std::size_t len);
+      bool inflate_chunk(const char *data, std::size_t len);
+      bool brotli_chunk(const char *data, std::size_t len);
+      void reset();
+
+    public:
+      content_decoder(curl_write_callback target, void *target_data);
+      ~content_decoder();
+
+      content_decoder(const content_decoder&) = delete;
+      content_decoder& operator=(const content_decoder&) = delete;
+
+      /**
+       * The value of the Accept-Encoding request header.
+       */
+      static const char *accepted_encodings();
+
+      /**
+       * Sets the encoding from the value of the Content-Encoding header;
+       * returns false for an unsupported encoding.
+       */
+      bool content_encoding(const std::string& value);
+
+      encoding_t encoding() const { return _encoding; }
+
+      /**
+       * Decodes a chunk of the body; returns false if the body is not
+       * correctly encoded or the target callback refused the data.
+       */
+      bool write(const char *data, std::size_t len);
+
+      /**
+       * Checks that a compressed body was complete.
+       */
+      bool finish();
+
+      const transfer_stats& stats() const { return _stats; }
+
+      static size_t curl_write(char *ptr, size_t size, size_t nmemb, void *decoder);
+      static size_t curl_header(char *ptr, size_t size, size_t nmemb, void *decoder);
+    };
+  }
+}
+
+#endif
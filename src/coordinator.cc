@@ -0,0 +1,460 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// coordinator.cc
+// hands out the units of the refresh queue to crawl workers running in
+// other processes or on other machines
+
+#include "coordinator.hh"
+#include "ranking.hh"
+
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+#include <boost/uuid/uuid_io.hpp>
+
+namespace ranktracker {
+  namespace cluster {
+
+    using boost::asio::ip::tcp;
+
+    double worker_stats::units_per_hour() const {
+      if(first_seen.is_not_a_date_time()) return 0;
+      auto seconds = (second_clock::local_time() - first_seen).total_seconds();
+      return seconds > 0 ? completed * 3600.0 / seconds : 0;
+    }
+
+    LeaseCoordinator::LeaseCoordinator(DataProvider& db, RefreshQueue& queue,
+                                       const coordinator_options& options) :
+      _db(db),
+      _queue(queue),
+      _options(options),
+      _acceptor(_io),
+      _stopping(false),
+      _next_lease(1),
+      _next_connection(1)
+    {}
+
+    LeaseCoordinator::~LeaseCoordinator() {
+      stop();
+    }
+
+    void LeaseCoordinator::start() {
+      tcp::endpoint endpoint(boost::asio::ip::address::from_string(_options.address), _options.port);
+      _acceptor.open(endpoint.protocol());
+      _acceptor.set_option(tcp::acceptor::reuse_address(true));
+      _acceptor.bind(endpoint);
+      _acceptor.listen();
+      BOOST_LOG_TRIVIAL(info) << "Lease coordinator listening on " << _options.address << ":" << _options.port
+                              << "; leases expire after " << _options.lease_timeout.count() << "s\n";
+
+      _accept_thread = std::thread(&LeaseCoordinator::accept_loop, this);
+      _reaper_thread = std::thread(&LeaseCoordinator::reaper_loop, this);
+    }
+
+    void LeaseCoordinator::stop() {
+      if(_stopping.exchange(true) || !_accept_thread.joinable()) return;
+      BOOST_LOG_TRIVIAL(trace) << "LeaseCoordinator::stop() called\n";
+
+      // a blocked accept is woken up by a connection
+      {
+        boost::system::error_code ec;
+        tcp::socket wake(_io);
+        auto endpoint = _acceptor.local_endpoint(ec);
+        if(!ec) {
+          if(endpoint.address().is_unspecified()) {
+            endpoint.address(boost::asio::ip::address_v4::loopback());
+          }
+          wake.connect(endpoint, ec);
+        }
+      }
+      _accept_thread.join();
+      boost::system::error_code ec;
+      _acceptor.close(ec);
+
+      // the reads of the connections are ended by the shutdown
+      std::unique_lock<std::mutex> lock(_mutex);
+      for(auto& c: _connections) {
+        c.second->shutdown(tcp::socket::shutdown_both, ec);
+      }
+      _changed.notify_all();
+      _changed.wait(lock, [this]() { return _connections.empty(); });
+      lock.unlock();
+      _reaper_thread.join();
+
+      release_leases(0);
+      for(auto& w: stats()) {
+        BOOST_LOG_TRIVIAL(info) << "Worker " << w.name << " (" << w.address << "): " << w.leased << " leased, "
+                                << w.completed << " completed, " << w.failed << " failed, " << w.expired
+                                << " expired, " << w.units_per_hour() << " units/hour\n";
+      }
+      BOOST_LOG_TRIVIAL(trace) << "LeaseCoordinator::stop() exit\n";
+    }
+
+    void LeaseCoordinator::accept_loop() {
+      for(;;) {
+        auto socket = std::make_shared<tcp::socket>(_io);
+        boost::system::error_code ec;
+        _acceptor.accept(*socket, ec);
+        if(_stopping) break;
+        if(ec) {
+          BOOST_LOG_TRIVIAL(error) << "Lease coordinator: accept failed: " << ec.message() << std::endl;
+          std::this_thread::sleep_for(std::chrono::seconds(1));
+          continue;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto connection = _next_connection++;
+        _connections[connection] = socket;
+        std::thread(&LeaseCoordinator::serve, this, connection, socket).detach();
+      }
+    }
+
+    void LeaseCoordinator::reaper_loop() {
+      auto next_report = std::chrono::steady_clock::now() + std::chrono::minutes(10);
+      std::unique_lock<std::mutex> lock(_mutex);
+      while(!_stopping) {
+        _changed.wait_for(lock, std::chrono::seconds(5));
+        if(_stopping) break;
+        lock.unlock();
+        auto now = std::chrono::steady_clock::now();
+        try {
+          expire(now);
+        } catch (DataProviderException) {
+          BOOST_LOG_TRIVIAL(error) << "Lease coordinator: database error while expiring the leases\n";
+        }
+        if(now >= next_report) {
+          next_report = now + std::chrono::minutes(10);
+          for(auto& w: stats()) {
+            BOOST_LOG_TRIVIAL(info) << "Worker " << w.name << ": " << w.completed << " completed, "
+                                    << w.failed << " failed, " << w.expired << " expired, "
+                                    << w.units_per_hour() << " units/hour\n";
+          }
+        }
+        lock.lock();
+      }
+    }
+
+    void LeaseCoordinator::serve(unsigned long connection, std::shared_ptr<tcp::socket> socket) {
+      boost::system::error_code ec;
+      std::string address = socket->remote_endpoint(ec).address().to_string();
+      std::string worker_name = address;
+      BOOST_LOG_TRIVIAL(info) << "Worker connected from " << address << std::endl;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        worker(worker_name).connections++;
+      }
+
+      boost::asio::streambuf input;
+      for(;;) {
+        boost::asio::read_until(*socket, input, '\n', ec);
+        if(ec || _stopping) break;
+
+        std::istream in(&input);
+        std::string line, command;
+        std::vector<std::string> fields;
+        std::getline(in, line);
+        if(!parse_message(line, command, fields)) continue;
+        if(command == message::BYE) break;
+
+        std::string previous_name = worker_name;
+        std::string reply;
+        try {
+          reply = handle(command, fields, worker_name, address, connection);
+        } catch (protocol_exception e) {
+          reply = format_message(message::ERROR, {e.message()});
+        } catch (DataProviderException) {
+          BOOST_LOG_TRIVIAL(error) << "Lease coordinator: database error while serving " << worker_name << std::endl;
+          reply = format_message(message::ERROR, {"database error"});
+        }
+        if(worker_name != previous_name) {
+          std::lock_guard<std::mutex> lock(_mutex);
+          worker(previous_name).connections--;
+          worker(worker_name).connections++;
+        }
+
+        boost::asio::write(*socket, boost::asio::buffer(reply), ec);
+        if(ec) break;
+      }
+
+      BOOST_LOG_TRIVIAL(info) << "Worker " << worker_name << " disconnected\n";
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        worker(worker_name).connections--;
+      }
+      // the units of a worker gone away are not waited for
+      if(!_stopping) {
+        try {
+          release_leases(connection);
+        } catch (DataProviderException) {
+          BOOST_LOG_TRIVIAL(error) << "Lease coordinator: database error while releasing the leases of "
+                                   << worker_name << std::endl;
+        }
+      }
+      socket->close(ec);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      _connections.erase(connection);
+      _changed.notify_all();
+    }
+
+    static unsigned long lease_id(const std::vector<std::string>& fields) {
+      try {
+        return boost::lexical_cast<unsigned long>(fields.at(0));
+      } catch (...) {
+        throw protocol_exception("bad lease id");
+      }
+    }
+
+    std::string LeaseCoordinator::handle(const std::string& command, const std::vector<std::string>& fields,
+                                         std::string& worker_name, const std::string& address,
+                                         unsigned long connection) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto& w = worker(worker_name);
+        w.last_seen = second_clock::local_time();
+        w.address = address;
+      }
+
+      if(command == message::HELLO) {
+        if(fields.empty() || fields[0].empty()) throw protocol_exception("missing worker name");
+        worker_name = fields[0];
+        BOOST_LOG_TRIVIAL(info) << "Worker at " << address << " is " << worker_name << std::endl;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto& w = worker(worker_name);
+        w.last_seen = second_clock::local_time();
+        w.address = address;
+        return format_message(message::OK);
+      }
+
+      if(command == message::LEASE) {
+        std::set<AbstractEntity::id_type> paused;
+        for(auto& f: fields) {
+          try {
+            paused.insert(boost::lexical_cast<AbstractEntity::id_type>(f));
+          } catch (boost::bad_lexical_cast) {
+            throw protocol_exception("bad engine id");
+          }
+        }
+        lease l;
+        std::string domain;
+        ranktracker::engine::query_options options;
+        if(!grant(worker_name, paused, l, domain, options, connection)) {
+          return format_message(message::WAIT, {std::to_string(_options.wait_hint.count())});
+        }
+        return format_message(message::UNIT, {std::to_string(l.id),
+              boost::uuids::to_string(l.unit._engid),
+              domain,
+              l.keyword.value(),
+              std::to_string(options.max_depth),
+              std::to_string(options.last_rank)});
+      }
+
+      if(command == message::RESULT) {
+        if(fields.size() < 3) throw protocol_exception("RESULT needs the lease, the rank and the page url");
+        ranktracker::engine::rank_result_type rank;
+        try {
+          rank = boost::lexical_cast<ranktracker::engine::rank_result_type>(fields[1]);
+        } catch (boost::bad_lexical_cast) {
+          throw protocol_exception("bad rank");
+        }
+        if(fields.size() > 3) {
+          ranktracker::engine::rank_query_result cost;
+          if(!parse_query_cost(fields[3], cost)) throw protocol_exception("bad query cost");
+          if(fields.size() > 4 && !parse_serp(fields[4], cost.serp)) throw protocol_exception("bad results");
+          QueryTelemetry telemetry(cost);
+          return format_message(complete(worker_name, connection, lease_id(fields), rank, fields[2],
+                                         &telemetry, &cost.serp) ?
+                                message::OK : message::EXPIRED);
+        }
+        return format_message(complete(worker_name, connection, lease_id(fields), rank, fields[2]) ?
+                              message::OK : message::EXPIRED);
+      }
+
+      if(command == message::FAIL) {
+        if(fields.size() < 2) throw protocol_exception("FAIL needs the lease and the failure");
+        return format_message(fail(worker_name, connection, lease_id(fields), fields[1] == message::THROTTLED) ?
+                              message::OK : message::EXPIRED);
+      }
+
+      if(command == message::STATS) {
+        std::string reply;
+        for(auto& w: stats()) {
+          std::ostringstream rate;
+          rate << w.units_per_hour();
+          reply += format_message(message::WORKER, {w.name, w.address,
+                std::to_string(w.leased), std::to_string(w.completed),
+                std::to_string(w.failed), std::to_string(w.expired), rate.str()});
+        }
+        return reply + format_message(message::END);
+      }
+
+      throw protocol_exception("unknown command " + command);
+    }
+
+    // expects the mutex to be locked
+    worker_stats& LeaseCoordinator::worker(const std::string& name) {
+      auto& w = _workers[name];
+      if(w.name.empty()) {
+        w.name = name;
+        w.first_seen = second_clock::local_time();
+        w.last_seen = w.first_seen;
+      }
+      return w;
+    }
+
+    bool LeaseCoordinator::grant(const std::string& worker_name,
+                                 const std::set<AbstractEntity::id_type>& paused,
+                                 lease& l,
+                                 std::string& domain,
+                                 ranktracker::engine::query_options& options,
+                                 unsigned long connection) {
+      auto available = [&paused](const AbstractEntity::id_type& engine_id) {
+        return paused.find(engine_id) == paused.end();
+      };
+      for(;;) {
+        if(_stopping || !_queue.claim(l.job, l.unit, available)) return false;
+
+        try {
+          auto const& e = ranktracker::engine::search_engines().at(l.unit._engid);
+          create_transaction trans(&_db, MDB_RDONLY);
+          l.keyword = _db.keyword(l.unit._kwdid);
+          auto d = _db.domain(l.unit._domid);
+          domain = d.name();
+          options = ranktracker::ranking::domain_query_options(_db, l.keyword, d, *e);
+          trans.commit();
+        } catch (NotFoundException) {
+          BOOST_LOG_TRIVIAL(warning) << "Keyword or domain of a queued refresh was deleted\n";
+          _queue.fail(l.job, l.unit);
+          continue;
+        } catch (std::out_of_range) {
+          BOOST_LOG_TRIVIAL(warning) << "Search engine of a queued refresh is not available\n";
+          _queue.fail(l.job, l.unit);
+          continue;
+        }
+        break;
+      }
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      l.id = _next_lease++;
+      l.worker = worker_name;
+      l.connection = connection;
+      l.deadline = std::chrono::steady_clock::now() + _options.lease_timeout;
+      _leases[l.id] = l;
+      worker(worker_name).leased++;
+      BOOST_LOG_TRIVIAL(trace) << "Lease " << l.id << " to " << worker_name << ": domain '" << domain
+                               << "', keywords '" << l.keyword.value() << "'\n";
+      return true;
+    }
+
+    bool LeaseCoordinator::complete(const std::string& worker_name, unsigned long connection, unsigned long lease_id,
+                                    ranktracker::engine::rank_result_type rank, const std::string& page_url,
+                                    const QueryTelemetry *telemetry,
+                                    const std::vector<ranktracker::engine::serp_result> *serp) {
+      lease l;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto i = _leases.find(lease_id);
+        if(i == _leases.end()) {
+          BOOST_LOG_TRIVIAL(warning) << "Worker " << worker_name << " answered the expired lease " << lease_id << std::endl;
+          return false;
+        }
+        if(i->second.connection != connection) {
+          BOOST_LOG_TRIVIAL(warning) << "Worker " << worker_name << " answered the lease " << lease_id
+                                     << " of " << i->second.worker << std::endl;
+          return false;
+        }
+        l = i->second;
+        _leases.erase(i);
+        worker(l.worker).completed++;
+      }
+      auto const& e = ranktracker::engine::search_engines().at(l.unit._engid);
+      _queue.complete(l.job, l.unit, l.keyword, *e, {second_clock::local_time(), rank, page_url}, telemetry,
+                      serp);
+      return true;
+    }
+
+    bool LeaseCoordinator::fail(const std::string& worker_name, unsigned long connection, unsigned long lease_id,
+                                bool throttled) {
+      lease l;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto i = _leases.find(lease_id);
+        if(i == _leases.end()) return false;
+        if(i->second.connection != connection) {
+          BOOST_LOG_TRIVIAL(warning) << "Worker " << worker_name << " failed the lease " << lease_id
+                                     << " of " << i->second.worker << std::endl;
+          return false;
+        }
+        l = i->second;
+        _leases.erase(i);
+        worker(l.worker).failed++;
+      }
+      if(throttled) {
+        BOOST_LOG_TRIVIAL(warning) << "Worker " << l.worker << " is throttled; lease " << lease_id
+                                   << " is put back in the queue\n";
+        _queue.release(l.job, l.unit);
+      } else {
+        _queue.fail(l.job, l.unit);
+      }
+      return true;
+    }
+
+    std::size_t LeaseCoordinator::expire(std::chrono::steady_clock::time_point now) {
+      std::vector<lease> expired;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto i = _leases.begin(); i != _leases.end(); ) {
+          if(i->second.deadline <= now) {
+            BOOST_LOG_TRIVIAL(warning) << "Lease " << i->first << " of " << i->second.worker
+                                       << " expired; the unit is put back in the queue\n";
+            worker(i->second.worker).expired++;
+            expired.push_back(i->second);
+            i = _leases.erase(i);
+          } else {
+            ++i;
+          }
+        }
+      }
+      for(auto& l: expired) {
+        _queue.release(l.job, l.unit);
+      }
+      return expired.size();
+    }
+
+    // the leases given on a connection, or all of them for 0
+    void LeaseCoordinator::release_leases(unsigned long connection) {
+      std::vector<lease> released;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto i = _leases.begin(); i != _leases.end(); ) {
+          if(connection == 0 || i->second.connection == connection) {
+            released.push_back(i->second);
+            i = _leases.erase(i);
+          } else {
+            ++i;
+          }
+        }
+      }
+      for(auto& l: released) {
+        _queue.release(l.job, l.unit);
+      }
+      if(!released.empty()) {
+        BOOST_LOG_TRIVIAL(info) << released.size() << " leases put back in the queue\n";
+      }
+    }
+
+    std::vector<worker_stats> LeaseCoordinator::stats() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<worker_stats> ws;
+      for(auto& w: _workers) {
+        ws.push_back(w.second);
+      }
+      return ws;
+    }
+
+    std::size_t LeaseCoordinator::open_leases() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _leases.size();
+    }
+  }
+}
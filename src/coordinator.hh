@@ -0,0 +1,183 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// coordinator.hh
+// hands out the units of the refresh queue to crawl workers running in
+// other processes or on other machines
+
+#ifndef RANKTRACKER_COORDINATOR_HH
+#define RANKTRACKER_COORDINATOR_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "data_provider.hh"
+#include "refresh_queue.hh"
+#include "cluster_protocol.hh"
+
+namespace ranktracker {
+  namespace cluster {
+    using namespace ranktracker::data;
+    using namespace ranktracker::persistence;
+    using ranktracker::ranking::RefreshQueue;
+
+    struct coordinator_options {
+      std::string address;                  // address to listen on
+      unsigned short port;
+      std::chrono::seconds lease_timeout;   // time a worker has to answer a lease
+      std::chrono::seconds wait_hint;       // polling interval suggested to idle workers
+
+      coordinator_options() :
+        address("0.0.0.0"),
+        port(7420),
+        lease_timeout(std::chrono::minutes(15)),
+        wait_hint(std::chrono::seconds(30))
+      {}
+    };
+
+    /**
+     * A refresh unit given to a worker.
+     */
+    struct lease {
+      unsigned long id;
+      RefreshJob job;
+      RefreshUnit unit;
+      Keyword keyword;
+      std::string worker;
+      unsigned long connection;     // connection the lease was given on
+      std::chrono::steady_clock::time_point deadline;
+    };
+
+    /**
+     * What the coordinator knows about a worker, by worker name.
+     */
+    struct worker_stats {
+      std::string name;
+      std::string address;              // of the last connection
+      std::size_t leased;
+      std::size_t completed;
+      std::size_t failed;
+      std::size_t expired;              // leases given to another worker after the timeout
+      std::size_t connections;          // connections opened now
+      ptime first_seen;
+      ptime last_seen;
+
+      worker_stats() : leased(0), completed(0), failed(0), expired(0), connections(0) {}
+
+      /**
+       * Completed rankings per hour since the worker first connected.
+       */
+      double units_per_hour() const;
+    };
+
+    /**
+     * Serves the units of the refresh queue to the crawl workers over
+     * TCP (see cluster_protocol.hh). The database stays in the
+     * coordinator's process: a worker gets the keywords, the domain and
+     * the engine of a unit, runs the ranking query and sends back the
+     * rank, which the coordinator stores. A lease not answered before
+     * its timeout, or held by a worker that disconnected, is put back in
+     * the queue for another worker.
+     *
+     * Each connection is served by its own thread; the rankings are
+     * stored through `RefreshQueue`, which opens its own transactions.
+     */
+    class LeaseCoordinator {
+      DataProvider& _db;
+      RefreshQueue& _queue;
+      coordinator_options _options;
+
+      boost::asio::io_service _io;
+      boost::asio::ip::tcp::acceptor _acceptor;
+      std::thread _accept_thread;
+      std::thread _reaper_thread;
+      std::atomic<bool> _stopping;
+
+      std::mutex _mutex;
+      std::condition_variable _changed;
+      unsigned long _next_lease;
+      std::map<unsigned long, lease> _leases;
+      std::map<std::string, worker_stats> _workers;
+      std::map<unsigned long, std::shared_ptr<boost::asio::ip::tcp::socket>> _connections;
+      unsigned long _next_connection;
+
+      void accept_loop();
+      void reaper_loop();
+      void serve(unsigned long connection, std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+      std::string handle(const std::string& command, const std::vector<std::string>& fields,
+                         std::string& worker, const std::string& address, unsigned long connection);
+      worker_stats& worker(const std::string& name);
+      void release_leases(unsigned long connection);
+
+    public:
+      LeaseCoordinator(DataProvider& db, RefreshQueue& queue,
+                       const coordinator_options& options = coordinator_options());
+      ~LeaseCoordinator();
+
+      LeaseCoordinator(const LeaseCoordinator&) = delete;
+      LeaseCoordinator& operator= (const LeaseCoordinator&) = delete;
+
+      /**
+       * Starts listening; throws `boost::system::system_error` if the
+       * address cannot be bound.
+       */
+      void start();
+
+      /**
+       * Closes the connections and puts the units of the open leases
+       * back in the queue.
+       */
+      void stop();
+
+      /**
+       * Leases the next unit of the queue to the worker, skipping the
+       * units of the paused engines. Returns false if there is no unit
+       * to lease. The lease is ended if the connection it was given on
+       * is closed. Must be called without a transaction opened.
+       */
+      bool grant(const std::string& worker,
+                 const std::set<AbstractEntity::id_type>& paused,
+                 lease& l,
+                 std::string& domain,
+                 ranktracker::engine::query_options& options,
+                 unsigned long connection = 0);
+
+      /**
+       * Stores the rank of a leased unit, with the cost and the results
+       * of its query when the worker sent them; returns false if the
+       * lease expired or was not given on this connection.
+       */
+      bool complete(const std::string& worker, unsigned long connection, unsigned long lease_id,
+                    ranktracker::engine::rank_result_type rank, const std::string& page_url,
+                    const QueryTelemetry *telemetry = nullptr,
+                    const std::vector<ranktracker::engine::serp_result> *serp = nullptr);
+
+      /**
+       * Ends a lease whose query failed: the unit is marked as failed,
+       * or put back in the queue if the engine throttled the worker.
+       * Returns false if the lease expired or was not given on this
+       * connection.
+       */
+      bool fail(const std::string& worker, unsigned long connection, unsigned long lease_id, bool throttled);
+
+      /**
+       * Puts back in the queue the units of the leases past their
+       * deadline; returns their number.
+       */
+      std::size_t expire(std::chrono::steady_clock::time_point now);
+
+      std::vector<worker_stats> stats();
+
+      std::size_t open_leases();
+    };
+  }
+}
+
+#endif
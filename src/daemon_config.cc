@@ -0,0 +1,192 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// daemon_config.cc
+// reading the configuration and schedule of the headless refresh daemon
+
+#include "daemon_config.hh"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace ranktracker {
+  namespace daemon {
+
+    static int parse_number(const std::string& s, const std::string& field) {
+      char *end;
+      long n = std::strtol(s.c_str(), &end, 10);
+      if(s.empty() || *end != '\0') {
+        throw config_exception("invalid number '" + s + "' in the cron field '" + field + "'");
+      }
+      return (int)n;
+    }
+
+    /**
+     * Sets in `bits` the values matched by a cron field; the values must
+     * be in [min, max]. When `sunday_7` is set, 7 is accepted and folded
+     * to 0 (day of week field).
+     */
+    template<std::size_t N>
+    static void parse_field(const std::string& field, int min, int max, std::bitset<N>& bits,
+                            bool sunday_7 = false) {
+      std::istringstream items(field);
+      std::string item;
+      while(std::getline(items, item, ',')) {
+        int step = 1;
+        auto slash = item.find('/');
+        if(slash != std::string::npos) {
+          step = parse_number(item.substr(slash + 1), field);
+          item = item.substr(0, slash);
+          if(step <= 0) {
+            throw config_exception("invalid step in the cron field '" + field + "'");
+          }
+        }
+
+        int first, last;
+        if(item == "*") {
+          first = min;
+          last = max;
+        } else {
+          auto dash = item.find('-');
+          if(dash != std::string::npos) {
+            first = parse_number(item.substr(0, dash), field);
+            last = parse_number(item.substr(dash + 1), field);
+          } else {
+            first = last = parse_number(item, field);
+            if(slash != std::string::npos) last = max; // "a/n" means from a to the end
+          }
+        }
+
+        int upper = sunday_7 ? max + 1 : max;
+        if(first < min || last > upper || first > last) {
+          throw config_exception("value out of range in the cron field '" + field + "'");
+        }
+        for(int v = first; v <= last; v += step) {
+          bits.set(sunday_7 && v == 7 ? 0 : v);
+        }
+      }
+    }
+
+    cron_expression::cron_expression(const std::string& minutes,
+                                     const std::string& hours,
+                                     const std::string& days,
+                                     const std::string& months,
+                                     const std::string& weekdays)
+      : _any_day(days == "*"), _any_weekday(weekdays == "*")
+    {
+      parse_field(minutes, 0, 59, _minutes);
+      parse_field(hours, 0, 23, _hours);
+      parse_field(days, 1, 31, _days);
+      parse_field(months, 1, 12, _months);
+      parse_field(weekdays, 0, 6, _weekdays, true);
+    }
+
+    bool cron_expression::matches(const std::tm& t) const {
+      if(!_minutes.test(t.tm_min) || !_hours.test(t.tm_hour) || !_months.test(t.tm_mon + 1)) {
+        return false;
+      }
+      // as in cron, when both days fields are restricted, either of them matches
+      bool day = _days.test(t.tm_mday);
+      bool weekday = _weekdays.test(t.tm_wday);
+      if(!_any_day && !_any_weekday) {
+        return day || weekday;
+      }
+      return day && weekday;
+    }
+
+    static void parse_line(const std::string& line, daemon_config& config) {
+      std::istringstream in(line);
+      std::string word;
+      if(!(in >> word)) return;
+
+      if(word == "concurrency") {
+        long n;
+        if(!(in >> n) || n < 0) throw config_exception("concurrency must be a number");
+        config.concurrency = (unsigned)n;
+      } else if(word == "parsers") {
+        long n;
+        if(!(in >> n) || n < 0) throw config_exception("parsers must be a number, 0 for one parser for each core");
+        config.parsers = (unsigned)n;
+      } else if(word == "listen") {
+        std::string endpoint;
+        if(!(in >> endpoint)) throw config_exception("listen needs a port or an address:port");
+        auto colon = endpoint.rfind(':');
+        std::string port = colon == std::string::npos ? endpoint : endpoint.substr(colon + 1);
+        if(colon != std::string::npos) config.listen_address = endpoint.substr(0, colon);
+        char *end;
+        long n = std::strtol(port.c_str(), &end, 10);
+        if(port.empty() || *end || n < 1 || n > 65535) throw config_exception("bad listen port '" + port + "'");
+        config.listen_port = (unsigned short)n;
+      } else if(word == "lease-timeout-minutes") {
+        long n;
+        if(!(in >> n) || n < 1) throw config_exception("lease-timeout-minutes must be a positive number");
+        config.lease_timeout_minutes = (unsigned)n;
+      } else if(word == "budget") {
+        long n;
+        if(!(in >> n) || n < 1) throw config_exception("budget must be a positive number");
+        config.schedule.budget = (std::size_t)n;
+      } else if(word == "max-staleness-hours") {
+        long n;
+        if(!(in >> n) || n < 1) throw config_exception("max-staleness-hours must be a positive number");
+        config.schedule.max_staleness = boost::posix_time::hours(n);
+      } else if(word == "run-interval-hours") {
+        long n;
+        if(!(in >> n) || n < 1) throw config_exception("run-interval-hours must be a positive number");
+        config.schedule.run_interval = boost::posix_time::hours(n);
+      } else {
+        std::string hours, days, months, weekdays, action;
+        if(!(in >> hours >> days >> months >> weekdays >> action)) {
+          throw config_exception("unknown setting '" + word + "'");
+        }
+        schedule_entry entry;
+        entry.when = cron_expression(word, hours, days, months, weekdays);
+
+        std::getline(in >> std::ws, entry.target);
+        auto end = entry.target.find_last_not_of(" \t\r");
+        entry.target.erase(end == std::string::npos ? 0 : end + 1);
+
+        if(action == "refresh-all") {
+          entry.action = schedule_entry::REFRESH_ALL;
+        } else if(action == "refresh-category") {
+          entry.action = schedule_entry::REFRESH_CATEGORY;
+        } else if(action == "refresh-domain") {
+          entry.action = schedule_entry::REFRESH_DOMAIN;
+        } else if(action == "scheduled-refresh") {
+          entry.action = schedule_entry::SCHEDULED_REFRESH;
+        } else {
+          throw config_exception("unknown action '" + action + "'");
+        }
+        if(entry.target.empty() &&
+           (entry.action == schedule_entry::REFRESH_CATEGORY || entry.action == schedule_entry::REFRESH_DOMAIN)) {
+          throw config_exception("action '" + action + "' needs a name");
+        }
+        config.entries.push_back(entry);
+      }
+    }
+
+    daemon_config load_daemon_config(const std::string& path) {
+      std::ifstream in(path);
+      if(!in) {
+        throw config_exception("can not open the configuration file " + path);
+      }
+
+      daemon_config config;
+      std::string line;
+      int line_no = 0;
+      while(std::getline(in, line)) {
+        line_no++;
+        auto comment = line.find('#');
+        if(comment != std::string::npos) line.erase(comment);
+        try {
+          parse_line(line, config);
+        } catch (config_exception e) {
+          throw config_exception(path + ":" + std::to_string(line_no) + ": " + e.message());
+        }
+      }
+      if(config.concurrency == 0 && config.listen_port == 0) {
+        throw config_exception(path + ": concurrency 0 leaves the refresh queue to the remote workers, "
+                               "but there is no listen setting");
+      }
+      return config;
+    }
+  }
+}
@@ -0,0 +1,118 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// daemon_config.hh
+// configuration and cron like schedule of the headless refresh daemon
+
+#ifndef RANKTRACKER_DAEMON_CONFIG_HH
+#define RANKTRACKER_DAEMON_CONFIG_HH
+
+#include <bitset>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "scheduler.hh"
+
+namespace ranktracker {
+  namespace daemon {
+
+    /**
+     * A cron time specification: minute, hour, day of month, month and
+     * day of week. Each field accepts `*`, numbers, ranges (`a-b`), steps
+     * (`*\/n`, `a-b/n`) and comma separated lists of those.
+     */
+    class cron_expression {
+      std::bitset<60> _minutes;
+      std::bitset<24> _hours;
+      std::bitset<32> _days;
+      std::bitset<13> _months;
+      std::bitset<7> _weekdays;
+      bool _any_day;
+      bool _any_weekday;
+
+    public:
+      cron_expression() : _any_day(true), _any_weekday(true) {}
+
+      /**
+       * Parses the five fields of the expression; throws
+       * `config_exception` for an invalid field.
+       */
+      cron_expression(const std::string& minutes,
+                      const std::string& hours,
+                      const std::string& days,
+                      const std::string& months,
+                      const std::string& weekdays);
+
+      /**
+       * Checks if the expression triggers in the minute of the given
+       * local time.
+       */
+      bool matches(const std::tm& t) const;
+    };
+
+    struct schedule_entry {
+      enum action_t {
+        REFRESH_ALL,        // all domains
+        REFRESH_CATEGORY,   // all domains of a category
+        REFRESH_DOMAIN,     // one domain
+        SCHEDULED_REFRESH   // the rankings selected by the RefreshScheduler
+      };
+
+      cron_expression when;
+      action_t action;
+      std::string target;   // category or domain name; optional category for SCHEDULED_REFRESH
+    };
+
+    /**
+     * Configuration of the daemon, read from a text file:
+     *
+     *   # comment
+     *   concurrency 2              # pages downloaded at the same time
+     *   parsers 0                  # page parsers; 0 for one for each core
+     *   listen 0.0.0.0:7420        # serve the queue to remote workers
+     *   lease-timeout-minutes 15   # time a remote worker has for a ranking
+     *   budget 300                 # result pages a day, what is left goes to scheduled-refresh
+     *   max-staleness-hours 168
+     *   run-interval-hours 24      # time between scheduled refreshes
+     *   0 3 * * *    refresh-all
+     *   30 6,18 * * * refresh-category <category name>
+     *   0 4 * * 1    refresh-domain <domain name>
+     *   0 2 * * *    scheduled-refresh [<category name>]
+     *
+     * `concurrency 0` turns off the local downloads, leaving the queue
+     * to the remote workers; it needs a `listen` setting.
+     */
+    struct daemon_config {
+      unsigned concurrency;
+      unsigned parsers;
+      std::string listen_address;       // address of the lease coordinator
+      unsigned short listen_port;       // 0 when the coordinator is not started
+      unsigned lease_timeout_minutes;
+      ranktracker::ranking::schedule_options schedule;
+      std::vector<schedule_entry> entries;
+
+      daemon_config() :
+        concurrency(1),
+        parsers(0),
+        listen_address("0.0.0.0"),
+        listen_port(0),
+        lease_timeout_minutes(15)
+      {}
+    };
+
+    class config_exception {
+      std::string _message;
+    public:
+      config_exception(std::string message) : _message(message) {}
+
+      const std::string& message() const { return _message; }
+    };
+
+    /**
+     * Reads the daemon configuration; throws `config_exception` if the
+     * file can not be read or has errors.
+     */
+    daemon_config load_daemon_config(const std::string& path);
+  }
+}
+
+#endif
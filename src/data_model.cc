@@ -3,6 +3,8 @@
 
 #include "data_model.hh"
 
+#include <limits>
+
 namespace ranktracker {
   namespace data {
     void Domain::insert_engine(const SearchEngineRef& engine) {
@@ -12,5 +14,40 @@ namespace ranktracker {
     void Domain::erase_engine(const SearchEngineRef& engine) {
       _engines.erase(engine);
     }
+
+    // saturates instead of wrapping around
+    template<class T, class V>
+    static T narrow(V value) {
+      return value < 0 ? 0 :
+        (std::uint64_t)value > std::numeric_limits<T>::max() ? std::numeric_limits<T>::max() : (T)value;
+    }
+
+    template<class Duration>
+    static std::uint32_t micros(Duration d) {
+      return narrow<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+    }
+
+    QueryTelemetry::QueryTelemetry() :
+      _pages(0), _http_status(0), _wire_bytes(0), _decoded_bytes(0),
+      _name_lookup(0), _connect(0), _tls(0), _first_byte(0), _transfer(0),
+      _decode(0), _fetch(0), _extract(0), _wait(0), _total(0)
+    {}
+
+    QueryTelemetry::QueryTelemetry(const ranktracker::engine::rank_query_result& result) :
+      _pages(narrow<std::uint16_t>(result.traffic.pages)),
+      _http_status(narrow<std::uint16_t>(result.traffic.http_status)),
+      _wire_bytes(narrow<std::uint32_t>(result.traffic.wire_bytes)),
+      _decoded_bytes(narrow<std::uint32_t>(result.traffic.decoded_bytes)),
+      _name_lookup(micros(result.traffic.name_lookup_time)),
+      _connect(micros(result.traffic.connect_time)),
+      _tls(micros(result.traffic.tls_time)),
+      _first_byte(micros(result.traffic.first_byte_time)),
+      _transfer(micros(result.traffic.transfer_time)),
+      _decode(micros(result.traffic.decode_time)),
+      _fetch(micros(result.fetch_time)),
+      _extract(micros(result.extract_time)),
+      _wait(micros(result.wait_time)),
+      _total(micros(result.total_time))
+    {}
   }
 }
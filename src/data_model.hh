@@ -5,6 +5,7 @@
 #ifndef RANKTRACKER_DATA_MODEL_HH
 #define RANKTRACKER_DATA_MODEL_HH
 
+#include <cstdint>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -17,6 +18,8 @@
 #include <boost/date_time/gregorian/greg_serialize.hpp>
 #include <boost/date_time/posix_time/time_serialize.hpp>
 #include <boost/serialization/unordered_set.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/version.hpp>
 
 #include "entity.hh"
 #include "engines.hh"
@@ -93,7 +96,7 @@ namespace ranktracker {
 
       template<class Archive>
       void serialize(Archive &ar, unsigned int version) {
-        if(version > 0)
+        if(version > 1)
           throw UnknownSerializationVersion(version);
 
         ar & boost::serialization::base_object<Entity>(*this);
@@ -101,12 +104,18 @@ namespace ranktracker {
         ar & _engines;
         ar & _createdDate;
         ar & _lastUpdateDate;
+        if(version > 0) {
+          ar & _maxDepth;
+          ar & _adaptiveDepth;
+        }
       }
 
       std::string _name;
       engines_set _engines;
       ptime _createdDate;
       ptime _lastUpdateDate;
+      unsigned _maxDepth = 100;     // results searched for the domain's rank
+      bool _adaptiveDepth = false;  // start the search on the page of the last rank
     public:
       Domain() : _createdDate(second_clock::local_time()) {}
 
@@ -122,6 +131,17 @@ namespace ranktracker {
         _createdDate(second_clock::local_time())
       {}
 
+      Domain(std::string name,
+             engines_set engines,
+             unsigned maxDepth,
+             bool adaptiveDepth) :
+        _name(name),
+        _engines(engines),
+        _createdDate(second_clock::local_time()),
+        _maxDepth(maxDepth),
+        _adaptiveDepth(adaptiveDepth)
+      {}
+
       Domain(id_type id,
              std::string name,
              engines_set engines,
@@ -142,6 +162,11 @@ namespace ranktracker {
       const ptime& createdDate() const { return _createdDate; }
       const ptime& lastUpdateDate() const { return _lastUpdateDate; }
 
+      unsigned maxDepth() const { return _maxDepth; }
+      void maxDepth(unsigned depth) { _maxDepth = depth; }
+      bool adaptiveDepth() const { return _adaptiveDepth; }
+      void adaptiveDepth(bool adaptive) { _adaptiveDepth = adaptive; }
+
       void insert_engine(const SearchEngineRef& engine);
       void erase_engine(const SearchEngineRef& engine);
     };
@@ -183,8 +208,163 @@ namespace ranktracker {
         ar & _page_url;
       }
     };
+
+    /**
+     * The cost of a ranking query, stored under the key of the ranking
+     * it produced. The times are in microseconds; the network times are
+     * the ones measured by curl, added up over the fetched pages.
+     */
+    struct QueryTelemetry {
+      std::uint16_t _pages;
+      std::uint16_t _http_status;     // of the last page
+      std::uint32_t _wire_bytes;
+      std::uint32_t _decoded_bytes;
+      std::uint32_t _name_lookup;
+      std::uint32_t _connect;
+      std::uint32_t _tls;
+      std::uint32_t _first_byte;
+      std::uint32_t _transfer;
+      std::uint32_t _decode;
+      std::uint32_t _fetch;           // downloading the pages, with the streamed parsing
+      std::uint32_t _extract;         // parsing and finding the results
+      std::uint32_t _wait;            // delays between the pages
+      std::uint32_t _total;
+
+      QueryTelemetry();
+      QueryTelemetry(const ranktracker::engine::rank_query_result& result);
+    private:
+      friend boost::serialization::access;
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int) {
+        ar & _pages;
+        ar & _http_status;
+        ar & _wire_bytes;
+        ar & _decoded_bytes;
+        ar & _name_lookup;
+        ar & _connect;
+        ar & _tls;
+        ar & _first_byte;
+        ar & _transfer;
+        ar & _decode;
+        ar & _fetch;
+        ar & _extract;
+        ar & _wait;
+        ar & _total;
+      }
+    };
+
+    /**
+     * The queries made on a day and the result pages they fetched,
+     * added up when their costs are stored.
+     */
+    struct DayCost {
+      std::uint32_t _queries;
+      std::uint32_t _pages;
+
+      DayCost() : _queries(0), _pages(0) {}
+    private:
+      friend boost::serialization::access;
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int) {
+        ar & _queries;
+        ar & _pages;
+      }
+    };
+
+    /**
+     * A result of a query, in the snapshot of all the results found by
+     * the query. The scheme and the host of the url are stored once, in
+     * the dictionary of hosts, and referred to by their id.
+     */
+    struct SerpEntry {
+      std::uint8_t _position;
+      std::uint32_t _host;            // id of the "scheme://host" of the url
+      std::string _path;              // the rest of the url
+    private:
+      friend boost::serialization::access;
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int) {
+        ar & _position;
+        ar & _host;
+        ar & _path;
+      }
+    };
+
+    typedef std::vector<SerpEntry> SerpSnapshot;
+
+    /**
+     * A refresh operation persisted as a list of (keyword, engine)
+     * units, so it can be resumed if the application stops before all
+     * the rankings were refreshed.
+     */
+    class RefreshJob : public Entity {
+      friend boost::serialization::access;
+
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int version) {
+        if(version > 0)
+          throw UnknownSerializationVersion(version);
+
+        ar & boost::serialization::base_object<Entity>(*this);
+        ar & _createdDate;
+        ar & _units;
+      }
+
+      ptime _createdDate;
+      std::size_t _units;
+    public:
+      RefreshJob() : _createdDate(second_clock::local_time()), _units(0) {}
+
+      const ptime& createdDate() const { return _createdDate; }
+      std::size_t units() const { return _units; }
+      void units(std::size_t units) { _units = units; }
+    };
+
+    struct RefreshUnitKey {
+      AbstractEntity::id_type _jobid, _kwdid, _engid;
+    private:
+      friend boost::serialization::access;
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int) {
+        ar & _jobid;
+        ar & _kwdid;
+        ar & _engid;
+      }
+    };
+
+    /**
+     * The refresh of the ranking of one keyword on one search engine,
+     * as part of a `RefreshJob`.
+     */
+    struct RefreshUnit {
+      enum state_t {
+        PENDING,
+        IN_FLIGHT,
+        DONE,
+        FAILED
+      };
+
+      AbstractEntity::id_type _kwdid, _engid, _domid;
+      std::size_t _seq;   // position of the unit in the job
+      state_t _state;
+      unsigned int _attempts;
+      ptime _updated;
+    private:
+      friend boost::serialization::access;
+      template<class Archive>
+      void serialize(Archive &ar, unsigned int) {
+        ar & _kwdid;
+        ar & _engid;
+        ar & _domid;
+        ar & _seq;
+        ar & _state;
+        ar & _attempts;
+        ar & _updated;
+      }
+    };
   }
 }
 
+BOOST_CLASS_VERSION(ranktracker::data::Domain, 1)
 
 #endif
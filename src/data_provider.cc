@@ -15,6 +15,7 @@
 #include <boost/stacktrace.hpp>
 
 #include <sstream>
+#include <algorithm>
 #include <cstring>
 #include <thread>
 
@@ -22,7 +23,7 @@ namespace ranktracker {
   namespace persistence {
     using namespace ranktracker::data;
 
-    int const maxdbs = 7;
+    int const maxdbs = 15;
     int const db_mapsize = RT_DB_MAPSIZE;
 
     char const * const dbname_categories = "categories";
@@ -32,6 +33,14 @@ namespace ranktracker {
     char const * const dbname_categorydomains = "categorydomains";
     char const * const dbname_domainkeywords = "domainkeywords";
     char const * const dbname_keywordranking = "keywordrankingv2";
+    char const * const dbname_refreshjobs = "refreshjobs";
+    char const * const dbname_refreshunits = "refreshunits";
+    char const * const dbname_jobunits = "jobunits";
+    char const * const dbname_telemetry = "telemetry";
+    char const * const dbname_daycost = "daycost";
+    char const * const dbname_serp = "serp";
+    char const * const dbname_hosts = "hosts";
+    char const * const dbname_hostnames = "hostnames";
 
     template <class DataObject, class Key = AbstractEntity::id_type>
     class Cursor {
@@ -82,6 +91,14 @@ namespace ranktracker {
         open_db(dbname_categorydomains, MDB_DUPSORT | MDB_DUPFIXED | MDB_CREATE, &dbi_categorydomains);
         open_db(dbname_domainkeywords, MDB_DUPSORT | MDB_DUPFIXED | MDB_CREATE, &dbi_domainkeywords);
         open_db(dbname_keywordranking, MDB_DUPSORT | MDB_DUPFIXED | MDB_CREATE, &dbi_keywordranking);
+        open_db(dbname_refreshjobs, MDB_CREATE, &dbi_refreshjobs);
+        open_db(dbname_refreshunits, MDB_CREATE, &dbi_refreshunits);
+        open_db(dbname_jobunits, MDB_DUPSORT | MDB_DUPFIXED | MDB_CREATE, &dbi_jobunits);
+        open_db(dbname_telemetry, MDB_CREATE, &dbi_telemetry);
+        open_db(dbname_daycost, MDB_CREATE, &dbi_daycost);
+        open_db(dbname_serp, MDB_CREATE, &dbi_serp);
+        open_db(dbname_hosts, MDB_CREATE, &dbi_hosts);
+        open_db(dbname_hostnames, MDB_CREATE, &dbi_hostnames);
         commit();
       } catch (...) {
         using namespace std;
@@ -230,6 +247,11 @@ namespace ranktracker {
 
     }
 
+    Domain DataProvider::domain(const AbstractEntity::id_type& id) const {
+      // expects a transaction to be opened
+      return get<Domain>(dbi_domains, id);
+    }
+
     /**
      * Loads the keywords for a domain from db. It expects a transaction
      * to be started.
@@ -273,6 +295,11 @@ namespace ranktracker {
       return crs.count();
     }
 
+    Keyword DataProvider::keyword(const AbstractEntity::id_type& id) const {
+      // expects a transaction to be opened
+      return get<Keyword>(dbi_keywords, id);
+    }
+
     /**
      * stores a keyword in the database
      */
@@ -390,6 +417,16 @@ namespace ranktracker {
       BOOST_LOG_TRIVIAL(trace) << "delete ranking keys\n";
       try {
         del<RankingKey>(dbi_ranking, {kwd_id, eng_id, ranking_date});
+        try {
+          del<RankingKey>(dbi_telemetry, {kwd_id, eng_id, ranking_date});
+        } catch (NotFoundException) {
+          // rankings stored before the telemetry was recorded
+        }
+        try {
+          del<RankingKey>(dbi_serp, {kwd_id, eng_id, ranking_date});
+        } catch (NotFoundException) {
+          // rankings stored before the results were recorded
+        }
         crs.get(key, ranking_date, MDB_NEXT_DUP);
         goto rankings_next;
       } catch (NotFoundException) {
@@ -403,6 +440,119 @@ namespace ranktracker {
       }
     }
 
+    void DataProvider::storeTelemetry(const Keyword& k,
+                                      ranktracker::engine::SearchEngine const &e,
+                                      const ptime& ranking_date,
+                                      const QueryTelemetry& telemetry) {
+      try {
+        put<QueryTelemetry, RankingKey>(dbi_telemetry, {k.id(), e.id(), ranking_date}, telemetry);
+        std::uint32_t day = ranking_date.date().day_number();
+        DayCost cost = day_cost(ranking_date.date());
+        cost._queries++;
+        cost._pages += telemetry._pages;
+        put<DayCost, std::uint32_t>(dbi_daycost, day, cost);
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to store the query telemetry for keyword: "
+                                 << k.value()
+                                 << std::endl;
+        throw;
+      }
+    }
+
+    std::vector<std::pair<RankingKey, QueryTelemetry>>
+    DataProvider::telemetry(const ptime& from, const ptime& to) const {
+      std::vector<std::pair<RankingKey, QueryTelemetry>> ts;
+      // the records are sorted by keyword, so all of them are read
+      Cursor<QueryTelemetry, RankingKey> crs(txn_ptr->get(), dbi_telemetry);
+      RankingKey key;
+      QueryTelemetry t;
+      try {
+        crs.get(key, t, MDB_FIRST);
+      telemetry_next:
+        if(key._ranking_date >= from && key._ranking_date < to) {
+          ts.push_back({key, t});
+        }
+        crs.get(key, t, MDB_NEXT);
+        goto telemetry_next;
+      } catch (NotFoundException) {
+        // successfully read all the records
+      }
+      return ts;
+    }
+
+    DayCost DataProvider::day_cost(const boost::gregorian::date& day) const {
+      try {
+        return get<DayCost, std::uint32_t>(dbi_daycost, day.day_number());
+      } catch (NotFoundException) {
+        // no query stored on that day
+        return DayCost();
+      }
+    }
+
+    void DataProvider::storeSerp(const Keyword& k,
+                                 ranktracker::engine::SearchEngine const &e,
+                                 const ptime& ranking_date,
+                                 const std::vector<ranktracker::engine::serp_result>& serp) {
+      try {
+        SerpSnapshot snapshot;
+        snapshot.reserve(serp.size());
+        for(auto& r: serp) {
+          // "scheme://host" and the rest of the url
+          auto scheme = r.url.find("://");
+          auto path = r.url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+          if(path == std::string::npos) path = r.url.size();
+          snapshot.push_back({(std::uint8_t)r.position, host_id(r.url.substr(0, path)), r.url.substr(path)});
+        }
+        put<SerpSnapshot, RankingKey>(dbi_serp, {k.id(), e.id(), ranking_date}, snapshot);
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to store the results of the query for keyword: "
+                                 << k.value()
+                                 << std::endl;
+        throw;
+      }
+    }
+
+    std::vector<ranktracker::engine::serp_result>
+    DataProvider::serp(const Keyword& k,
+                       ranktracker::engine::SearchEngine const &e,
+                       const ptime& ranking_date) const {
+      std::vector<ranktracker::engine::serp_result> serp;
+      SerpSnapshot snapshot;
+      try {
+        snapshot = get<SerpSnapshot, RankingKey>(dbi_serp, {k.id(), e.id(), ranking_date});
+      } catch (NotFoundException) {
+        // rankings stored before the results were recorded
+        return serp;
+      }
+      serp.reserve(snapshot.size());
+      for(auto& r: snapshot) {
+        serp.push_back({r._position, get<std::string, std::uint32_t>(dbi_hostnames, r._host) + r._path});
+      }
+      return serp;
+    }
+
+    /**
+     * The id of a host in the dictionary of the hosts of the results,
+     * added to it if it is a new one. Needs a write transaction.
+     */
+    std::uint32_t DataProvider::host_id(const std::string& host) {
+      try {
+        return get<std::uint32_t, std::string>(dbi_hosts, host);
+      } catch (NotFoundException) {
+        // a new host; the ids are given in sequence
+      }
+      MDB_stat db_stat;
+      int result = mdb_stat(txn_ptr->get(), dbi_hosts, &db_stat);
+      if(result != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Error trying to read the number of hosts: " << result << std::endl;
+        throw DataProviderException(DataProviderException::STAT, result);
+      }
+      std::uint32_t id = db_stat.ms_entries + 1;
+      put<std::uint32_t, std::string>(dbi_hosts, host, id);
+      put<std::string, std::uint32_t>(dbi_hostnames, id, host);
+      return id;
+    }
+
     Ranking DataProvider::last_ranking(const Keyword& k,
                                        ranktracker::engine::SearchEngine const &e) const {
       Cursor<ptime, KeywordEngine> crs(txn_ptr->get(), dbi_keywordranking);
@@ -523,6 +673,99 @@ namespace ranktracker {
       return prv;
     }
 
+    std::vector<RefreshJob> DataProvider::refresh_jobs() const {
+      std::vector<RefreshJob> jobs;
+      try {
+        // expects a transaction to be opened
+        Cursor<RefreshJob> crs(txn_ptr->get(), dbi_refreshjobs);
+        RefreshJob job;
+        AbstractEntity::id_type id;
+
+        crs.get(id, job, MDB_FIRST);
+        jobs.push_back(job);
+      refresh_jobs_next:
+        crs.get(id, job, MDB_NEXT);
+        jobs.push_back(job);
+        goto refresh_jobs_next;
+      } catch (NotFoundException) {
+        // read all the jobs
+      }
+      std::sort(jobs.begin(), jobs.end(), [](const RefreshJob& a, const RefreshJob& b) {
+          return a.createdDate() < b.createdDate();
+        });
+      return jobs;
+    }
+
+    void DataProvider::storeRefreshJob(const RefreshJob& job) {
+      try {
+        // expects a write transaction to be opened
+        put(dbi_refreshjobs, job.id(), job);
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to store refresh job\n";
+        throw;
+      }
+    }
+
+    void DataProvider::deleteRefreshJob(const RefreshJob& job) {
+      Cursor<KeywordEngine> crs(txn_ptr->get(), dbi_jobunits);
+      AbstractEntity::id_type job_id = job.id();
+      KeywordEngine ke;
+
+      try {
+        crs.get(job_id, ke, MDB_SET);
+      job_units_next:
+        try {
+          del<RefreshUnitKey>(dbi_refreshunits, {job.id(), ke._kwdid, ke._engid});
+        } catch (NotFoundException) {
+          BOOST_LOG_TRIVIAL(warning) << "refresh unit not found while deleting refresh job\n";
+        }
+        crs.get(job_id, ke, MDB_NEXT_DUP);
+        goto job_units_next;
+      } catch (NotFoundException) {
+        // deleted all the units
+      }
+
+      try {
+        del(dbi_jobunits, job.id());
+      } catch (NotFoundException) {
+        // a job without units
+      }
+      del(dbi_refreshjobs, job.id());
+    }
+
+    std::vector<RefreshUnit> DataProvider::refresh_units(const RefreshJob& job) const {
+      std::vector<RefreshUnit> units;
+      Cursor<KeywordEngine> crs(txn_ptr->get(), dbi_jobunits);
+      AbstractEntity::id_type job_id = job.id();
+      KeywordEngine ke;
+
+      try {
+        crs.get(job_id, ke, MDB_SET);
+      job_units_next:
+        units.push_back(get<RefreshUnit, RefreshUnitKey>(dbi_refreshunits,
+                                                         {job.id(), ke._kwdid, ke._engid}));
+        crs.get(job_id, ke, MDB_NEXT_DUP);
+        goto job_units_next;
+      } catch (NotFoundException) {
+        // read all the units of the job
+      }
+      std::sort(units.begin(), units.end(), [](const RefreshUnit& a, const RefreshUnit& b) {
+          return a._seq < b._seq;
+        });
+      return units;
+    }
+
+    void DataProvider::storeRefreshUnit(const RefreshJob& job, const RefreshUnit& unit) {
+      try {
+        // expects a write transaction to be opened
+        put<RefreshUnit, RefreshUnitKey>(dbi_refreshunits, {job.id(), unit._kwdid, unit._engid}, unit);
+        put<KeywordEngine>(dbi_jobunits, job.id(), {unit._kwdid, unit._engid});
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to store refresh unit\n";
+        throw;
+      }
+    }
+
     void DataProvider::create_env() {
       using namespace std;
 
@@ -34,6 +34,7 @@ namespace ranktracker {
         CLOSE_CURSOR,
         CURSOR_GET,
         CURSOR_DEL,
+        STAT,
       } db_call;
       int db_call_result;
 
@@ -68,6 +69,14 @@ namespace ranktracker {
       MDB_dbi dbi_categorydomains;
       MDB_dbi dbi_domainkeywords;
       MDB_dbi dbi_keywordranking;
+      MDB_dbi dbi_refreshjobs;
+      MDB_dbi dbi_refreshunits;
+      MDB_dbi dbi_jobunits;
+      MDB_dbi dbi_telemetry;
+      MDB_dbi dbi_daycost;
+      MDB_dbi dbi_serp;
+      MDB_dbi dbi_hosts;
+      MDB_dbi dbi_hostnames;
 
       void create_env();
       void set_mapsize(unsigned int mapsize = RT_DB_MAPSIZE);
@@ -97,6 +106,8 @@ namespace ranktracker {
       template<class K = AbstractEntity::id_type>
       void del(MDB_dbi dbi, const K& k);
 
+      std::uint32_t host_id(const std::string& host);
+
     public:
       void increase_mapsize();
 
@@ -150,6 +161,11 @@ namespace ranktracker {
        */
       void deleteDomain(const Domain& domain);
 
+      /**
+       * Load a domain by its id.
+       */
+      Domain domain(const AbstractEntity::id_type& id) const;
+
       /**
        * loads the keywords for a domain from db.
        */
@@ -157,6 +173,11 @@ namespace ranktracker {
 
       std::size_t countKeywords(const Domain& domain) const;
 
+      /**
+       * Load a keyword by its id.
+       */
+      Keyword keyword(const AbstractEntity::id_type& id) const;
+
       /**
        * stores a keyword in the database, adding it to a domain by
        * inserting a new record in the `domainkeywords` index; use
@@ -220,6 +241,73 @@ namespace ranktracker {
                     ranktracker::engine::SearchEngine const &e,
                     Ranking *last = nullptr,
                     Ranking *prev = nullptr) const;
+
+      /**
+       * stores the cost of the query that produced a ranking, under the
+       * key of the ranking, and adds it to the cost of its day
+       */
+      void storeTelemetry(const Keyword& k,
+                          ranktracker::engine::SearchEngine const &e,
+                          const ptime& ranking_date,
+                          const QueryTelemetry& telemetry);
+
+      /**
+       * get the query costs of the rankings made in the interval [from, to),
+       * for all keywords and engines
+       */
+      std::vector<std::pair<RankingKey, QueryTelemetry>> telemetry(const ptime& from, const ptime& to) const;
+
+      /**
+       * get the number of queries made on a day and of the pages they
+       * fetched, from the stored query costs
+       */
+      DayCost day_cost(const boost::gregorian::date& day) const;
+
+      /**
+       * stores all the results found by the query that produced a
+       * ranking, under the key of the ranking
+       */
+      void storeSerp(const Keyword& k,
+                     ranktracker::engine::SearchEngine const &e,
+                     const ptime& ranking_date,
+                     const std::vector<ranktracker::engine::serp_result>& serp);
+
+      /**
+       * get the results found by the query that produced a ranking; the
+       * rank of any domain in them is given by
+       * `ranktracker::engine::serp_rank`. Empty for the rankings stored
+       * before the results were recorded.
+       */
+      std::vector<ranktracker::engine::serp_result> serp(const Keyword& k,
+                                                         ranktracker::engine::SearchEngine const &e,
+                                                         const ptime& ranking_date) const;
+
+      /**
+       * Get all the refresh jobs stored in the database.
+       */
+      std::vector<RefreshJob> refresh_jobs() const;
+
+      /**
+       * Persist the definition of a refresh job.
+       */
+      void storeRefreshJob(const RefreshJob& job);
+
+      /**
+       * Delete a refresh job together with all its units.
+       */
+      void deleteRefreshJob(const RefreshJob& job);
+
+      /**
+       * Get the units of a refresh job, sorted in the order they were
+       * added to the job.
+       */
+      std::vector<RefreshUnit> refresh_units(const RefreshJob& job) const;
+
+      /**
+       * Add a unit to a refresh job or update the state of an existing
+       * unit.
+       */
+      void storeRefreshUnit(const RefreshJob& job, const RefreshUnit& unit);
     };
 
     class db_txn {
@@ -0,0 +1,159 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// domain_matcher.cc
+// matching of the result urls against the tracked domains
+
+#include "domain_matcher.hh"
+#include "url_canonicalizer.hh"
+
+#include <cctype>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/range/iterator_range.hpp>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * The parts of a url, as offsets in it: the scheme ends at
+     * `scheme_end` (npos if there is none), the host is
+     * [host_begin, host_end) and the path, with the query, starts at
+     * `path_begin`. A '&' ends the host too: google appends its
+     * parameters to the result urls.
+     */
+    struct url_parts {
+      std::size_t scheme_end;
+      std::size_t host_begin;
+      std::size_t host_end;
+      std::size_t path_begin;
+
+      url_parts(const std::string& url) {
+        scheme_end = url.find("://");
+        host_begin = scheme_end == std::string::npos ? 0 : scheme_end + 3;
+        path_begin = url.find_first_of("/?#&", host_begin);
+        if(path_begin == std::string::npos) path_begin = url.size();
+        auto at = url.find('@', host_begin);
+        if(at < path_begin) host_begin = at + 1;
+        host_end = url.find(':', host_begin);
+        if(host_end > path_begin) host_end = path_begin;
+        if(host_end > host_begin && url[host_end - 1] == '.') host_end--;
+      }
+    };
+
+    static char lower(char c) {
+      return std::tolower((unsigned char)c);
+    }
+
+    // the path of a url is `prefix` or one below it; paths are compared
+    // with their case
+    static bool under_path(const boost::iterator_range<std::string::const_iterator>& path,
+                           const std::string& prefix) {
+      if(!boost::algorithm::starts_with(path, prefix)) return false;
+      if(path.size() == prefix.size() || prefix.back() == '/') return true;
+      char c = path[prefix.size()];
+      return c == '/' || c == '?' || c == '#' || c == '&';
+    }
+
+    domain_matcher::domain_matcher() {
+      clear();
+    }
+
+    domain_matcher::domain_matcher(const std::vector<std::string>& domains) {
+      clear();
+      for(auto& d: domains) add(d);
+    }
+
+    void domain_matcher::clear() {
+      _patterns.clear();
+      _nodes.clear();
+      _nodes.push_back(node());
+    }
+
+    domain_matcher::pattern_id domain_matcher::add(const std::string& domain) {
+      url_parts parts(domain);
+      pattern p;
+      p.domain = domain;
+      if(parts.scheme_end != std::string::npos) {
+        for(std::size_t i = 0; i < parts.scheme_end; i++) p.scheme += lower(domain[i]);
+      }
+      // the path as it is in the canonical result urls
+      std::string canonical = url_canonicalizer::canonicalize(parts.scheme_end == std::string::npos ?
+                                                              "http://" + domain : domain);
+      p.path = canonical.substr(url_parts(canonical).path_begin);
+      if(p.path == "/") p.path.clear();
+      if(parts.host_end - parts.host_begin > 2 && domain.compare(parts.host_begin, 2, "*.") == 0) {
+        parts.host_begin += 2;
+      }
+
+      // the host, from its end
+      std::uint32_t n = 0;
+      for(std::size_t i = parts.host_end; i > parts.host_begin; i--) {
+        char c = lower(domain[i - 1]);
+        std::uint32_t child = 0;
+        for(auto& e: _nodes[n].next) {
+          if(e.first == c) {
+            child = e.second;
+            break;
+          }
+        }
+        if(child == 0) {
+          child = _nodes.size();
+          _nodes[n].next.push_back({c, child});
+          _nodes.push_back(node());
+        }
+        n = child;
+      }
+      pattern_id id = _patterns.size();
+      _patterns.push_back(p);
+      if(n != 0) _nodes[n].ends.push_back(id);
+      return id;
+    }
+
+    template<class F>
+    void domain_matcher::scan(const std::string& url, F found) const {
+      url_parts parts(url);
+      auto scheme = boost::make_iterator_range(url.begin(),
+                                               url.begin() + (parts.scheme_end == std::string::npos ?
+                                                              0 : parts.scheme_end));
+      auto path = boost::make_iterator_range(url.begin() + parts.path_begin, url.end());
+
+      std::uint32_t n = 0;
+      for(std::size_t i = parts.host_end; i > parts.host_begin; i--) {
+        char c = lower(url[i - 1]);
+        std::uint32_t child = 0;
+        for(auto& e: _nodes[n].next) {
+          if(e.first == c) {
+            child = e.second;
+            break;
+          }
+        }
+        if(child == 0) return;
+        n = child;
+
+        // a whole host, or a whole label of a subdomain
+        if(_nodes[n].ends.empty() || (i - 1 > parts.host_begin && url[i - 2] != '.')) continue;
+        for(auto id: _nodes[n].ends) {
+          auto const& p = _patterns[id];
+          if(!p.scheme.empty() && !boost::algorithm::iequals(scheme, p.scheme)) continue;
+          if(!p.path.empty() && !under_path(path, p.path)) continue;
+          if(found(id)) return;
+        }
+      }
+    }
+
+    void domain_matcher::match(const std::string& url, std::vector<pattern_id>& matches) const {
+      matches.clear();
+      scan(url, [&matches](pattern_id id) {
+          matches.push_back(id);
+          return false;
+        });
+    }
+
+    bool domain_matcher::matches(const std::string& url) const {
+      bool any = false;
+      scan(url, [&any](pattern_id) {
+          any = true;
+          return true;
+        });
+      return any;
+    }
+  }
+}
@@ -0,0 +1,85 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// domain_matcher.hh
+// matching of the result urls against the tracked domains, all the
+// domains at once
+
+#ifndef RANKTRACKER_DOMAIN_MATCHER_HH
+#define RANKTRACKER_DOMAIN_MATCHER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * The domains to look for in the results, compiled into a trie of
+     * their hosts read backwards, so the host of a result url is read
+     * once, from its end, whatever the number of domains.
+     *
+     * A domain is `[scheme://]host[/path]`. A url matches it if its host
+     * is the domain's host or one of its subdomains ("example.com"
+     * matches "www.example.com", not "myexample.com" or
+     * "example.com.au") and, when they are given, if its scheme is the
+     * domain's one and its path is the domain's path or one below it
+     * ("/blog" matches "/blog/post", not "/blogs"). The domain's path is
+     * put in the canonical form of the result urls (see
+     * `url_canonicalizer`), so "/blog/" and "/blog" are the same path.
+     * The hosts and the schemes are compared without case, the paths
+     * with it.
+     */
+    class domain_matcher {
+    public:
+      typedef std::size_t pattern_id;
+
+    private:
+      struct pattern {
+        std::string domain;
+        std::string scheme;     // lower case; empty for any scheme
+        std::string path;       // empty for any path
+      };
+
+      struct node {
+        std::vector<std::pair<char, std::uint32_t>> next;  // by the previous character of the host
+        std::vector<pattern_id> ends;                      // the domains whose host ends here
+      };
+
+      std::vector<pattern> _patterns;
+      std::vector<node> _nodes;
+
+    public:
+      domain_matcher();
+      explicit domain_matcher(const std::vector<std::string>& domains);
+
+      /**
+       * Adds a domain; returns its id, the number of domains added
+       * before it.
+       */
+      pattern_id add(const std::string& domain);
+
+      void clear();
+
+      std::size_t size() const { return _patterns.size(); }
+      const std::string& domain(pattern_id id) const { return _patterns[id].domain; }
+
+      /**
+       * Sets `matches` to the ids of all the domains the url matches.
+       */
+      void match(const std::string& url, std::vector<pattern_id>& matches) const;
+
+      /**
+       * True if the url matches any of the domains.
+       */
+      bool matches(const std::string& url) const;
+
+    private:
+      template<class F>
+      void scan(const std::string& url, F found) const;
+    };
+  }
+}
+
+#endif
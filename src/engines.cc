@@ -3,6 +3,10 @@
 // search engines related code
 
 #include "engines.hh"
+#include "replay_engine.hh"
+#include "page_classifier.hh"
+#include "serp_scanner.hh"
+#include "serp_layout.hh"
 #include <sstream>
 #include <iostream>
 
@@ -13,9 +17,12 @@
 #include <lexbor/dom/collection.h>
 #include <lexbor/dom/interfaces/element.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <thread>
-#include <boost/algorithm/string/predicate.hpp>
 
 namespace ranktracker {
   namespace engine {
@@ -54,141 +61,110 @@ namespace ranktracker {
     }
 
 
-    class dom_collection {
-      lxb_dom_collection_t *_col;
+    class html_document {
+      lxb_html_document_t *_doc;
     public:
-      dom_collection(lxb_dom_document_t *doc) {
-        _col = lxb_dom_collection_make(doc, 10);
+      html_document() {
+        _doc = lxb_html_document_create();
       }
 
-      ~dom_collection() {
-        lxb_dom_collection_destroy(_col, true);
+      html_document(html_document const&) = delete;
+      html_document& operator= (const html_document &) = delete;
+
+      ~html_document() {
+        if(_doc) lxb_html_document_destroy(_doc);
       }
 
-      lxb_dom_collection_t *operator() () {
-        return _col;
+      lxb_html_document_t *operator() () {
+        return _doc;
       }
     };
 
-    class html_document {
-      lxb_html_document_t *_doc;
+    /**
+     * The lexbor document and the element collection a thread parses
+     * the result pages with. They are created once per thread and
+     * reused for all its pages: the document is cleaned before each
+     * page, which keeps its parser, its memory pools and its tag and
+     * attribute tables, and the collection is emptied before each
+     * lookup instead of being allocated for it.
+     */
+    class dom_parser {
+      html_document _document;
+      lxb_dom_collection_t *_collection;
+
     public:
-      html_document() {
-        _doc = lxb_html_document_create();
+      dom_parser() : _collection(NULL) {
+        if(_document() != NULL) {
+          _collection = lxb_dom_collection_make(lxb_dom_interface_document(_document()), 16);
+        }
       }
 
-      html_document(html_document const&) = delete;
-      html_document& operator= (const html_document &) = delete;
+      dom_parser(const dom_parser&) = delete;
+      dom_parser& operator= (const dom_parser&) = delete;
 
-      void swap(html_document&& doc) {
-        std::swap(_doc, doc._doc);
+      ~dom_parser() {
+        if(_collection) lxb_dom_collection_destroy(_collection, true);
       }
 
-      ~html_document() {
-        lxb_html_document_destroy(_doc);
+      bool ready() const { return _collection != NULL; }
+
+      /**
+       * The document, emptied of the previous page.
+       */
+      lxb_html_document_t *new_page() {
+        lxb_html_document_clean(_document());
+        return _document();
       }
 
-      lxb_html_document_t *operator() () {
-        return _doc;
+      lxb_html_document_t *document() { return _document(); }
+
+      /**
+       * The collection, emptied, for a lookup in the document.
+       */
+      lxb_dom_collection_t *collection() {
+        lxb_dom_collection_clean(_collection);
+        return _collection;
       }
     };
 
-    lxb_dom_element_t *get_child(lxb_dom_document_t *document,
+    // the lexbor state of the calling thread; NULL if it could not be
+    // allocated
+    static dom_parser *thread_dom_parser() {
+      static thread_local dom_parser parser;
+      return parser.ready() ? &parser : NULL;
+    }
+
+    // the scanner of the calling thread, reused for its pages
+    static serp_scanner& thread_serp_scanner() {
+      static thread_local serp_scanner scanner;
+      return scanner;
+    }
+
+    lxb_dom_element_t *get_child(dom_parser& parser,
                                  lxb_dom_element_t *root,
                                  const lxb_char_t *tag_name,
                                  size_t tag_name_len,
                                  int idx) {
       lxb_status_t dom_status;
       lxb_dom_element_t *el;
-      dom_collection children(document);
-      if(children() == NULL) {
-        BOOST_LOG_TRIVIAL(error) << "Could not allocate dom collection on google_next_page function.\n";
-        throw dom_exception();
-      }
+      lxb_dom_collection_t *children = parser.collection();
       dom_status = lxb_dom_elements_by_tag_name(root,
-                                                children(),
+                                                children,
                                                 tag_name,
                                                 tag_name_len);
       if(dom_status != LXB_STATUS_OK) {
         BOOST_LOG_TRIVIAL(error) << "ERROR: failed to get the first div in the footer\n";
         throw dom_exception();
       }
-      el = lxb_dom_collection_element(children(), idx);
+      el = lxb_dom_collection_element(children, idx);
       return el;
     }
 
-    std::string google_next_page(lxb_html_document_t *document) {
-      assert(document != NULL);
-
-      lxb_html_body_element_t *body = lxb_html_document_body_element(document);
-      assert(body != NULL);
-
-      // the footer
-      lxb_dom_element_t *el = get_child(lxb_dom_interface_document(document),
-                                        lxb_dom_interface_element(body),
-                                        (const lxb_char_t *)"footer",
-                                        6,
-                                        0);
-      if(!el) throw next_link_not_found();
-      //serialize_node(lxb_dom_interface_node(el));
-
-      // footer->div(0)->div(0)->div(0)
-      el = get_child(lxb_dom_interface_document(document),
-                     el,
-                     (const lxb_char_t *)"div",
-                     3,
-                     2);
-      if(!el) throw next_link_not_found();
-      //serialize_node(lxb_dom_interface_node(el));
-
-      // footer(0)->div(0)->div(0)->div(0)->a(1)
-      lxb_dom_element_t *a = get_child(lxb_dom_interface_document(document),
-                                       el,
-                                       (const lxb_char_t *)"a",
-                                       1,
-                                       2);
-      if(a == NULL /* maybe we are on the second page */) {
-        // body->div(0)->footer(0)->div(0)->div(0)->div(0)->a(0)
-        a = get_child(lxb_dom_interface_document(document),
-                      el,
-                      (const lxb_char_t *)"a",
-                      1,
-                      1);
-      }
-
-      if(a == NULL /* maybe we are on the first page */) {
-        // body->div(0)->footer(0)->div(0)->div(0)->div(0)->a(0)
-        a = get_child(lxb_dom_interface_document(document),
-                      el,
-                      (const lxb_char_t *)"a",
-                      1,
-                      0);
-      }
-
-      if(a == NULL) {
-        BOOST_LOG_TRIVIAL(trace) << "no next link in google search response page\n";
-        throw next_link_not_found();
-      }
-
-      //serialize_node(lxb_dom_interface_node(a));
-
-      size_t href_len;
-      const lxb_char_t *href;
-      href = lxb_dom_element_get_attribute(a,
-                                           (const lxb_char_t *)"href",
-                                           4,
-                                           &href_len);
-      if(href_len && href) {
-        return std::string((const char *)href, href_len);
-      }
-      throw next_link_not_found();
-    }
-
-    lxb_dom_element_t *find_element_by_id(lxb_html_document_t *document, const std::string& id) {
-      dom_collection elements(lxb_dom_interface_document(document));
+    lxb_dom_element_t *find_element_by_id(dom_parser& parser, const std::string& id) {
+      lxb_dom_collection_t *elements = parser.collection();
       lxb_status_t dom_status;
-      dom_status = lxb_dom_elements_by_attr(lxb_dom_interface_element(document->body),
-                                            elements(),
+      dom_status = lxb_dom_elements_by_attr(lxb_dom_interface_element(parser.document()->body),
+                                            elements,
                                             (const lxb_char_t *)"id",
                                             2,
                                             (const lxb_char_t *)id.c_str(),
@@ -198,12 +174,70 @@ namespace ranktracker {
         return NULL;
       }
 
-      return lxb_dom_collection_element(elements(), 0);
+      return lxb_dom_collection_element(elements, 0);
+    }
+
+    /**
+     * Checks if a page without results is one of the pages google
+     * returns instead of the results when it throttles the queries.
+     */
+    void check_blocked_page(dom_parser& parser) {
+      lxb_html_document_t *document = parser.document();
+      if(find_element_by_id(parser, "captcha-form")) {
+        BOOST_LOG_TRIVIAL(warning) << "google returned a captcha page\n";
+        throw throttled_exception(throttled_exception::CAPTCHA);
+      }
+
+      lxb_html_body_element_t *body = lxb_html_document_body_element(document);
+      if(body == NULL) return;
+      for(int i = 0; ; i++) {
+        lxb_dom_element_t *form = get_child(parser,
+                                            lxb_dom_interface_element(body),
+                                            (const lxb_char_t *)"form",
+                                            4,
+                                            i);
+        if(form == NULL) break;
+
+        size_t action_len;
+        const lxb_char_t *action = lxb_dom_element_get_attribute(form,
+                                                                 (const lxb_char_t *)"action",
+                                                                 6,
+                                                                 &action_len);
+        if(action && action_len &&
+           std::string((const char *)action, action_len).find("consent.") != std::string::npos) {
+          BOOST_LOG_TRIVIAL(warning) << "google returned a consent page\n";
+          throw throttled_exception(throttled_exception::CONSENT);
+        }
+      }
+    }
+
+    // the result page being received
+    struct page_receiver {
+      lxb_html_document_t *document;
+      serp_scanner *scanner;    // instead of the document, for the streaming parser
+      page_classifier classifier;
+    };
+
+    [[noreturn]] static void throw_blocked_page(page_classifier::verdict_t verdict) {
+      BOOST_LOG_TRIVIAL(warning) << "google returned a " << page_classifier::verdict_name(verdict)
+                                 << " page instead of the results\n";
+      throw throttled_exception(verdict == page_classifier::CONSENT ?
+                                throttled_exception::CONSENT :
+                                throttled_exception::CAPTCHA);
     }
 
     size_t rcv_google_chunk(char *ptr, size_t, size_t nmemb, void *userdata) {
-      lxb_html_document_t *doc = (lxb_html_document_t *)userdata;
-      lxb_status_t result = lxb_html_document_parse_chunk(doc, (const lxb_char_t *)ptr, nmemb);
+      page_receiver *page = (page_receiver *)userdata;
+      page->classifier.feed(ptr, nmemb);
+      if(page->classifier.blocked()) {
+        // abort the transfer; the query reports the blocked page
+        return 0;
+      }
+      if(page->scanner) {
+        page->scanner->feed(ptr, nmemb);
+        return nmemb;
+      }
+      lxb_status_t result = lxb_html_document_parse_chunk(page->document, (const lxb_char_t *)ptr, nmemb);
 
       if(result != LXB_STATUS_OK) {
         BOOST_LOG_TRIVIAL(error) << "Error: failed to parse html chunk from google\n";
@@ -213,190 +247,606 @@ namespace ranktracker {
       return nmemb;
     }
 
-    bool is_my_domain(const std::string &domain, const std::string &result_url) {
-      return boost::algorithm::istarts_with(result_url, domain);
+    rank_result_type serp_rank(const std::vector<serp_result>& serp, const std::string& domain,
+                               std::string *page_url) {
+      domain_matcher mine;
+      mine.add(domain);
+      for(auto& r: serp) {
+        if(mine.matches(r.url)) {
+          if(page_url) *page_url = r.url;
+          return r.position;
+        }
+      }
+      return -1;
     }
 
-    bool is_result_line(lxb_dom_node_t *node, std::string& result_url) {
-      BOOST_LOG_TRIVIAL(trace) << "is_result_line() called\n";
-      if(node->type != LXB_DOM_NODE_TYPE_ELEMENT) {
-        BOOST_LOG_TRIVIAL(trace) << "is_reuslt_line(): node type is not an element\n";
-        BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-        return false;
+    std::vector<rank_result_type> serp_ranks(const std::vector<serp_result>& serp, const domain_matcher& domains) {
+      std::vector<rank_result_type> ranks(domains.size(), -1);
+      std::vector<domain_matcher::pattern_id> matches;
+      for(auto& r: serp) {
+        domains.match(r.url, matches);
+        for(auto id: matches) {
+          if(ranks[id] == -1 || r.position < ranks[id]) ranks[id] = r.position;
+        }
       }
-      if(node->first_child == NULL ||
-         node->first_child->type != LXB_DOM_NODE_TYPE_ELEMENT) {
-        BOOST_LOG_TRIVIAL(trace) << "is_reuslt_line(): first child is not an element\n";
-        BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-        return false;
+      return ranks;
+    }
+
+    rank_result_type
+    SearchEngine::perform_rank_query(std::string domain,
+                                     std::string keywords,
+                                     progress_updater& p,
+                                     std::string* page_url,
+                                     const query_options& options,
+                                     rank_query_result *details) const {
+      auto result = query(domain, keywords, p, options);
+      if(page_url) *page_url = result.page_url;
+      if(details) *details = result;
+      return result.rank;
+    }
+
+    // the result page downloaded for a parser running apart from curl
+    struct page_buffer {
+      page_body *body;
+      page_classifier classifier;
+    };
+
+    size_t rcv_page_buffer(char *ptr, size_t, size_t nmemb, void *userdata) {
+      page_buffer *page = (page_buffer *)userdata;
+      page->classifier.feed(ptr, nmemb);
+      if(page->classifier.blocked()) {
+        return 0;
       }
-      if(node->first_child->first_child == NULL ||
-         node->first_child->first_child->type != LXB_DOM_NODE_TYPE_ELEMENT) {
-        BOOST_LOG_TRIVIAL(trace) << "is_reuslt_line(): first child of first child is not an element\n";
-        BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-        return false;
+      page->body->append(ptr, nmemb);
+      return nmemb;
+    }
+
+    // the matcher of the calling thread, for the pages parsed by lexbor
+    static serp_matcher& thread_serp_matcher() {
+      static thread_local serp_matcher matcher;
+      return matcher;
+    }
+
+    /**
+     * Looks at the results of a parsed page, up to `limit` of them, for
+     * the domain: the rules of the layout are evaluated on the nodes of
+     * the document, in one pass.
+     */
+    serp_page extract_page(dom_parser& parser, const std::string& domain, int limit) {
+      serp_matcher& matcher = thread_serp_matcher();
+      matcher.reset(domain, limit);
+
+      // the values of the attributes the layout needs, for each element
+      auto const& names = matcher.layout().attributes();
+      static thread_local std::vector<std::string> values;
+      static thread_local std::vector<const std::string *> set;
+      values.resize(names.size());
+      set.resize(names.size());
+
+      std::string tag;
+      lxb_dom_node_t *root = lxb_dom_interface_node(parser.document());
+      lxb_dom_node_t *node = root->first_child;
+      while(node != NULL && !matcher.done()) {
+        if(node->type == LXB_DOM_NODE_TYPE_ELEMENT) {
+          lxb_dom_element_t *element = lxb_dom_interface_element(node);
+          size_t len;
+          const lxb_char_t *name = lxb_dom_element_local_name(element, &len);
+          tag.assign((const char *)name, name ? len : 0);
+          for(std::size_t i = 0; i < names.size(); i++) {
+            const lxb_char_t *value = lxb_dom_element_get_attribute(element,
+                                                                    (const lxb_char_t *)names[i].c_str(),
+                                                                    names[i].size(),
+                                                                    &len);
+            if(value) {
+              values[i].assign((const char *)value, len);
+              set[i] = &values[i];
+            } else {
+              set[i] = NULL;
+            }
+          }
+          matcher.start(tag, set, false);
+          if(node->first_child != NULL) {
+            node = node->first_child;
+            continue;
+          }
+          matcher.end();
+        } else if(node->type == LXB_DOM_NODE_TYPE_TEXT || node->type == LXB_DOM_NODE_TYPE_COMMENT) {
+          matcher.text();
+        }
+
+        // the next node, closing the elements left
+        while(node != root && node->next == NULL) {
+          node = node->parent;
+          if(node != root) matcher.end();
+        }
+        node = node == root ? NULL : node->next;
       }
-      if(node->first_child->first_child->first_child == NULL ||
-         node->first_child->first_child->first_child->type != LXB_DOM_NODE_TYPE_ELEMENT) {
-        BOOST_LOG_TRIVIAL(trace) << "is_reuslt_line(): first child of first child of first child "
-          "is not an element\n";
-        BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-        return false;
+
+      serp_page page = matcher.finish();
+      if(!matcher.page_seen()) {
+        BOOST_LOG_TRIVIAL(warning) << "extract_page(): the page rule of the SERP layout "
+                                   << matcher.layout().source() << " does not match the page\n";
+        check_blocked_page(parser);
+        // not a results page: the rank is unknown, not "over 100"
+        throw unrecognized_page_exception();
       }
+      return page;
+    }
 
-      size_t href_len;
-      const lxb_char_t *href;
-      href = lxb_dom_element_get_attribute(lxb_dom_interface_element(node->first_child->
-                                                                     first_child->first_child),
-                                           (const lxb_char_t *)"href",
-                                           4,
-                                           &href_len);
-      if(href_len && href) {
-        std::string candidate_url((const char *)href, href_len);
-        BOOST_LOG_TRIVIAL(trace) << "is_result_line() found candidate url:"
-                                 << candidate_url << std::endl;
-        if(boost::algorithm::istarts_with(candidate_url, "/url?q=http")) {
-          result_url = candidate_url.substr(7);
-          BOOST_LOG_TRIVIAL(trace) << "is_result_line() found result url: "
-                                   << result_url << std::endl;
-          BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-          return true;
-        }
+    // the `start` parameter of a result page link: the number of results
+    // before the page; `otherwise` if the link has none
+    static int link_start(const std::string& link, int otherwise) {
+      std::size_t p = link.find("start=");
+      while(p != std::string::npos && (p == 0 || (link[p - 1] != '?' && link[p - 1] != '&'))) {
+        p = link.find("start=", p + 1);
       }
-      BOOST_LOG_TRIVIAL(trace) << "is_result_line() result url not found\n";
-      BOOST_LOG_TRIVIAL(trace) << "is_result_line() exit\n";
-      return false;
+      if(p == std::string::npos) return otherwise;
+      const char *digits = link.c_str() + p + 6;
+      char *end;
+      long start = std::strtol(digits, &end, 10);
+      return end == digits || start < 0 ? otherwise : (int)std::min(start, 1000L);
     }
 
+    serp_walk::serp_walk(const std::string& base_url,
+                         const std::string& search_url,
+                         int depth,
+                         unsigned per_page,
+                         rank_result_type last_rank) :
+      _base_url(base_url),
+      _search_url(per_page > 10 ? search_url + "&num=" + std::to_string(per_page) : search_url),
+      _next_url(_search_url),
+      _depth(std::max(1, std::min(100, depth))),
+      _per_page(per_page),
+      _crt_rank(0),
+      _searched(0),
+      _pages(0),
+      _short_first_page(false),
+      _rank(-1),
+      _adaptive_start(0),
+      _adaptive_page(false)
+    {
+      if(last_rank > 10 && last_rank <= _depth) {
+        // the page of 10 results the last rank is on, whatever the size
+        // of the pages of the walk
+        _adaptive_start = (last_rank - 1) / 10 * 10;
+        _adaptive_page = true;
+        _crt_rank = _adaptive_start;
+        _next_url = search_url + "&start=" + std::to_string(_adaptive_start);
+        BOOST_LOG_TRIVIAL(trace) << "serp_walk: adaptive search from rank " << _adaptive_start << std::endl;
+      }
+    }
 
-    rank_result_type
-    GoogleEngine::perform_rank_query(std::string domain,
-                                     std::string keywords,
-                                     progress_updater& p,
-                                     std::string* page_url) const {
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): enter\n";
-      auto curl_session = curl_easy_init();
-      if(curl_session == NULL) {
-        BOOST_LOG_TRIVIAL(error) << "GoogleEngine::perform_rank_query(): curl session could not be initialized\n";
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
-        throw http_init_exception();
+    bool serp_walk::page_done(const serp_page& page) {
+      _pages++;
+      _short_first_page = false;
+      bool adaptive_page = _adaptive_page;
+      _adaptive_page = false;
+
+      // the positions follow from the start of the page, not from the
+      // results of the pages before it, which may have fewer than 10
+      bool ordered = _serp.empty() || _serp.back().position <= _crt_rank;
+      for(std::size_t i = 0; i < page.urls.size(); i++) {
+        _serp.push_back({_crt_rank + (rank_result_type)i + 1, page.urls[i]});
+      }
+      if(!ordered) {
+        // the first pages are searched after the page of the last rank
+        std::stable_sort(_serp.begin(), _serp.end(), [](const serp_result& a, const serp_result& b) {
+            return a.position < b.position;
+          });
+      }
+      _searched += page.results;
+      if(page.found) {
+        _rank = _crt_rank + page.results;
+        _page_url = page.page_url;
+        return false;
+      }
+      if(adaptive_page) {
+        BOOST_LOG_TRIVIAL(trace) << "serp_walk: the domain left the page of its last rank; "
+                                 << "searching from the first page\n";
+        if(_per_page == 10) {
+          // the walk skips this page, and goes on from its next link
+          _adaptive_next = page.next_link;
+        } else {
+          // the large pages have its results again
+          _serp.clear();
+          _adaptive_start = 0;
+        }
+        _crt_rank = 0;
+        _next_url = _search_url;
+        return true;
+      }
+      if(page.next_link.empty()) {
+        return false;
+      }
+
+      if(_per_page > 10 && _crt_rank == 0 && page.results <= 10) {
+        _short_first_page = true;
+      }
+      std::string next_link = page.next_link;
+      int next = link_start(next_link, _crt_rank + page.results);
+      if(_adaptive_start > 0 && next == _adaptive_start) {
+        // the next page was searched first; skip it
+        if(_adaptive_next.empty()) return false;
+        next_link = _adaptive_next;
+        next = link_start(next_link, _adaptive_start + 10);
+      }
+      if(next <= _crt_rank || next >= _depth) {
+        // the depth is reached, or the link goes back to the pages searched
+        return false;
       }
 
+      BOOST_LOG_TRIVIAL(trace) << "did not reach the max rank and the domain was not found yet.\n";
+      _crt_rank = next;
+      _next_url = _base_url + next_link;
+      return true;
+    }
+
+    serp_walk GoogleEngine::start_walk(CURL *session, const std::string& keywords,
+                                       const query_options& options) const {
       std::stringstream search_url;
-      auto escaped_keywords = curl_easy_escape(curl_session, keywords.c_str(), keywords.length());
+      auto escaped_keywords = curl_easy_escape(session, keywords.c_str(), keywords.length());
       search_url << url() << "/search?q=" << escaped_keywords;
       curl_free(escaped_keywords);
-      BOOST_LOG_TRIVIAL(trace) << "get google page " << search_url.str() << std::endl;
+      // results to look at, and results to ask for on every page
+      int depth = std::max(1, std::min(100, (int)options.max_depth));
+      unsigned paginated = _paginated_queries;
+      while(paginated > 0 && !_paginated_queries.compare_exchange_weak(paginated, paginated - 1)) {}
+      if(paginated == 1) {
+        BOOST_LOG_TRIVIAL(info) << name() << ": the next queries request " << _results_per_page << " results per page again\n";
+      }
+      unsigned per_page = paginated > 0 ? 10 : std::min(_results_per_page, (unsigned)std::max(10, depth));
+      return serp_walk(url(), search_url.str(), depth, per_page, options.last_rank);
+    }
 
-      html_document document;
-      lxb_status_t parser_status;
+    // the queries made with pages of 10 results when the larger pages
+    // were ignored, before trying them again
+    static const unsigned PAGINATED_QUERIES = 50;
+
+    bool GoogleEngine::next_page(serp_walk& walk, const serp_page& page) const {
+      bool more = walk.page_done(page);
+      if(more && walk.short_first_page()) {
+        // there are more results, but not on the first page: the
+        // results per page parameter was ignored
+        BOOST_LOG_TRIVIAL(warning) << name() << " returned " << page.results << " of " << walk.per_page()
+                                   << " results per page; falling back to pagination for "
+                                   << PAGINATED_QUERIES << " queries\n";
+        _paginated_queries = PAGINATED_QUERIES;
+      }
+      return more;
+    }
 
-      if(document() == NULL) {
+    transfer_stats GoogleEngine::download_page(CURL *session, const std::string& page_url,
+                                               page_body& body) const {
+      page_buffer page;
+      page.body = &body;
+      try {
+        return fetch_page(session, page_url, rcv_page_buffer, (void *)&page);
+      } catch (...) {
+        if(page.classifier.blocked()) {
+          throw_blocked_page(page.classifier.verdict());
+        }
+        throw;
+      }
+    }
+
+    serp_page GoogleEngine::parse_page(const page_body& body, const std::string& domain, int limit) const {
+      if(_serp_parser == STREAM_PARSER) {
+        serp_scanner& scanner = thread_serp_scanner();
+        scanner.reset(domain, limit);
+        for(std::size_t i = 0; i < body.chunks() && !scanner.done(); i++) {
+          auto chunk = body[i];
+          scanner.feed(chunk.data, chunk.size);
+        }
+        return scanner.finish();
+      }
+
+      dom_parser *parser = thread_dom_parser();
+      if(parser == NULL) {
         BOOST_LOG_TRIVIAL(error) << "ERROR: failed to allocate new DOM document\n";
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
         throw parse_init_exception();
       }
-
-      curl_easy_setopt(curl_session, CURLOPT_URL, search_url.str().c_str());
-      curl_easy_setopt(curl_session, CURLOPT_WRITEFUNCTION, rcv_google_chunk);
-      int crt_rank = 0;
-      bool page_found = false;
-      int page_rank = -1;
-    next_page:
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): Loading and parsing next page\n";
-      parser_status = lxb_html_document_parse_chunk_begin(document());
-      if(parser_status != LXB_STATUS_OK) {
+      lxb_html_document_t *document = parser->new_page();
+      if(lxb_html_document_parse_chunk_begin(document) != LXB_STATUS_OK) {
         BOOST_LOG_TRIVIAL(error) << "ERROR: failed to init parsing document chunks\n";
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
         throw parse_init_exception();
       }
-      curl_easy_setopt(curl_session, CURLOPT_WRITEDATA, (void *)document());
+      for(std::size_t i = 0; i < body.chunks(); i++) {
+        auto chunk = body[i];
+        if(lxb_html_document_parse_chunk(document, (const lxb_char_t *)chunk.data, chunk.size) != LXB_STATUS_OK) {
+          BOOST_LOG_TRIVIAL(error) << "ERROR: failed to parse the google response\n";
+          throw parse_end_exception();
+        }
+      }
+      if(lxb_html_document_parse_chunk_end(document) != LXB_STATUS_OK) {
+        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to end the google response parsing\n";
+        throw parse_end_exception();
+      }
+      return extract_page(*parser, domain, limit);
+    }
 
-      auto result = curl_easy_perform(curl_session);
-      if(result != 0) {
-        BOOST_LOG_TRIVIAL(error) << "Failed to fetch URL: " << search_url.str() << std::endl;
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
-        throw http_request_failed_exception(result);
+    serp_page GoogleEngine::parse_page(const std::string& body, const std::string& domain, int limit) const {
+      if(_serp_parser == STREAM_PARSER) {
+        serp_scanner& scanner = thread_serp_scanner();
+        scanner.reset(domain, limit);
+        scanner.feed(body.data(), body.size());
+        return scanner.finish();
       }
 
-      parser_status = lxb_html_document_parse_chunk_end(document());
+      dom_parser *parser = thread_dom_parser();
+      if(parser == NULL) {
+        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to allocate new DOM document\n";
+        throw parse_init_exception();
+      }
+      lxb_status_t parser_status = lxb_html_document_parse(parser->new_page(), (const lxb_char_t *)body.data(),
+                                                           body.size());
       if(parser_status != LXB_STATUS_OK) {
-        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to end the google response parsing\n";
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
+        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to parse the google response\n";
         throw parse_end_exception();
       }
-      //ranktracker::engine::serialize(lxb_dom_interface_node(document()));
-
-      // process the document to extract ranking info
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): finding main div\n";
-      lxb_dom_element_t *maindiv = find_element_by_id(document(), "main");
-      if(maindiv) {
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): main div found\n";
-        for(auto node = lxb_dom_interface_node(maindiv)->first_child;
-            node != NULL && !page_found && crt_rank < 100;
-            node = node->next) {
-          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): "
-            "getting next result node on crt page\n";
-
-          std::string result_url;
-          if(is_result_line(node, result_url)) {
-            crt_rank++;
-            BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_quer(): the current node "
-              "is a result line; crt_rank = " << crt_rank << std::endl;
-
-            if(is_my_domain(domain, result_url)) {
-              BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_quer(): domain found; url: " << result_url << std::endl;
-              page_found = true;
-              page_rank = crt_rank;
-              if (page_url) *page_url = result_url;
-            }
-          } else {
-            BOOST_LOG_TRIVIAL(trace) << "The current node is not a result line\n";
+      return extract_page(*parser, domain, limit);
+    }
+
+    serp_page GoogleEngine::receive_page(const std::string& body, const std::string& domain, int limit,
+                                         std::size_t chunk) const {
+      bool stream = _serp_parser == STREAM_PARSER;
+      serp_scanner& scanner = thread_serp_scanner();
+      dom_parser *parser = stream ? NULL : thread_dom_parser();
+      page_receiver page;
+      page.scanner = NULL;
+      page.document = NULL;
+      if(stream) {
+        scanner.reset(domain, limit);
+        page.scanner = &scanner;
+      } else {
+        if(parser == NULL) {
+          BOOST_LOG_TRIVIAL(error) << "ERROR: failed to allocate new DOM document\n";
+          throw parse_init_exception();
+        }
+        page.document = parser->new_page();
+        if(lxb_html_document_parse_chunk_begin(page.document) != LXB_STATUS_OK) {
+          BOOST_LOG_TRIVIAL(error) << "ERROR: failed to init parsing document chunks\n";
+          throw parse_init_exception();
+        }
+      }
+
+      chunk = std::max((std::size_t)1, chunk);
+      for(std::size_t pos = 0; pos < body.size(); pos += chunk) {
+        std::size_t len = std::min(chunk, body.size() - pos);
+        if(rcv_google_chunk(const_cast<char *>(body.data() + pos), 1, len, (void *)&page) != len) {
+          if(page.classifier.blocked()) {
+            throw_blocked_page(page.classifier.verdict());
           }
+          throw parse_end_exception();
         }
+      }
+
+      if(stream) return scanner.finish();
+      if(lxb_html_document_parse_chunk_end(page.document) != LXB_STATUS_OK) {
+        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to end the google response parsing\n";
+        throw parse_end_exception();
+      }
+      return extract_page(*parser, domain, limit);
+    }
+
+    rank_query_result
+    GoogleEngine::query(std::string domain,
+                        std::string keywords,
+                        progress_updater& p,
+                        const query_options& options) const {
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): enter\n";
+      auto query_start = std::chrono::steady_clock::now();
+      auto curl_session = curl_easy_init();
+      if(curl_session == NULL) {
+        BOOST_LOG_TRIVIAL(error) << "GoogleEngine::query(): curl session could not be initialized\n";
+        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+        throw http_init_exception();
+      }
+
+      serp_walk walk = start_walk(curl_session, keywords, options);
+      BOOST_LOG_TRIVIAL(trace) << "get google page " << walk.next_url() << std::endl;
+
+      bool stream = _serp_parser == STREAM_PARSER;
+      serp_scanner& scanner = thread_serp_scanner();
+      dom_parser *parser = stream ? NULL : thread_dom_parser();
+      lxb_html_document_t *document = NULL;
+      lxb_status_t parser_status;
+
+      if(!stream && parser == NULL) {
+        BOOST_LOG_TRIVIAL(error) << "ERROR: failed to allocate new DOM document\n";
+        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+        curl_easy_cleanup(curl_session);
+        throw parse_init_exception();
+      }
+
+      page_receiver page;
+      page.scanner = stream ? &scanner : NULL;
+      rank_query_result result;
+      serp_page page_info;
+    next_page:
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): Loading and parsing next page\n";
+      if(stream) {
+        // the results are picked up while the page is received
+        scanner.reset(domain, walk.remaining());
       } else {
-        BOOST_LOG_TRIVIAL(warning) << "GoogleEngine::perform_rank_query(): main div not found on Google results page\n";
+        document = parser->new_page();
+        parser_status = lxb_html_document_parse_chunk_begin(document);
+        if(parser_status != LXB_STATUS_OK) {
+          BOOST_LOG_TRIVIAL(error) << "ERROR: failed to init parsing document chunks\n";
+          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+          curl_easy_cleanup(curl_session);
+          throw parse_init_exception();
+        }
       }
-      if(crt_rank < 100 && !page_found) {
-        BOOST_LOG_TRIVIAL(trace) << "did not reach the max rank and the domain was not found yet.\n";
-        BOOST_LOG_TRIVIAL(trace) << "trying the next Google page\n";
+
+      page.document = document;
+      page.classifier.reset();
+      {
+        auto fetch_start = std::chrono::steady_clock::now();
         try {
-          std::string next_page_url = url() + google_next_page(document());
-          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): get next page - "
-                                   << next_page_url << std::endl;
+          result.traffic += fetch_page(curl_session, walk.next_url(), rcv_google_chunk, (void *)&page);
+        } catch (...) {
+          curl_easy_cleanup(curl_session);
+          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+          if(page.classifier.blocked()) {
+            throw_blocked_page(page.classifier.verdict());
+          }
+          throw;
+        }
 
-          curl_easy_setopt(curl_session, CURLOPT_URL, next_page_url.c_str());
-          document.swap(html_document()); // automatic free the prev document
+        parser_status = stream ? LXB_STATUS_OK : lxb_html_document_parse_chunk_end(document);
+        if(parser_status != LXB_STATUS_OK) {
+          BOOST_LOG_TRIVIAL(error) << "ERROR: failed to end the google response parsing\n";
+          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+          curl_easy_cleanup(curl_session);
+          throw parse_end_exception();
+        }
+        //ranktracker::engine::serialize(lxb_dom_interface_node(document));
+        auto extract_start = std::chrono::steady_clock::now();
+        result.fetch_time += std::chrono::duration_cast<std::chrono::milliseconds>(extract_start - fetch_start);
 
-          if(document() == NULL) {
-            BOOST_LOG_TRIVIAL(error) << "ERROR: failed to allocate new DOM document\n";
-            BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
-            throw parse_init_exception();
-          }
-          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): update progress with "
-                                   << crt_rank << std::endl;
-          p(crt_rank); // update progress
-          BOOST_LOG_TRIVIAL(trace) << "waiting for 13s before fetching a new page\n";
-          std::this_thread::sleep_for(std::chrono::seconds(13));
-          goto next_page;
-        } catch (next_link_not_found) {
-          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): no next page on google search\n";
+        // process the document to extract ranking info
+        try {
+          page_info = stream ? scanner.finish() : extract_page(*parser, domain, walk.remaining());
+        } catch (...) {
+          curl_easy_cleanup(curl_session);
+          BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+          throw;
         }
+        result.extract_time += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()
+                                                                                     - extract_start);
       }
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): finalizing search\n";
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): updating progress to max rank (100)\n";
+      if(!next_page(walk, page_info)) goto search_done;
+
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): get next page - " << walk.next_url() << std::endl;
+      {
+        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): update progress to " << walk.progress() << std::endl;
+        p(walk.progress()); // update progress
+        auto delay = page_delay();
+        BOOST_LOG_TRIVIAL(trace) << "waiting for " << delay.count() << "ms before fetching a new page\n";
+        std::this_thread::sleep_for(delay);
+        result.wait_time += delay;
+        goto next_page;
+      }
+
+    search_done:
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): finalizing search\n";
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): updating progress to the end of the query (100)\n";
       p(100); // update progress with maximum rank (job completed)
-      if(page_found) {
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): page found  - rank is "
-                                 << page_rank << std::endl;
+      if(walk.rank() > 0) {
+        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): page found  - rank is "
+                                 << walk.rank() << std::endl;
       } else {
-        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query():page not found\n";
+        BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query():page not found\n";
       }
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): cleaning up curl\n";
+      result.rank = walk.rank();
+      result.page_url = walk.page_url();
+      result.serp = walk.serp();
+      result.total_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()
+                                                                                - query_start);
+      record_transfer(result.traffic);
+      BOOST_LOG_TRIVIAL(info) << "GoogleEngine::query(): " << result.traffic.pages << " pages, "
+                              << result.traffic.wire_bytes << " bytes received, " << result.traffic.decoded_bytes
+                              << " bytes decoded in " << result.traffic.decode_time.count() << "us; "
+                              << result.total_time.count() << "ms total, " << result.fetch_time.count()
+                              << "ms fetching\n";
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): cleaning up curl\n";
       curl_easy_cleanup(curl_session);
 
-      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::perform_rank_query(): exit\n";
-      return page_rank;
+      BOOST_LOG_TRIVIAL(trace) << "GoogleEngine::query(): exit\n";
+      return result;
+    }
+
+    // the times curl measured for the last request of the session
+    static void read_transfer_times(CURL *session, transfer_stats& stats) {
+      struct {
+        CURLINFO info;
+        std::chrono::microseconds *time;
+      } times[] = {
+        {CURLINFO_NAMELOOKUP_TIME_T, &stats.name_lookup_time},
+        {CURLINFO_CONNECT_TIME_T, &stats.connect_time},
+        {CURLINFO_APPCONNECT_TIME_T, &stats.tls_time},
+        {CURLINFO_STARTTRANSFER_TIME_T, &stats.first_byte_time},
+        {CURLINFO_TOTAL_TIME_T, &stats.transfer_time},
+      };
+      for(auto& t: times) {
+        curl_off_t us = 0;
+        if(curl_easy_getinfo(session, t.info, &us) == CURLE_OK) {
+          *t.time += std::chrono::microseconds(us);
+        }
+      }
+    }
+
+    transfer_stats GoogleEngine::fetch_page(CURL *session,
+                                            const std::string& page_url,
+                                            curl_write_callback rcv,
+                                            void *rcv_data) const {
+      // the body is decompressed by our decoder instead of curl, to stream
+      // it into the parser and to measure the decompression
+      content_decoder decoder(rcv, rcv_data);
+      std::string accept_encoding = std::string("Accept-Encoding: ") + content_decoder::accepted_encodings();
+      struct curl_slist *headers = curl_slist_append(NULL, accept_encoding.c_str());
+
+      curl_easy_setopt(session, CURLOPT_URL, page_url.c_str());
+      curl_easy_setopt(session, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(session, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+      curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, content_decoder::curl_write);
+      curl_easy_setopt(session, CURLOPT_WRITEDATA, (void *)&decoder);
+      curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, content_decoder::curl_header);
+      curl_easy_setopt(session, CURLOPT_HEADERDATA, (void *)&decoder);
+
+      auto result = curl_easy_perform(session);
+      curl_easy_setopt(session, CURLOPT_HTTPHEADER, NULL);
+      curl_slist_free_all(headers);
+      if(result != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to fetch URL: " << page_url << std::endl;
+        throw http_request_failed_exception(result);
+      }
+
+      long status = 0;
+      curl_easy_getinfo(session, CURLINFO_RESPONSE_CODE, &status);
+      if(status == 429 || status == 503) {
+        BOOST_LOG_TRIVIAL(warning) << "Google is rate limiting the queries (HTTP " << status << ")\n";
+        throw throttled_exception(throttled_exception::RATE_LIMITED);
+      }
+      if(status >= 300 && status < 400) {
+        // google redirects to the captcha and consent pages
+        char *location = NULL;
+        curl_easy_getinfo(session, CURLINFO_REDIRECT_URL, &location);
+        std::string redirect(location ? location : "");
+        BOOST_LOG_TRIVIAL(warning) << "Google redirected the query to " << redirect << std::endl;
+        if(redirect.find("/sorry/") != std::string::npos) {
+          throw throttled_exception(throttled_exception::CAPTCHA);
+        }
+        if(redirect.find("consent.") != std::string::npos) {
+          throw throttled_exception(throttled_exception::CONSENT);
+        }
+        throw http_status_exception(status);
+      }
+      if(status >= 400) {
+        BOOST_LOG_TRIVIAL(error) << "Google answered with HTTP " << status << " for " << page_url << std::endl;
+        throw http_status_exception(status);
+      }
+      if(!decoder.finish()) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to decode the page: " << page_url << std::endl;
+        throw http_request_failed_exception(CURLE_BAD_CONTENT_ENCODING);
+      }
+      transfer_stats stats = decoder.stats();
+      stats.http_status = status;
+      read_transfer_times(session, stats);
+      return stats;
+    }
+
+    unsigned GoogleEngine::results_per_page() const {
+      return _paginated_queries ? 10 : _results_per_page;
+    }
+
+    void GoogleEngine::results_per_page(unsigned n) {
+      _results_per_page = std::max(10u, std::min(100u, n));
+      _paginated_queries = 0;
+    }
+
+    std::chrono::milliseconds GoogleEngine::page_delay() const {
+      return _page_delay;
     }
 
     static engines_map engines;
@@ -410,10 +860,85 @@ namespace ranktracker {
                                   "google.uk",
                                   "Google/UK",
                                   "https://www.google.co.uk");
+    static ReplayEngine replay(uuid_read("5f0e7c1b-8d2a-4c6e-9b3f-2a7d41e6c950"),
+                               "replay",
+                               "Recorded pages (offline)",
+                               "http://replay.invalid");
+    // created when the url of a fake search server is configured
+    static std::unique_ptr<GoogleEngine> fake_serp;
 
     void init_search_engines() {
+      // RANKTRACKER_RESULTS_PER_PAGE=10 turns off the large result pages;
+      // the recorded and the fake pages hold 10 results, so the offline
+      // engines only request larger ones when it is set
+      unsigned per_page = 100;
+      unsigned offline_per_page = 10;
+      const char *per_page_env = std::getenv("RANKTRACKER_RESULTS_PER_PAGE");
+      if(per_page_env && *per_page_env) {
+        per_page = std::strtoul(per_page_env, NULL, 10);
+        offline_per_page = per_page;
+      }
+      google_com.results_per_page(per_page);
+      google_uk.results_per_page(per_page);
+
+      // RANKTRACKER_SERP_PARSER=dom parses the result pages on the lexbor
+      // DOM instead of the streaming scanner
+      GoogleEngine::serp_parser_t parser = GoogleEngine::STREAM_PARSER;
+      const char *parser_env = std::getenv("RANKTRACKER_SERP_PARSER");
+      if(parser_env && std::strcmp(parser_env, "dom") == 0) {
+        parser = GoogleEngine::DOM_PARSER;
+      }
+      google_com.serp_parser(parser);
+      google_uk.serp_parser(parser);
+
+      // RANKTRACKER_SERP_LAYOUT replaces the built-in rules that find the
+      // results on the pages; the file is reloaded when it changes
+      const char *layout_env = std::getenv("RANKTRACKER_SERP_LAYOUT");
+      if(layout_env && *layout_env) {
+        try {
+          load_serp_layout(layout_env);
+        } catch(layout_exception e) {
+          BOOST_LOG_TRIVIAL(error) << "Error loading the SERP layout: " << e.message()
+                                   << "; using the built-in layout" << std::endl;
+        }
+      }
+
       engines.insert({google_com.id(), SearchEngineRef(&google_com)});
       engines.insert({google_uk.id(), SearchEngineRef(&google_uk)});
+
+      // the replay engine is only offered when a folder of recorded
+      // pages is configured
+      replay_options options;
+      if(replay_options_from_env(options)) {
+        BOOST_LOG_TRIVIAL(info) << "Replaying recorded search pages from " << options.pages_dir << std::endl;
+        replay.configure(options);
+        replay.results_per_page(offline_per_page);
+        replay.serp_parser(parser);
+        engines.insert({replay.id(), SearchEngineRef(&replay)});
+      }
+
+      // the fake search server (fake-serp-server) is queried like
+      // google, through curl, to test the network code offline
+      const char *fake_serp_url = std::getenv("RANKTRACKER_FAKE_SERP_URL");
+      if(fake_serp_url && *fake_serp_url && !fake_serp) {
+        std::string base_url(fake_serp_url);
+        while(!base_url.empty() && base_url.back() == '/') base_url.pop_back();
+        BOOST_LOG_TRIVIAL(info) << "Querying the fake search server at " << base_url << std::endl;
+        fake_serp.reset(new GoogleEngine(uuid_read("a3c1f0d2-64b7-4e59-8f1a-7d2e9c05b418"),
+                                         "fake-serp",
+                                         "Fake search server (testing)",
+                                         base_url));
+        // no politeness delay is needed between the pages of a local server
+        unsigned long delay_ms = 0;
+        const char *delay_env = std::getenv("RANKTRACKER_FAKE_SERP_PAGE_DELAY_MS");
+        if(delay_env && *delay_env) {
+          delay_ms = std::strtoul(delay_env, NULL, 10);
+        }
+        fake_serp->page_delay(std::chrono::milliseconds(delay_ms));
+        fake_serp->results_per_page(offline_per_page);
+        fake_serp->serp_parser(parser);
+        engines.insert({fake_serp->id(), SearchEngineRef(fake_serp.get())});
+      }
     }
 
     const engines_map& search_engines() {
@@ -7,9 +7,13 @@
 #define ENGINES_HH
 
 #include <string>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <vector>
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/base_object.hpp>
 #include <boost/serialization/split_member.hpp>
@@ -17,6 +21,9 @@
 
 #include "entity.hh"
 #include "progress.hh"
+#include "content_decoder.hh"
+#include "domain_matcher.hh"
+#include "page_body.hh"
 
 namespace ranktracker {
   namespace engine {
@@ -29,6 +36,148 @@ namespace ranktracker {
 
     typedef int rank_result_type;
 
+    /**
+     * A result line of the searched pages, at its position in the
+     * results of the query.
+     */
+    struct serp_result {
+      rank_result_type position;
+      std::string url;        // the canonical url of the result's landing page
+    };
+
+    /**
+     * The outcome of a rank query.
+     */
+    struct rank_query_result {
+      rank_result_type rank;                   // -1 if the domain is not in the results
+      std::string page_url;                    // url of the ranked page
+      std::vector<serp_result> serp;           // all the results of the searched pages, by position
+      transfer_stats traffic;                  // pages fetched and bytes transferred
+      std::chrono::milliseconds fetch_time;    // downloading and parsing the pages
+      std::chrono::milliseconds extract_time;  // finding the results in the parsed pages
+      std::chrono::milliseconds wait_time;     // delays between the pages
+      std::chrono::milliseconds total_time;
+
+      rank_query_result() :
+        rank(-1),
+        fetch_time(0),
+        extract_time(0),
+        wait_time(0),
+        total_time(0)
+      {}
+    };
+
+    /**
+     * How deep a rank query searches.
+     */
+    struct query_options {
+      unsigned max_depth;           // number of results to look at, up to 100
+      rank_result_type last_rank;   // adaptive search: the previous rank, whose page is
+                                    // searched first; -1 to search from the first page
+
+      query_options() : max_depth(100), last_rank(-1) {}
+    };
+
+    /**
+     * What a parsed result page tells about the searched domain.
+     */
+    struct serp_page {
+      unsigned results;       // result lines looked at, up to the domain's one
+      bool found;             // the domain is the last result looked at
+      std::string page_url;   // url of the domain's result
+      std::string next_link;  // href of the link to the next page; empty if there is none
+      std::vector<std::string> urls;  // all the result urls on the page, up to the limit, canonical
+
+      serp_page() : results(0), found(false) {}
+    };
+
+    /**
+     * The rank of the domain in the results of a query, as
+     * `perform_rank_query` would find it; -1 if it is not there.
+     */
+    rank_result_type serp_rank(const std::vector<serp_result>& serp, const std::string& domain,
+                               std::string *page_url = nullptr);
+
+    /**
+     * The ranks of all the domains of the matcher in the results of a
+     * query, in one pass over the results: the first position each
+     * domain matches, by the domain's id; -1 for the domains that are
+     * not in the results.
+     */
+    std::vector<rank_result_type> serp_ranks(const std::vector<serp_result>& serp, const domain_matcher& domains);
+
+    /**
+     * The result pages a rank query goes through: the first page, or
+     * the page of the last rank for the adaptive search, then the next
+     * pages until the domain is found or the search depth is reached.
+     * The pages are fetched and parsed by the caller, which reports each
+     * page to `page_done`.
+     */
+    class serp_walk {
+      std::string _base_url;
+      std::string _search_url;
+      std::string _next_url;
+      int _depth;
+      unsigned _per_page;
+      int _crt_rank;          // results before the next page: its `start`
+      int _searched;          // results looked at, for the progress
+      unsigned _pages;
+      bool _short_first_page;
+      rank_result_type _rank;
+      std::string _page_url;
+      std::vector<serp_result> _serp;
+
+      // adaptive search: the page of 10 results of the last rank is
+      // searched first, and the search goes on from the first page only
+      // if the domain moved from there; with pages of 10 results the
+      // walk skips that page, and goes on from its next link
+      int _adaptive_start;
+      std::string _adaptive_next;
+      bool _adaptive_page;
+
+    public:
+      /**
+       * `search_url` is the url of the first page of 10 results; the
+       * pages of the walk ask for `per_page` results.
+       */
+      serp_walk(const std::string& base_url,
+                const std::string& search_url,
+                int depth,
+                unsigned per_page,
+                rank_result_type last_rank);
+
+      const std::string& next_url() const { return _next_url; }
+
+      /**
+       * Number of results still to look at, the limit for the next page.
+       */
+      int remaining() const { return _depth - _crt_rank; }
+
+      /**
+       * Records a parsed page; returns true if the next page is needed.
+       */
+      bool page_done(const serp_page& page);
+
+      unsigned pages() const { return _pages; }
+      unsigned per_page() const { return _per_page; }
+
+      /**
+       * The page just recorded is the first page, with no more than 10
+       * of the results requested, and it links to a next page. A large
+       * page with a few results less is a normal page.
+       */
+      bool short_first_page() const { return _short_first_page; }
+
+      int progress() const { return std::min(99, _searched * 100 / _depth); }
+      rank_result_type rank() const { return _rank; }
+      const std::string& page_url() const { return _page_url; }
+
+      /**
+       * The results of the pages recorded so far, by position.
+       */
+      const std::vector<serp_result>& serp() const { return _serp; }
+    };
+
     class SearchEngineRef;
 
     typedef std::unordered_map<Entity::id_type, SearchEngineRef, boost::hash<Entity::id_type>> engines_map;
@@ -62,25 +211,131 @@ namespace ranktracker {
       /**
        * rank computation performing; connects to the search engine
        * perform the query on the keywords string and verfies the rank
-       * of the given domain name
+       * of the given domain name; the cost of the query is copied to
+       * `details` when given
        */
-      virtual rank_result_type perform_rank_query(std::string domain,
-                                                  std::string keywords,
-                                                  progress_updater& p,
-                                                  std::string *page_url = nullptr) const = 0;
+      rank_result_type perform_rank_query(std::string domain,
+                                          std::string keywords,
+                                          progress_updater& p,
+                                          std::string *page_url = nullptr,
+                                          const query_options& options = query_options(),
+                                          rank_query_result *details = nullptr) const;
+
+      /**
+       * Performs the rank query, like `perform_rank_query`, returning the
+       * rank together with the page url and the cost of the query. The
+       * progress goes from 0 to 100 as the results up to the maximum
+       * depth are searched.
+       */
+      virtual rank_query_result query(std::string domain,
+                                      std::string keywords,
+                                      progress_updater& p,
+                                      const query_options& options = query_options()) const = 0;
     };
 
     /**
      * SearchEngine implementation for Google
      */
     class GoogleEngine : public SearchEngine {
+    public:
+      enum serp_parser_t {
+        STREAM_PARSER,      // serp_scanner, on the chunks as they arrive
+        DOM_PARSER          // extraction from the lexbor DOM of the page
+      };
+
+    private:
+      serp_parser_t _serp_parser = STREAM_PARSER;
+      unsigned _results_per_page = 10;
+      // queries left to make with pages of 10 results, after the engine
+      // ignored the larger pages
+      mutable std::atomic<unsigned> _paginated_queries{0};
+      std::chrono::milliseconds _page_delay = std::chrono::seconds(13);
+
     public:
       using SearchEngine::SearchEngine;
 
-      rank_result_type perform_rank_query(std::string domain,
-                                          std::string keywords,
-                                          progress_updater& p,
-                                          std::string* page_url = nullptr) const override;
+      /**
+       * Number of results requested on each result page, between 10 and
+       * 100. When more than 10, the top 100 results are fetched in fewer
+       * requests; if the engine returns fewer results than requested
+       * while having more, the query continues with the next pages and
+       * the following queries request the default 10 results per page,
+       * until the larger pages are tried again.
+       */
+      unsigned results_per_page() const;
+      void results_per_page(unsigned n);
+
+      /**
+       * How the result pages are parsed. The streaming scanner looks at
+       * the results as the page arrives, without building the DOM; the
+       * DOM parser is kept to compare the two.
+       */
+      serp_parser_t serp_parser() const { return _serp_parser; }
+      void serp_parser(serp_parser_t parser) { _serp_parser = parser; }
+
+      rank_query_result query(std::string domain,
+                              std::string keywords,
+                              progress_updater& p,
+                              const query_options& options = query_options()) const override;
+
+      /**
+       * The steps of `query`, for the callers running them in separate
+       * threads (see `RefreshPipeline`): `start_walk` plans the pages of
+       * the query, `download_page` fetches the page the walk is at and
+       * `parse_page` finds the results on it, to be passed to
+       * `next_page`. `session` is only used to escape the keywords.
+       */
+      serp_walk start_walk(CURL *session, const std::string& keywords, const query_options& options) const;
+
+      /**
+       * Downloads a result page, appending the decompressed body to
+       * `body`, to be moved to the thread parsing it. Throws
+       * `throttled_exception` if a captcha or consent page is
+       * recognized while downloading.
+       */
+      transfer_stats download_page(CURL *session, const std::string& page_url, page_body& body) const;
+
+      /**
+       * Parses a downloaded page and looks at its results, up to `limit`
+       * of them, for the domain. Throws `throttled_exception` for the
+       * pages google returns when it blocks the queries and
+       * `unrecognized_page_exception` if it is not a results page.
+       */
+      serp_page parse_page(const page_body& body, const std::string& domain, int limit) const;
+      serp_page parse_page(const std::string& body, const std::string& domain, int limit) const;
+
+      /**
+       * Parses a page the way `query` does while receiving it: the body
+       * is passed to the receiver of the downloads in chunks of `chunk`
+       * bytes, as curl does. For the benchmarks of the parsing.
+       */
+      serp_page receive_page(const std::string& body, const std::string& domain, int limit,
+                             std::size_t chunk) const;
+
+      /**
+       * Records a parsed page in the walk; returns true if the next page
+       * of the walk is needed.
+       */
+      bool next_page(serp_walk& walk, const serp_page& page) const;
+
+      /**
+       * Time to wait before requesting the next result page of a query.
+       */
+      virtual std::chrono::milliseconds page_delay() const;
+      void page_delay(std::chrono::milliseconds delay) { _page_delay = delay; }
+
+    protected:
+      /**
+       * Download one result page, passing the body to `rcv` chunk by
+       * chunk as it arrives. `session` is the curl handle of the current
+       * query and it is reused for all the pages of that query. The page
+       * is requested compressed and it is decompressed as it arrives;
+       * returns the traffic of the page.
+       */
+      virtual transfer_stats fetch_page(CURL *session,
+                              const std::string& page_url,
+                              curl_write_callback rcv,
+                              void *rcv_data) const;
     };
 
     class SearchEngineRef : public AbstractEntity {
@@ -131,9 +386,11 @@ namespace ranktracker {
       rank_result_type perform_rank_query(std::string domain,
                                           std::string keywords,
                                           progress_updater& p,
-                                          std::string *page_url = nullptr) const {
+                                          std::string *page_url = nullptr,
+                                          const query_options& options = query_options(),
+                                          rank_query_result *details = nullptr) const {
         assert(_engine != NULL);
-        return _engine->perform_rank_query(domain, keywords, p, page_url);
+        return _engine->perform_rank_query(domain, keywords, p, page_url, options, details);
       }
     };
 
@@ -158,10 +415,46 @@ namespace ranktracker {
       CURLcode result_code() const {return _result_code; }
     };
 
+    class http_status_exception : public http_exception {
+      long _status;
+    public:
+      http_status_exception(long status) : _status(status) {}
+
+      long status() const { return _status; }
+    };
+
+    /**
+     * The search engine refused to answer the query: the request was
+     * rate limited or a captcha or a consent page was returned instead
+     * of the results.
+     */
+    class throttled_exception : public search_exception {
+    public:
+      enum reason_t {
+        RATE_LIMITED,
+        CAPTCHA,
+        CONSENT
+      };
+
+    private:
+      reason_t _reason;
+
+    public:
+      throttled_exception(reason_t reason) : _reason(reason) {}
+
+      reason_t reason() const { return _reason; }
+    };
+
     class parse_exception: public search_exception {};
     class parse_init_exception : public parse_exception {};
     class parse_end_exception : public parse_exception {};
 
+    /**
+     * The page is neither a results page nor a page google returns
+     * when it blocks the queries.
+     */
+    class unrecognized_page_exception : public parse_exception {};
+
     class dom_exception : public search_exception {};
 
     class next_link_not_found : public search_exception {};
@@ -0,0 +1,497 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// fake-serp-server.cc
+// local HTTP server answering google search requests with recorded
+// result pages; used to test and benchmark the network code offline
+
+#include "logging.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+
+namespace fs = boost::filesystem;
+using boost::asio::ip::tcp;
+
+namespace {
+
+  struct server_options {
+    std::string pages_dir;    // folder with the recorded *.html pages
+    std::string address;
+    unsigned short port;
+    unsigned latency_ms;      // time to the first byte of every answer
+    unsigned jitter_ms;       // random extra latency, between 0 and jitter_ms
+    std::size_t bandwidth;    // bytes per second of each answer; 0 for no limit
+    double throttle_rate;     // probability of a 429 answer (0..1)
+    double error_rate;        // probability of a 500 answer (0..1)
+    bool gzip;                // compress the pages for the clients accepting it
+    unsigned seed;
+
+    server_options() :
+      address("127.0.0.1"),
+      port(8380),
+      latency_ms(0),
+      jitter_ms(0),
+      bandwidth(0),
+      throttle_rate(0),
+      error_rate(0),
+      gzip(false),
+      seed(0)
+    {}
+  };
+
+  struct http_response {
+    int status;
+    std::string reason;
+    std::string body;
+    bool gzipped;
+  };
+
+  /**
+   * The recorded pages and the simulated network conditions, shared by
+   * the connections.
+   */
+  class fake_serp {
+    server_options _options;
+    std::mutex _mutex;
+    std::mt19937 _rng;
+    std::map<std::string, std::shared_ptr<const std::string>> _pages;  // contents by path
+
+    std::vector<std::string> recorded_pages(const std::string& keywords);
+    std::shared_ptr<const std::string> page(const std::string& path);
+
+  public:
+    std::atomic<std::size_t> connections;
+    std::atomic<std::size_t> requests;
+    std::atomic<std::size_t> throttled;
+    std::atomic<std::size_t> errors;
+    std::atomic<std::size_t> bytes;
+
+    fake_serp(const server_options& options) :
+      _options(options),
+      _rng(options.seed),
+      connections(0),
+      requests(0),
+      throttled(0),
+      errors(0),
+      bytes(0)
+    {}
+
+    const server_options& options() const { return _options; }
+
+    http_response answer(const std::string& target, bool accepts_gzip);
+  };
+}
+
+static void usage(const char *program);
+static void init_log(bool verbose);
+static void serve(fake_serp& server, std::shared_ptr<tcp::socket> socket);
+
+/**
+ fake search server entry point
+*/
+int main(int argc, char **argv) {
+  server_options options;
+  bool verbose = false;
+  for(int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if(std::strcmp(argv[i], "-d") == 0 && has_value) {
+      options.pages_dir = argv[++i];
+    } else if(std::strcmp(argv[i], "-a") == 0 && has_value) {
+      options.address = argv[++i];
+    } else if(std::strcmp(argv[i], "-p") == 0 && has_value) {
+      options.port = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-l") == 0 && has_value) {
+      options.latency_ms = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-j") == 0 && has_value) {
+      options.jitter_ms = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-b") == 0 && has_value) {
+      options.bandwidth = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-t") == 0 && has_value) {
+      options.throttle_rate = std::min(1.0, std::max(0.0, std::strtod(argv[++i], NULL)));
+    } else if(std::strcmp(argv[i], "-e") == 0 && has_value) {
+      options.error_rate = std::min(1.0, std::max(0.0, std::strtod(argv[++i], NULL)));
+    } else if(std::strcmp(argv[i], "-s") == 0 && has_value) {
+      options.seed = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-z") == 0) {
+      options.gzip = true;
+    } else if(std::strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(options.pages_dir.empty() || options.port == 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  init_log(verbose);
+  fake_serp server(options);
+
+  boost::asio::io_service io;
+  tcp::acceptor acceptor(io);
+  try {
+    tcp::endpoint endpoint(boost::asio::ip::address::from_string(options.address), options.port);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+  } catch (const boost::system::system_error& e) {
+    BOOST_LOG_TRIVIAL(error) << "Can not listen on " << options.address << ":" << options.port << ": " << e.what();
+    return 1;
+  }
+  BOOST_LOG_TRIVIAL(info) << "Serving the pages of " << options.pages_dir << " on http://" << options.address
+                          << ":" << options.port << "/search\n";
+
+  // the counters are logged every minute while the server is used
+  std::thread([&server]() {
+      std::size_t logged = 0;
+      for(;;) {
+        std::this_thread::sleep_for(std::chrono::minutes(1));
+        if(server.requests == logged) continue;
+        logged = server.requests;
+        BOOST_LOG_TRIVIAL(info) << server.requests << " requests on " << server.connections << " connections; "
+                                << server.throttled << " throttled, " << server.errors << " errors, "
+                                << server.bytes << " bytes sent\n";
+      }
+    }).detach();
+
+  for(;;) {
+    auto socket = std::make_shared<tcp::socket>(io);
+    boost::system::error_code ec;
+    acceptor.accept(*socket, ec);
+    if(ec) {
+      BOOST_LOG_TRIVIAL(error) << "Accept failed: " << ec.message() << std::endl;
+      continue;
+    }
+    server.connections++;
+    std::thread(serve, std::ref(server), socket).detach();
+  }
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " -d pages-folder [-a address] [-p port] [-l ms] [-j ms] [-b bytes/s]\n"
+            << "       [-t rate] [-e rate] [-z] [-s seed] [-v]\n"
+            << "  -d  folder with the recorded result pages (*.html); the pages of a query are taken\n"
+            << "      from its sub-folder, if there is one, as for the replay engine\n"
+            << "  -a  address to listen on (default 127.0.0.1)\n"
+            << "  -p  port (default 8380)\n"
+            << "  -l  latency of every answer, in milliseconds\n"
+            << "  -j  maximum random extra latency, in milliseconds\n"
+            << "  -b  bandwidth of each answer, in bytes per second (default: no limit)\n"
+            << "  -t  probability of a 429 (rate limited) answer, 0 to 1\n"
+            << "  -e  probability of a 500 answer, 0 to 1\n"
+            << "  -z  gzip the pages for the clients accepting it\n"
+            << "  -s  seed of the latency and of the failures\n"
+            << "  -v  verbose (trace) logging\n";
+}
+
+// decoded value of a parameter of the query string of an url; empty if
+// the parameter is not present
+static std::string query_param(const std::string& url, const std::string& name) {
+  auto q = url.find('?');
+  while(q != std::string::npos) {
+    auto start = q + 1;
+    if(url.compare(start, name.size() + 1, name + "=") == 0) {
+      start += name.size() + 1;
+      auto end = url.find('&', start);
+      std::string value = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+      std::string decoded;
+      for(size_t i = 0; i < value.size(); i++) {
+        if(value[i] == '+') {
+          decoded += ' ';
+        } else if(value[i] == '%' && i + 2 < value.size() &&
+                  std::isxdigit((unsigned char)value[i + 1]) &&
+                  std::isxdigit((unsigned char)value[i + 2])) {
+          decoded += (char)std::strtol(value.substr(i + 1, 2).c_str(), NULL, 16);
+          i += 2;
+        } else {
+          decoded += value[i];
+        }
+      }
+      return decoded;
+    }
+    q = url.find('&', start);
+  }
+  return std::string();
+}
+
+static std::string escape_param(const std::string& value) {
+  std::string escaped;
+  for(auto c: value) {
+    if(std::isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.') {
+      escaped += c;
+    } else if(c == ' ') {
+      escaped += '+';
+    } else {
+      char code[4];
+      std::snprintf(code, sizeof(code), "%%%02X", (unsigned char)c);
+      escaped += code;
+    }
+  }
+  return escaped;
+}
+
+// the query of a search link, with the keywords replaced and the start
+// shifted; the parameters are separated by "&amp;" in the html
+static std::string rewrite_query(const std::string& query, const std::string& q, long offset) {
+  std::string rewritten;
+  std::size_t start = 0;
+  for(;;) {
+    auto amp = query.find('&', start);
+    std::string param = query.substr(start, amp == std::string::npos ? std::string::npos : amp - start);
+    if(param.compare(0, 2, "q=") == 0) {
+      param = "q=" + q;
+    } else if(param.compare(0, 6, "start=") == 0) {
+      param = "start=" + std::to_string(std::max(0L, std::strtol(param.c_str() + 6, NULL, 10) + offset));
+    }
+    rewritten += param;
+    if(amp == std::string::npos) break;
+    std::size_t separator = query.compare(amp, 5, "&amp;") == 0 ? 5 : 1;
+    rewritten.append(query, amp, separator);
+    start = amp + separator;
+  }
+  return rewritten;
+}
+
+// points the search links of a recorded page, the next page link among
+// them, to the requested keywords and result page
+static std::string rewrite_links(const std::string& page, const std::string& keywords, long offset) {
+  static const std::string search_link = "href=\"/search?";
+  std::string q = escape_param(keywords);
+  std::string rewritten;
+  rewritten.reserve(page.size() + 256);
+  std::size_t pos = 0;
+  for(;;) {
+    auto link = page.find(search_link, pos);
+    if(link == std::string::npos) {
+      rewritten.append(page, pos, std::string::npos);
+      break;
+    }
+    link += search_link.size();
+    rewritten.append(page, pos, link - pos);
+    auto end = page.find('"', link);
+    if(end == std::string::npos) end = page.size();
+    rewritten += rewrite_query(page.substr(link, end - link), q, offset);
+    pos = end;
+  }
+  return rewritten;
+}
+
+static bool gzip(const std::string& data, std::string& compressed) {
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  compressed.resize(deflateBound(&zs, data.size()) + 32);
+  zs.next_in = (Bytef *)data.data();
+  zs.avail_in = data.size();
+  zs.next_out = (Bytef *)&compressed[0];
+  zs.avail_out = compressed.size();
+  int result = deflate(&zs, Z_FINISH);
+  compressed.resize(zs.total_out);
+  deflateEnd(&zs);
+  return result == Z_STREAM_END;
+}
+
+std::vector<std::string> fake_serp::recorded_pages(const std::string& keywords) {
+  std::string name;
+  for(auto c: keywords) {
+    name += std::isalnum((unsigned char)c) ? (char)std::tolower((unsigned char)c) : '-';
+  }
+  fs::path folder = fs::path(_options.pages_dir) / name;
+  if(name.empty() || !fs::is_directory(folder)) {
+    folder = _options.pages_dir;
+  }
+  std::vector<std::string> pages;
+  try {
+    for(fs::directory_iterator i(folder); i != fs::directory_iterator(); i++) {
+      if(fs::is_regular_file(i->path()) && i->path().extension() == ".html") {
+        pages.push_back(i->path().string());
+      }
+    }
+  } catch (const fs::filesystem_error& e) {
+    BOOST_LOG_TRIVIAL(error) << "Failed to read the recorded pages folder: " << e.what() << std::endl;
+  }
+  std::sort(pages.begin(), pages.end());
+  return pages;
+}
+
+std::shared_ptr<const std::string> fake_serp::page(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto i = _pages.find(path);
+    if(i != _pages.end()) return i->second;
+  }
+  std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+  if(!in) return nullptr;
+  std::ostringstream content;
+  content << in.rdbuf();
+  auto p = std::make_shared<const std::string>(content.str());
+  std::lock_guard<std::mutex> lock(_mutex);
+  _pages[path] = p;
+  return p;
+}
+
+http_response fake_serp::answer(const std::string& target, bool accepts_gzip) {
+  requests++;
+  unsigned latency;
+  bool throttle, fail;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    latency = _options.latency_ms;
+    if(_options.jitter_ms > 0) {
+      latency += std::uniform_int_distribution<unsigned>(0, _options.jitter_ms)(_rng);
+    }
+    throttle = std::uniform_real_distribution<double>(0, 1)(_rng) < _options.throttle_rate;
+    fail = std::uniform_real_distribution<double>(0, 1)(_rng) < _options.error_rate;
+  }
+  if(latency > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+  }
+
+  if(target.compare(0, 8, "/search?") != 0) {
+    return {404, "Not Found", "not found\n", false};
+  }
+  if(throttle) {
+    throttled++;
+    return {429, "Too Many Requests", "rate limited\n", false};
+  }
+  if(fail) {
+    errors++;
+    return {500, "Internal Server Error", "injected failure\n", false};
+  }
+
+  auto keywords = query_param(target, "q");
+  auto pages = recorded_pages(keywords);
+  if(pages.empty()) {
+    BOOST_LOG_TRIVIAL(error) << "No recorded pages in " << _options.pages_dir << std::endl;
+    return {404, "Not Found", "no recorded pages\n", false};
+  }
+  // the n-th recorded page stands for the results starting at n * 10;
+  // its links are shifted to the requested results
+  long start = std::strtol(query_param(target, "start").c_str(), NULL, 10);
+  std::size_t index = (std::max(0L, start) / 10) % pages.size();
+  auto content = page(pages[index]);
+  if(!content) {
+    BOOST_LOG_TRIVIAL(error) << "Can not read " << pages[index] << std::endl;
+    return {500, "Internal Server Error", "unreadable page\n", false};
+  }
+  BOOST_LOG_TRIVIAL(trace) << target << " -> " << pages[index] << std::endl;
+
+  http_response response = {200, "OK", rewrite_links(*content, keywords, start - (long)index * 10), false};
+  if(_options.gzip && accepts_gzip) {
+    std::string compressed;
+    if(gzip(response.body, compressed)) {
+      response.body.swap(compressed);
+      response.gzipped = true;
+    }
+  }
+  return response;
+}
+
+// writes the data at the configured bandwidth
+static void send(fake_serp& server, tcp::socket& socket, const std::string& data) {
+  std::size_t bandwidth = server.options().bandwidth;
+  if(bandwidth == 0) {
+    boost::asio::write(socket, boost::asio::buffer(data));
+    server.bytes += data.size();
+    return;
+  }
+  // in slices of 50ms
+  std::size_t slice = std::max<std::size_t>(1, bandwidth / 20);
+  auto started = std::chrono::steady_clock::now();
+  for(std::size_t sent = 0; sent < data.size(); ) {
+    std::size_t n = std::min(slice, data.size() - sent);
+    boost::asio::write(socket, boost::asio::buffer(data.data() + sent, n));
+    sent += n;
+    server.bytes += n;
+    std::this_thread::sleep_until(started + std::chrono::microseconds(sent * 1000000 / bandwidth));
+  }
+}
+
+// answers the requests of a connection, keeping it open between the
+// requests as curl expects
+static void serve(fake_serp& server, std::shared_ptr<tcp::socket> socket) {
+  boost::asio::streambuf input;
+  try {
+    for(;;) {
+      boost::asio::read_until(*socket, input, "\r\n\r\n");
+      std::istream in(&input);
+      std::string line, method, target, version;
+      std::getline(in, line);
+      std::istringstream request_line(line);
+      request_line >> method >> target >> version;
+
+      bool accepts_gzip = false;
+      bool keep_alive = version == "HTTP/1.1";
+      while(std::getline(in, line) && line != "\r" && !line.empty()) {
+        std::string header = line;
+        std::transform(header.begin(), header.end(), header.begin(),
+                       [](char c) { return (char)std::tolower((unsigned char)c); });
+        if(header.compare(0, 16, "accept-encoding:") == 0 && header.find("gzip") != std::string::npos) {
+          accepts_gzip = true;
+        } else if(header.compare(0, 11, "connection:") == 0) {
+          keep_alive = header.find("close") == std::string::npos;
+        }
+      }
+
+      http_response response = method == "GET" ?
+        server.answer(target, accepts_gzip) :
+        http_response{405, "Method Not Allowed", "method not allowed\n", false};
+
+      std::ostringstream headers;
+      headers << "HTTP/1.1 " << response.status << " " << response.reason << "\r\n"
+              << "Content-Type: text/html; charset=UTF-8\r\n"
+              << "Content-Length: " << response.body.size() << "\r\n";
+      if(response.gzipped) {
+        headers << "Content-Encoding: gzip\r\n";
+      }
+      if(response.status == 429) {
+        headers << "Retry-After: 60\r\n";
+      }
+      headers << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+      send(server, *socket, headers.str());
+      send(server, *socket, response.body);
+      if(!keep_alive) break;
+    }
+  } catch (const boost::system::system_error& e) {
+    if(e.code() != boost::asio::error::eof) {
+      BOOST_LOG_TRIVIAL(trace) << "Connection closed: " << e.what() << std::endl;
+    }
+  }
+  boost::system::error_code ignored;
+  socket->shutdown(tcp::socket::shutdown_both, ignored);
+}
+
+// log initialization; the server logs to the console
+static void init_log(bool verbose) {
+  logging::add_console_log
+    (std::clog,
+     keywords::format = "[%TimeStamp%][%ThreadID%][%Severity%]: %Message%"
+     );
+
+  logging::core::get()->set_filter
+    (logging::trivial::severity >= (verbose ? logging::trivial::trace : logging::trivial::info));
+
+  logging::add_common_attributes();
+}
@@ -0,0 +1,118 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// page_body.cc
+// the body of a downloaded result page, kept in pooled blocks while it
+// goes from the network threads to the parsers
+
+#include "page_body.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+namespace ranktracker {
+  namespace engine {
+
+    const std::size_t page_body::BLOCK_SIZE;
+
+    // the free blocks; past this many, the blocks given back are freed
+    static const std::size_t MAX_POOLED_BLOCKS = 4096;
+
+    static std::atomic<std::size_t> allocated(0);
+
+    struct block_pool {
+      std::mutex mutex;
+      std::vector<char *> blocks;
+
+      ~block_pool() {
+        for(auto b: blocks) delete[] b;
+      }
+    };
+
+    static block_pool pool;
+
+    static char *take_block() {
+      {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if(!pool.blocks.empty()) {
+          char *block = pool.blocks.back();
+          pool.blocks.pop_back();
+          return block;
+        }
+      }
+      allocated++;
+      return new char[page_body::BLOCK_SIZE];
+    }
+
+    // gives back all the blocks of a body at once
+    static void give_blocks(std::vector<char *>& blocks) {
+      if(blocks.empty()) return;
+      std::size_t kept;
+      {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        kept = std::min(blocks.size(), MAX_POOLED_BLOCKS - std::min(MAX_POOLED_BLOCKS, pool.blocks.size()));
+        pool.blocks.insert(pool.blocks.end(), blocks.begin(), blocks.begin() + kept);
+      }
+      for(std::size_t i = kept; i < blocks.size(); i++) {
+        delete[] blocks[i];
+        allocated--;
+      }
+      blocks.clear();
+    }
+
+    page_body::page_body(page_body&& other) : _blocks(std::move(other._blocks)), _size(other._size) {
+      other._blocks.clear();
+      other._size = 0;
+    }
+
+    page_body& page_body::operator=(page_body&& other) {
+      if(this != &other) {
+        clear();
+        _blocks.swap(other._blocks);
+        _size = other._size;
+        other._size = 0;
+      }
+      return *this;
+    }
+
+    void page_body::append(const char *data, std::size_t len) {
+      while(len > 0) {
+        std::size_t used = _size - (_blocks.empty() ? 0 : (_blocks.size() - 1) * BLOCK_SIZE);
+        if(_blocks.empty() || used == BLOCK_SIZE) {
+          _blocks.push_back(take_block());
+          used = 0;
+        }
+        std::size_t n = std::min(len, BLOCK_SIZE - used);
+        std::memcpy(_blocks.back() + used, data, n);
+        _size += n;
+        data += n;
+        len -= n;
+      }
+    }
+
+    void page_body::clear() {
+      // the vector keeps its buffer for the next page
+      give_blocks(_blocks);
+      _size = 0;
+    }
+
+    std::string page_body::str() const {
+      std::string s;
+      s.reserve(_size);
+      for(std::size_t i = 0; i < chunks(); i++) {
+        auto c = (*this)[i];
+        s.append(c.data, c.size);
+      }
+      return s;
+    }
+
+    std::size_t page_body::pooled_blocks() {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      return pool.blocks.size();
+    }
+
+    std::size_t page_body::allocated_blocks() {
+      return allocated;
+    }
+  }
+}
@@ -0,0 +1,78 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// page_body.hh
+// the body of a downloaded result page, kept in pooled blocks while it
+// goes from the network threads to the parsers
+
+#ifndef RANKTRACKER_PAGE_BODY_HH
+#define RANKTRACKER_PAGE_BODY_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * A page body as a list of fixed size blocks. The received chunks
+     * are copied once, into the last block, and the body is never
+     * reallocated or joined: the parsers read it block by block and the
+     * body is handed over between the threads by moving it. The blocks
+     * come from a pool shared by all the threads and go back to it when
+     * the body is cleared, so the pages after the first ones are read
+     * without allocations.
+     */
+    class page_body {
+    public:
+      // the largest chunk curl passes to a write callback (CURL_MAX_WRITE_SIZE)
+      static const std::size_t BLOCK_SIZE = 16384;
+
+      struct chunk {
+        const char *data;
+        std::size_t size;
+      };
+
+    private:
+      std::vector<char *> _blocks;
+      std::size_t _size;
+
+    public:
+      page_body() : _size(0) {}
+      ~page_body() { clear(); }
+
+      page_body(page_body&& other);
+      page_body& operator=(page_body&& other);
+
+      page_body(const page_body&) = delete;
+      page_body& operator=(const page_body&) = delete;
+
+      void append(const char *data, std::size_t len);
+
+      /**
+       * Empties the body, giving its blocks back to the pool.
+       */
+      void clear();
+
+      std::size_t size() const { return _size; }
+      bool empty() const { return _size == 0; }
+
+      std::size_t chunks() const { return _blocks.size(); }
+      chunk operator[](std::size_t i) const {
+        return {_blocks[i], i + 1 < _blocks.size() ? BLOCK_SIZE : _size - i * BLOCK_SIZE};
+      }
+
+      /**
+       * A copy of the whole body.
+       */
+      std::string str() const;
+
+      /**
+       * Blocks kept in the pool, and allocated since the start.
+       */
+      static std::size_t pooled_blocks();
+      static std::size_t allocated_blocks();
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,77 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// page_classifier.cc
+// early recognition of the pages returned by google instead of the
+// search results
+
+#include "page_classifier.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ranktracker {
+  namespace engine {
+
+    struct page_marker {
+      const char *text;
+      page_classifier::verdict_t verdict;
+    };
+
+    static const page_marker markers[] = {
+      {"id=\"main\"", page_classifier::RESULTS},
+      {"id=\"captcha-form\"", page_classifier::CAPTCHA},
+      {"action=\"/sorry/", page_classifier::CAPTCHA},
+      {"class=\"g-recaptcha\"", page_classifier::CAPTCHA},
+      {"detected unusual traffic", page_classifier::UNUSUAL_TRAFFIC},
+      {"action=\"https://consent.", page_classifier::CONSENT}
+    };
+
+    // the longest marker, less one character, is kept between chunks
+    static std::size_t markers_overlap() {
+      std::size_t len = 0;
+      for(auto& m: markers) len = std::max(len, std::strlen(m.text));
+      return len - 1;
+    }
+
+    page_classifier::verdict_t page_classifier::feed(const char *data, std::size_t len) {
+      if(_verdict != UNDECIDED || _scanned >= scan_limit) return _verdict;
+
+      len = std::min(len, scan_limit - _scanned);
+      _scanned += len;
+
+      std::string window;
+      window.reserve(_tail.size() + len);
+      window.append(_tail);
+      window.append(data, len);
+
+      // the marker found first in the page decides
+      std::size_t first = std::string::npos;
+      for(auto& m: markers) {
+        auto pos = window.find(m.text);
+        if(pos < first) {
+          first = pos;
+          _verdict = m.verdict;
+        }
+      }
+
+      static const std::size_t overlap = markers_overlap();
+      _tail = window.size() > overlap ? window.substr(window.size() - overlap) : window;
+      return _verdict;
+    }
+
+    void page_classifier::reset() {
+      _verdict = UNDECIDED;
+      _scanned = 0;
+      _tail.clear();
+    }
+
+    const char *page_classifier::verdict_name(verdict_t verdict) {
+      switch(verdict) {
+      case RESULTS: return "results";
+      case CAPTCHA: return "captcha";
+      case UNUSUAL_TRAFFIC: return "unusual traffic";
+      case CONSENT: return "consent";
+      default: return "undecided";
+      }
+    }
+  }
+}
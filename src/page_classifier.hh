@@ -0,0 +1,62 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// page_classifier.hh
+// early recognition of the pages returned by google instead of the
+// search results, from the first chunks of the response
+
+#ifndef RANKTRACKER_PAGE_CLASSIFIER_HH
+#define RANKTRACKER_PAGE_CLASSIFIER_HH
+
+#include <cstddef>
+#include <string>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * Scans the html of a response, chunk by chunk, for markers of the
+     * results pages and of the captcha, "unusual traffic" and consent
+     * pages, without building the DOM. The first marker found decides
+     * the page kind; the scan stops when the page kind is decided or
+     * after the first `scan_limit` bytes.
+     */
+    class page_classifier {
+    public:
+      enum verdict_t {
+        UNDECIDED,
+        RESULTS,
+        CAPTCHA,
+        UNUSUAL_TRAFFIC,
+        CONSENT
+      };
+
+    private:
+      verdict_t _verdict;
+      std::size_t _scanned;
+      std::string _tail;    // end of the previous chunk, for markers split between chunks
+
+    public:
+      static const std::size_t scan_limit = 256 * 1024;
+
+      page_classifier() : _verdict(UNDECIDED), _scanned(0) {}
+
+      /**
+       * Scans the next chunk of the page; returns the verdict so far.
+       */
+      verdict_t feed(const char *data, std::size_t len);
+
+      verdict_t verdict() const { return _verdict; }
+
+      /**
+       * True if the page was recognized as a page that replaces the
+       * results when google blocks the queries.
+       */
+      bool blocked() const { return _verdict == CAPTCHA || _verdict == UNUSUAL_TRAFFIC || _verdict == CONSENT; }
+
+      void reset();
+
+      static const char *verdict_name(verdict_t verdict);
+    };
+  }
+}
+
+#endif
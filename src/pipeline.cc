@@ -0,0 +1,480 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// pipeline.cc
+// the refresh queue processed by separate network, parser and database
+// stages
+
+#include "pipeline.hh"
+#include "ranking.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+namespace ranktracker {
+  namespace ranking {
+
+    using ranktracker::engine::SearchEngine;
+    using ranktracker::engine::GoogleEngine;
+    using ranktracker::engine::serp_walk;
+    using ranktracker::engine::serp_page;
+    using ranktracker::engine::query_options;
+    using ranktracker::engine::rank_query_result;
+    using ranktracker::engine::page_body;
+
+    /**
+     * A ranking going through the pipeline.
+     */
+    struct pipeline_task {
+      enum outcome_t {
+        RANKED,
+        FAILED,
+        RELEASED      // put back in the refresh queue
+      };
+
+      RefreshJob job;
+      RefreshUnit unit;
+      Keyword keyword;
+      Domain domain;
+      const SearchEngine *engine;
+      const GoogleEngine *google;       // NULL for the engines queried in one step
+      query_options options;
+      std::unique_ptr<serp_walk> walk;
+      page_body body;                   // the page waiting for a parser
+      rank_query_result result;         // the rank and the cost of the query
+      std::chrono::steady_clock::time_point started;
+      unsigned attempts;                // failed attempts of the ranking query
+      bool parse_retried;
+      std::chrono::steady_clock::time_point not_before;
+      outcome_t outcome;
+
+      pipeline_task(const RefreshJob& j, const RefreshUnit& u) :
+        job(j),
+        unit(u),
+        engine(NULL),
+        google(NULL),
+        attempts(0),
+        parse_retried(false),
+        outcome(FAILED)
+      {}
+    };
+
+    static std::int64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void RefreshPipeline::stage::queued(std::size_t n) {
+      auto crt = max_queued.load();
+      while(n > crt && !max_queued.compare_exchange_weak(crt, n)) {}
+    }
+
+    stage_stats RefreshPipeline::stage::stats() const {
+      stage_stats st;
+      st.name = name;
+      st.threads = threads;
+      st.items = items;
+      st.busy = std::chrono::microseconds(busy_us);
+      st.idle = std::chrono::microseconds(idle_us);
+      st.max_queued = max_queued;
+      return st;
+    }
+
+    static unsigned parser_threads(const pipeline_options& options) {
+      if(options.parser_threads > 0) return options.parser_threads;
+      return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    RefreshPipeline::RefreshPipeline(DataProvider& db,
+                                     RefreshQueue& queue,
+                                     ranktracker::engine::EngineResilience& resilience,
+                                     const std::atomic<bool>& stopping,
+                                     const pipeline_options& options) :
+      _db(db),
+      _queue(queue),
+      _resilience(resilience),
+      _stopping(stopping),
+      _options(options),
+      // every task fits in any queue, so the stages pushing back into
+      // the network queue never wait for each other
+      _fetch(std::max<std::size_t>(1, options.max_in_flight)),
+      _parse(std::max<std::size_t>(1, options.max_in_flight)),
+      _store(std::max<std::size_t>(1, options.max_in_flight)),
+      _network("network", std::max(1u, options.network_threads)),
+      _parser("parser", parser_threads(options)),
+      _writer("writer", 1),
+      _in_flight(0)
+    {
+      _options.max_in_flight = std::max<std::size_t>(1, options.max_in_flight);
+    }
+
+    RefreshPipeline::~RefreshPipeline() {}
+
+    void RefreshPipeline::to_fetch(task_ptr t) {
+      _network.queued(_fetch.size() + 1);
+      _fetch.push(std::move(t));
+    }
+
+    void RefreshPipeline::to_parse(task_ptr t) {
+      _parser.queued(_parse.size() + 1);
+      _parse.push(std::move(t));
+    }
+
+    void RefreshPipeline::to_store(task_ptr t) {
+      _writer.queued(_store.size() + 1);
+      _store.push(std::move(t));
+    }
+
+    bool RefreshPipeline::start_task(task_ptr& t) {
+      try {
+        auto const& e = ranktracker::engine::search_engines().at(t->unit._engid);
+        t->engine = &*e;
+        t->google = dynamic_cast<const GoogleEngine *>(t->engine);
+        create_transaction trans(&_db, MDB_RDONLY);
+        t->keyword = _db.keyword(t->unit._kwdid);
+        t->domain = _db.domain(t->unit._domid);
+        t->options = domain_query_options(_db, t->keyword, t->domain, *t->engine);
+        trans.commit();
+      } catch (NotFoundException) {
+        BOOST_LOG_TRIVIAL(warning) << "Keyword or domain of a queued refresh was deleted\n";
+        _queue.fail(t->job, t->unit);
+        return false;
+      } catch (std::out_of_range) {
+        BOOST_LOG_TRIVIAL(warning) << "Search engine of a queued refresh is not available\n";
+        _queue.fail(t->job, t->unit);
+        return false;
+      }
+
+      if(!_resilience.admit(*t->engine)) {
+        _queue.release(t->job, t->unit);
+        return false;
+      }
+      BOOST_LOG_TRIVIAL(trace) << "RefreshPipeline: domain '" << t->domain.name() << "', keywords '"
+                               << t->keyword.value() << "', engine " << t->engine->name() << std::endl;
+      t->started = std::chrono::steady_clock::now();
+      return true;
+    }
+
+    // must be called from the catch block of the failure
+    void RefreshPipeline::page_failed(task_ptr t) {
+      auto const& e = *t->engine;
+      bool retry = false;
+      switch(_resilience.failed(e)) {
+      case ranktracker::engine::FAILURE_THROTTLED:
+        if(!_resilience.available(e)) {
+          BOOST_LOG_TRIVIAL(warning) << "Engine paused; the refresh unit is put back in the queue\n";
+          t->outcome = pipeline_task::RELEASED;
+          to_store(std::move(t));
+          return;
+        }
+        retry = ++t->attempts < _resilience.options().max_attempts;
+        break;
+      case ranktracker::engine::FAILURE_TRANSIENT:
+        retry = ++t->attempts < _resilience.options().max_attempts;
+        break;
+      case ranktracker::engine::FAILURE_PARSE:
+        retry = !t->parse_retried;
+        t->parse_retried = true;
+        break;
+      case ranktracker::engine::FAILURE_PERMANENT:
+        break;
+      }
+
+      if(retry) {
+        auto delay = _resilience.backoff(t->attempts);
+        BOOST_LOG_TRIVIAL(warning) << "ranking query for '" << t->keyword.value() << "' on " << e.name()
+                                   << " failed; retrying in " << delay.count() << "ms\n";
+        t->not_before = std::chrono::steady_clock::now() + delay;
+        to_fetch(std::move(t));
+        return;
+      }
+
+      BOOST_LOG_TRIVIAL(error) << "ranking query for '" << t->keyword.value() << "' on " << e.name()
+                               << " failed after " << t->attempts + 1 << " attempts\n";
+      _resilience.abandoned(e);
+      t->outcome = pipeline_task::FAILED;
+      to_store(std::move(t));
+    }
+
+    void RefreshPipeline::network_loop() {
+      CURL *session = NULL;
+      std::vector<task_ptr> delayed;    // tasks waiting for the delay of their next page
+      auto by_time = [](const task_ptr& a, const task_ptr& b) { return a->not_before < b->not_before; };
+
+      for(;;) {
+        task_ptr t;
+        auto now = std::chrono::steady_clock::now();
+        auto due = std::min_element(delayed.begin(), delayed.end(), by_time);
+        if(due != delayed.end() && ((*due)->not_before <= now || _stopping)) {
+          t = std::move(*due);
+          delayed.erase(due);
+        } else if(!_fetch.try_pop(t)) {
+          if(delayed.empty()) {
+            std::chrono::microseconds waited(0);
+            bool popped = _fetch.pop(t, waited);
+            _network.idle_us += waited.count();
+            if(!popped) break;
+          } else {
+            auto wait = std::min<std::chrono::steady_clock::duration>((*due)->not_before - now,
+                                                                      std::chrono::milliseconds(10));
+            std::this_thread::sleep_for(wait);
+            _network.idle_us += std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+            continue;
+          }
+        }
+
+        if(_stopping) {
+          // the pages not downloaded yet are left for the next run
+          t->outcome = pipeline_task::RELEASED;
+          to_store(std::move(t));
+          continue;
+        }
+        if(t->not_before > std::chrono::steady_clock::now()) {
+          delayed.push_back(std::move(t));
+          continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+          if(t->google) {
+            if(session == NULL && (session = curl_easy_init()) == NULL) {
+              BOOST_LOG_TRIVIAL(error) << "RefreshPipeline: curl session could not be initialized\n";
+              throw ranktracker::engine::http_init_exception();
+            }
+            if(!t->walk) {
+              t->walk.reset(new serp_walk(t->google->start_walk(session, t->keyword.value(), t->options)));
+            }
+            t->body.clear();
+            t->result.traffic += t->google->download_page(session, t->walk->next_url(), t->body);
+          } else {
+            // engines without separate result pages are queried in one step
+            progress_updater ignore_progress = [](int) {};
+            t->result = t->engine->query(t->domain.name(), t->keyword.value(), ignore_progress, t->options);
+            _resilience.succeeded(*t->engine);
+            t->outcome = pipeline_task::RANKED;
+          }
+        } catch (...) {
+          _network.busy_us += elapsed_us(start);
+          page_failed(std::move(t));
+          continue;
+        }
+        _network.busy_us += elapsed_us(start);
+        _network.items++;
+        if(t->google) {
+          t->result.fetch_time += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()
+                                                                                        - start);
+        }
+
+        if(t->google) {
+          to_parse(std::move(t));
+        } else {
+          to_store(std::move(t));
+        }
+      }
+
+      if(session) {
+        curl_easy_cleanup(session);
+      }
+    }
+
+    void RefreshPipeline::parser_loop() {
+      for(;;) {
+        task_ptr t;
+        std::chrono::microseconds waited(0);
+        bool popped = _parse.pop(t, waited);
+        _parser.idle_us += waited.count();
+        if(!popped) break;
+
+        auto start = std::chrono::steady_clock::now();
+        bool more;
+        try {
+          auto page = t->google->parse_page(t->body, t->domain.name(), t->walk->remaining());
+          // the blocks go back to the pool for the next downloads
+          t->body.clear();
+          more = t->google->next_page(*t->walk, page);
+        } catch (...) {
+          _parser.busy_us += elapsed_us(start);
+          page_failed(std::move(t));
+          continue;
+        }
+        _parser.busy_us += elapsed_us(start);
+        _parser.items++;
+        t->result.extract_time += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()
+                                                                                        - start);
+
+        if(more) {
+          BOOST_LOG_TRIVIAL(trace) << "RefreshPipeline: next page - " << t->walk->next_url() << std::endl;
+          auto delay = t->google->page_delay();
+          t->not_before = std::chrono::steady_clock::now() + delay;
+          t->result.wait_time += delay;
+          to_fetch(std::move(t));
+        } else {
+          _resilience.succeeded(*t->engine);
+          t->result.rank = t->walk->rank();
+          t->result.page_url = t->walk->page_url();
+          t->result.serp = t->walk->serp();
+          t->outcome = pipeline_task::RANKED;
+          to_store(std::move(t));
+        }
+      }
+    }
+
+    void RefreshPipeline::writer_loop(progress_updater p) {
+      int completed = 0;
+      for(;;) {
+        task_ptr t;
+        std::chrono::microseconds waited(0);
+        bool popped = _store.pop(t, waited);
+        _writer.idle_us += waited.count();
+        if(!popped) break;
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+          switch(t->outcome) {
+          case pipeline_task::RANKED:
+            {
+              // the total includes the time spent in the pipeline's queues
+              t->result.total_time = std::chrono::duration_cast<std::chrono::milliseconds>
+                (std::chrono::steady_clock::now() - t->started);
+              QueryTelemetry telemetry(t->result);
+              _queue.complete(t->job, t->unit, t->keyword, *t->engine,
+                              {second_clock::local_time(), t->result.rank, t->result.page_url}, &telemetry,
+                              &t->result.serp);
+            }
+            completed++;
+            break;
+          case pipeline_task::FAILED:
+            _queue.fail(t->job, t->unit);
+            completed++;
+            break;
+          case pipeline_task::RELEASED:
+            _queue.release(t->job, t->unit);
+            break;
+          }
+          if(t->google) {
+            ranktracker::engine::record_transfer(t->result.traffic);
+          }
+
+          if(t->outcome != pipeline_task::RELEASED) {
+            auto st = _queue.stats();
+            BOOST_LOG_TRIVIAL(info) << "Refresh queue: " << st.remaining() << " units left, "
+                                    << st.units_per_hour << " units/hour, eta " << st.eta << std::endl;
+          }
+        } catch (...) {
+          BOOST_LOG_TRIVIAL(error) << "Database error while storing a ranking of the refresh queue\n";
+          std::lock_guard<std::mutex> lock(_mutex);
+          if(!_failure) _failure = std::current_exception();
+        }
+        _writer.busy_us += elapsed_us(start);
+        _writer.items++;
+        p(completed * 100);
+
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _in_flight--;
+        }
+        _finished.notify_all();
+      }
+    }
+
+    void RefreshPipeline::run(progress_updater p) {
+      BOOST_LOG_TRIVIAL(trace) << "RefreshPipeline::run() called\n";
+      std::vector<std::thread> threads;
+      for(unsigned i = 0; i < _network.threads; i++) {
+        threads.push_back(std::thread(&RefreshPipeline::network_loop, this));
+      }
+      for(unsigned i = 0; i < _parser.threads; i++) {
+        threads.push_back(std::thread(&RefreshPipeline::parser_loop, this));
+      }
+      threads.push_back(std::thread(&RefreshPipeline::writer_loop, this, p));
+
+      auto available = [this](const AbstractEntity::id_type& engine_id) {
+        auto const& engines = ranktracker::engine::search_engines();
+        auto e = engines.find(engine_id);
+        // units of unknown engines are taken, to be marked as failed
+        return e == engines.end() || _resilience.available(*e->second);
+      };
+
+      try {
+        while(!_stopping) {
+          {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(_failure) break;
+            if(_in_flight >= _options.max_in_flight) {
+              // backpressure: the stages are behind
+              _finished.wait_for(lock, std::chrono::seconds(1));
+              continue;
+            }
+          }
+
+          RefreshJob job;
+          RefreshUnit unit;
+          if(_queue.claim(job, unit, available)) {
+            task_ptr t(new pipeline_task(job, unit));
+            if(start_task(t)) {
+              {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _in_flight++;
+              }
+              to_fetch(std::move(t));
+            }
+            continue;
+          }
+
+          {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(_in_flight > 0) {
+              _finished.wait_for(lock, std::chrono::seconds(1));
+              continue;
+            }
+          }
+          if(_queue.stats().pending == 0) break;
+
+          // only units of paused engines are left
+          auto next_probe = _resilience.next_probe();
+          auto wait = next_probe == ranktracker::engine::resilience_clock::time_point::max() ?
+            std::chrono::seconds(1) :
+            std::chrono::duration_cast<std::chrono::seconds>(next_probe - ranktracker::engine::resilience_clock::now());
+          BOOST_LOG_TRIVIAL(info) << "All engines with queued refreshes are paused; waiting "
+                                  << wait.count() << "s\n";
+          auto until = std::chrono::steady_clock::now() + std::max(wait, std::chrono::seconds(1));
+          while(!_stopping && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+          }
+        }
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Database error while claiming the units of the refresh queue\n";
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_failure) _failure = std::current_exception();
+      }
+
+      // the tasks in the pipeline are finished before the stages stop
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _finished.wait(lock, [this]() { return _in_flight == 0; });
+      }
+      _fetch.close();
+      _parse.close();
+      _store.close();
+      for(auto& t: threads) {
+        t.join();
+      }
+
+      for(auto& st: stats()) {
+        BOOST_LOG_TRIVIAL(info) << "Pipeline stage " << st.name << ": " << st.threads << " threads, "
+                                << st.items << " items, " << (int)(st.utilisation() * 100) << "% busy, "
+                                << st.busy.count() / 1000 << "ms busy, at most " << st.max_queued
+                                << " items queued\n";
+      }
+      BOOST_LOG_TRIVIAL(info) << "Pipeline page buffers: " << page_body::allocated_blocks() << " blocks of "
+                              << page_body::BLOCK_SIZE << " bytes allocated, " << page_body::pooled_blocks()
+                              << " free\n";
+      BOOST_LOG_TRIVIAL(trace) << "RefreshPipeline::run() exit\n";
+      if(_failure) {
+        std::rethrow_exception(_failure);
+      }
+    }
+
+    std::vector<stage_stats> RefreshPipeline::stats() const {
+      return {_network.stats(), _parser.stats(), _writer.stats()};
+    }
+  }
+}
@@ -0,0 +1,140 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// pipeline.hh
+// the refresh queue processed by separate network, parser and database
+// stages
+
+#ifndef RANKTRACKER_PIPELINE_HH
+#define RANKTRACKER_PIPELINE_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bounded_queue.hh"
+#include "data_provider.hh"
+#include "progress.hh"
+#include "refresh_queue.hh"
+#include "resilience.hh"
+
+namespace ranktracker {
+  namespace ranking {
+    using namespace ranktracker::data;
+    using namespace ranktracker::persistence;
+    using namespace ranktracker::progress;
+
+    struct pipeline_options {
+      unsigned network_threads;     // pages downloaded at the same time
+      unsigned parser_threads;      // 0 for one parser for each core
+      std::size_t max_in_flight;    // rankings in the pipeline at the same time
+
+      pipeline_options() : network_threads(1), parser_threads(0), max_in_flight(64) {}
+    };
+
+    /**
+     * Utilisation of a pipeline stage.
+     */
+    struct stage_stats {
+      std::string name;
+      unsigned threads;
+      std::uint64_t items;              // pages or rankings processed
+      std::chrono::microseconds busy;   // time spent processing, all threads
+      std::chrono::microseconds idle;   // time spent waiting for work
+      std::size_t max_queued;           // most items waiting for the stage
+
+      double utilisation() const {
+        auto total = busy.count() + idle.count();
+        return total > 0 ? (double)busy.count() / total : 0;
+      }
+    };
+
+    struct pipeline_task;
+
+    /**
+     * Runs the refresh queue in three stages connected by bounded
+     * queues: the network stage downloads the result pages, a pool of
+     * parsers, one for each core, parses them and looks for the domains,
+     * and a single writer stores the rankings and updates the queue. A
+     * ranking whose domain is not on the page goes back to the network
+     * stage for the next page, after the page delay of its engine; the
+     * network threads download the pages of other rankings meanwhile.
+     *
+     * The number of rankings in the pipeline is limited, so new units
+     * are only claimed from the refresh queue when the slowest stage
+     * keeps up. Failed pages are retried with the backoff and the
+     * circuit breakers of `EngineResilience`.
+     */
+    class RefreshPipeline {
+      struct stage {
+        std::string name;
+        unsigned threads;
+        std::atomic<std::uint64_t> items;
+        std::atomic<std::int64_t> busy_us;
+        std::atomic<std::int64_t> idle_us;
+        std::atomic<std::size_t> max_queued;
+
+        stage(const std::string& n, unsigned t) :
+          name(n), threads(t), items(0), busy_us(0), idle_us(0), max_queued(0) {}
+
+        void queued(std::size_t n);
+        stage_stats stats() const;
+      };
+
+      typedef std::unique_ptr<pipeline_task> task_ptr;
+
+      DataProvider& _db;
+      RefreshQueue& _queue;
+      ranktracker::engine::EngineResilience& _resilience;
+      const std::atomic<bool>& _stopping;
+      pipeline_options _options;
+
+      bounded_queue<task_ptr> _fetch;
+      bounded_queue<task_ptr> _parse;
+      bounded_queue<task_ptr> _store;
+      stage _network;
+      stage _parser;
+      stage _writer;
+
+      std::mutex _mutex;
+      std::condition_variable _finished;  // a task left the pipeline
+      std::size_t _in_flight;
+      std::exception_ptr _failure;         // database error of the writer
+
+      bool start_task(task_ptr& t);
+      void to_fetch(task_ptr t);
+      void to_parse(task_ptr t);
+      void to_store(task_ptr t);
+      void page_failed(task_ptr t);
+
+      void network_loop();
+      void parser_loop();
+      void writer_loop(progress_updater p);
+
+    public:
+      RefreshPipeline(DataProvider& db,
+                      RefreshQueue& queue,
+                      ranktracker::engine::EngineResilience& resilience,
+                      const std::atomic<bool>& stopping,
+                      const pipeline_options& options = pipeline_options());
+      ~RefreshPipeline();
+
+      RefreshPipeline(const RefreshPipeline&) = delete;
+      RefreshPipeline& operator= (const RefreshPipeline&) = delete;
+
+      /**
+       * Processes the refresh queue until it is empty or the stopping
+       * flag is set; see `RankingService::run_refresh_pipeline`.
+       */
+      void run(progress_updater p);
+
+      std::vector<stage_stats> stats() const;
+    };
+  }
+}
+
+#endif
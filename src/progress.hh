@@ -6,6 +6,9 @@
 #define RANKTRACKER_PROGRESS_H
 
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace ranktracker {
   namespace progress {
@@ -52,6 +55,42 @@ namespace ranktracker {
         BOOST_LOG_TRIVIAL(trace) << "offset_progress_updater::operator() exit\n";
       }
     };
+
+    /**
+     * Merges the progress of tasks running concurrently. Each task
+     * reports its progress through its own `stream(i)` updater and the
+     * target updater receives the sum of the progress of all the tasks,
+     * as if the tasks were run one after the other. The target updater
+     * is called with a lock held, from the threads of the tasks.
+     */
+    class merging_progress_updater {
+      struct merged_state {
+        std::mutex mutex;
+        std::vector<int> progress;
+        progress_updater target_updater;
+      };
+      std::shared_ptr<merged_state> _state;
+    public:
+      merging_progress_updater(std::size_t streams, progress_updater target_updater)
+        : _state(std::make_shared<merged_state>())
+      {
+        _state->progress.resize(streams, 0);
+        _state->target_updater = target_updater;
+      }
+
+      progress_updater stream(std::size_t i) {
+        auto state = _state;
+        return [state, i](int progress) {
+          BOOST_LOG_TRIVIAL(trace) << "merging_progress_updater: stream " << i
+                                   << " progress = " << progress << std::endl;
+          std::lock_guard<std::mutex> lock(state->mutex);
+          state->progress[i] = progress;
+          int total = 0;
+          for(auto p: state->progress) total += p;
+          state->target_updater(total);
+        };
+      }
+    };
   }
 }
 
@@ -5,34 +5,97 @@
 
 #include "ranking.hh"
 
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <thread>
+
 namespace ranktracker {
   namespace ranking {
 
+    ranktracker::engine::query_options
+    domain_query_options(const DataProvider& db, const Keyword& k, const Domain& d,
+                         const ranktracker::engine::SearchEngine& e) {
+      ranktracker::engine::query_options options;
+      options.max_depth = d.maxDepth();
+      if(d.adaptiveDepth()) {
+        try {
+          options.last_rank = db.last_ranking(k, e)._rank;
+        } catch (NotFoundException) {
+          // never ranked: a full search
+        }
+      }
+      return options;
+    }
+
     void RankingService::refresh_ranking(const Keyword& k, const Domain& d, progress_updater p) {
       BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) called\n";
       BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(): "
                                << "domain '" << d.name() << "', keywords '" << k.value() << "'\n";
-      auto const engines = d.engines();
-      int crt_progress = 0;
-      progress_updater _p(tracking_progress_updater(crt_progress, p)); // _p updates ctr_progress
+      std::vector<SearchEngineRef> engines(d.engines().begin(), d.engines().end());
       auto ranking_date = second_clock::local_time();
 
-      for(auto i = engines.begin(); i != engines.end(); i++) {
-        std::string page_url = "";
-        auto const &e = *i;
+      struct engine_result {
+        bool ok;
+        ranktracker::engine::rank_result_type rank;
+        std::string page_url;
+        ranktracker::engine::rank_query_result details;
+      };
+
+      // the engines are independent hosts, so they are queried at the
+      // same time; each query reports its progress between 1 and 100
+      merging_progress_updater merged(engines.size(), p);
+      std::vector<std::future<engine_result>> results;
+      for(std::size_t i = 0; i < engines.size(); i++) {
         BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(): "
                                  << "perfomm ranking query for engine: "
-                                 << e.name() << std::endl;
-        BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) current progress = "
-                                 << crt_progress;
-        // __p receives values between 1 and 100
-        progress_updater __p(offset_progress_updater(crt_progress, _p));
-        auto rank = e.perform_rank_query(d.name(), k.value(), __p, &page_url);
-        BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) save storing to db\n";
-        _db.storeRanking(k, *e, {ranking_date, rank, page_url});
-        BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) storing saved to db\n";
-        BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) exit\n";
+                                 << engines[i].name() << std::endl;
+        auto options = domain_query_options(_db, k, d, *engines[i]);
+        results.push_back(std::async(std::launch::async,
+                                     [this, &engines, i, &merged, &d, &k, options]() {
+            engine_result r = {false, -1, "", {}};
+            auto const& e = engines[i];
+            progress_updater __p(merged.stream(i));
+            try {
+              r.rank = _resilience.perform_rank_query(*e, d.name(), k.value(), __p, &r.page_url, options,
+                                                    &r.details);
+              r.ok = true;
+            } catch (ranktracker::engine::circuit_open_exception) {
+              BOOST_LOG_TRIVIAL(warning) << "RankingService::refresh_ranking(): queries to "
+                                         << e.name() << " are paused; skipping the engine\n";
+              __p(100);
+            } catch (ranktracker::engine::search_exception) {
+              BOOST_LOG_TRIVIAL(error) << "RankingService::refresh_ranking(): ranking query failed on "
+                                       << e.name() << "; skipping the engine\n";
+              __p(100);
+            }
+            return r;
+          }));
+      }
+
+      // the rankings are stored by the calling thread, which owns the
+      // transaction
+      std::exception_ptr failure;
+      for(std::size_t i = 0; i < results.size(); i++) {
+        try {
+          auto r = results[i].get();
+          if(r.ok) {
+            BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) save storing to db\n";
+            _db.storeRanking(k, *engines[i], {ranking_date, r.rank, r.page_url});
+            _db.storeTelemetry(k, *engines[i], ranking_date, QueryTelemetry(r.details));
+            if(!r.details.serp.empty()) {
+              _db.storeSerp(k, *engines[i], ranking_date, r.details.serp);
+            }
+            BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) storing saved to db\n";
+          }
+        } catch (...) {
+          if(!failure) failure = std::current_exception();
+        }
       }
+      if(failure) {
+        std::rethrow_exception(failure);
+      }
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(keyword, domain) exit\n";
     }
 
     void RankingService::refresh_ranking(const Domain& d, progress_updater p) {
@@ -51,5 +114,141 @@ namespace ranktracker {
       }
       BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(domain) exit\n";
     }
+
+    void RankingService::enqueue_refresh(const std::vector<Domain>& ds) {
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::enqueue_refresh() called\n";
+      _queue.enqueue(ds);
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::enqueue_refresh() exit\n";
+    }
+
+    bool RankingService::engine_available(const AbstractEntity::id_type& engine_id) {
+      auto const& engines = ranktracker::engine::search_engines();
+      auto e = engines.find(engine_id);
+      // units of unknown engines are taken, to be marked as failed
+      return e == engines.end() || _resilience.available(*e->second);
+    }
+
+    void RankingService::enqueue_scheduled_refresh(const std::vector<Domain>& ds,
+                                                   const schedule_options& options) {
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::enqueue_scheduled_refresh() called\n";
+      std::vector<RefreshUnit> units;
+      // the units still waiting will spend the budget too
+      std::size_t queued = _queue.remaining();
+      {
+        create_transaction trans(&_db, MDB_RDONLY);
+        units = RefreshScheduler(_db).plan(ds, options, queued);
+        trans.commit();
+      }
+      _queue.enqueue(units);
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::enqueue_scheduled_refresh() exit\n";
+    }
+
+    void RankingService::run_refresh_queue(progress_updater p) {
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::run_refresh_queue() called\n";
+      int completed = 0;
+      RefreshJob job;
+      RefreshUnit unit;
+      auto available = [this](const AbstractEntity::id_type& engine_id) { return engine_available(engine_id); };
+      while(!_stopping) {
+        if(!_queue.claim(job, unit, available)) {
+          if(_queue.stats().pending == 0) break;
+
+          // only units of paused engines are left
+          auto next_probe = _resilience.next_probe();
+          auto wait = next_probe == ranktracker::engine::resilience_clock::time_point::max() ?
+            std::chrono::seconds(1) :
+            std::chrono::duration_cast<std::chrono::seconds>(next_probe - ranktracker::engine::resilience_clock::now());
+          BOOST_LOG_TRIVIAL(info) << "All engines with queued refreshes are paused; waiting "
+                                  << wait.count() << "s\n";
+          auto until = std::chrono::steady_clock::now() + std::max(wait, std::chrono::seconds(1));
+          while(!_stopping && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+          }
+          continue;
+        }
+
+        progress_updater _p(offset_progress_updater(completed * 100, p));
+        try {
+          auto const& e = ranktracker::engine::search_engines().at(unit._engid);
+          Keyword k;
+          Domain d;
+          ranktracker::engine::query_options options;
+          {
+            create_transaction trans(&_db, MDB_RDONLY);
+            k = _db.keyword(unit._kwdid);
+            d = _db.domain(unit._domid);
+            options = domain_query_options(_db, k, d, *e);
+            trans.commit();
+          }
+          BOOST_LOG_TRIVIAL(trace) << "RankingService::run_refresh_queue(): "
+                                   << "domain '" << d.name() << "', keywords '" << k.value()
+                                   << "', engine " << e.name() << std::endl;
+          std::string page_url = "";
+          ranktracker::engine::rank_query_result details;
+          auto rank = _resilience.perform_rank_query(*e, d.name(), k.value(), _p, &page_url, options, &details);
+          QueryTelemetry telemetry(details);
+          _queue.complete(job, unit, k, *e, {second_clock::local_time(), rank, page_url}, &telemetry,
+                          &details.serp);
+        } catch (ranktracker::engine::circuit_open_exception) {
+          BOOST_LOG_TRIVIAL(warning) << "Engine paused; the refresh unit is put back in the queue\n";
+          _queue.release(job, unit);
+          _p(0);
+          continue;
+        } catch (NotFoundException) {
+          BOOST_LOG_TRIVIAL(warning) << "Keyword or domain of a queued refresh was deleted\n";
+          _queue.fail(job, unit);
+        } catch (std::out_of_range) {
+          BOOST_LOG_TRIVIAL(warning) << "Search engine of a queued refresh is not available\n";
+          _queue.fail(job, unit);
+        } catch (ranktracker::engine::search_exception) {
+          BOOST_LOG_TRIVIAL(error) << "Ranking query failed for a queued refresh\n";
+          _queue.fail(job, unit);
+        }
+        completed++;
+        _p(100);
+
+        auto st = _queue.stats();
+        BOOST_LOG_TRIVIAL(info) << "Refresh queue: " << st.remaining() << " units left, "
+                                << st.units_per_hour << " units/hour, eta " << st.eta << std::endl;
+      }
+      if(_stopping) {
+        BOOST_LOG_TRIVIAL(info) << "Refresh queue stopped; " << _queue.remaining() << " units left in the queue\n";
+      }
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::run_refresh_queue() exit\n";
+    }
+
+    void RankingService::run_refresh_pipeline(progress_updater p, const pipeline_options& options) {
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::run_refresh_pipeline() called\n";
+      RefreshPipeline pipeline(_db, _queue, _resilience, _stopping, options);
+      pipeline.run(p);
+      if(_stopping) {
+        BOOST_LOG_TRIVIAL(info) << "Refresh queue stopped; " << _queue.remaining() << " units left in the queue\n";
+      }
+      BOOST_LOG_TRIVIAL(trace) << "RankingService::run_refresh_pipeline() exit\n";
+    }
+
+    std::vector<std::pair<Domain, ranktracker::engine::rank_result_type>>
+    RankingService::tracked_ranks(const Keyword& k, const ranktracker::engine::SearchEngine& e,
+                                  const ptime& ranking_date) {
+      std::vector<Domain> ds;
+      std::vector<ranktracker::engine::serp_result> serp;
+      {
+        create_transaction trans(&_db, MDB_RDONLY);
+        ds = _db.domains();
+        serp = _db.serp(k, e, ranking_date);
+        trans.commit();
+      }
+
+      // all the domains are matched in one pass over the results
+      ranktracker::engine::domain_matcher matcher;
+      for(auto& d: ds) matcher.add(d.name());
+      auto ranks = ranktracker::engine::serp_ranks(serp, matcher);
+
+      std::vector<std::pair<Domain, ranktracker::engine::rank_result_type>> rs;
+      for(std::size_t i = 0; i < ds.size(); i++) {
+        if(ranks[i] > 0) rs.push_back({ds[i], ranks[i]});
+      }
+      return rs;
+    }
   }
 }
@@ -6,8 +6,14 @@
 #ifndef RANCKTRACKER_RANKING_H
 #define RANCKTRACKER_RANKING_H
 
+#include <atomic>
+
 #include "data_provider.hh"
+#include "pipeline.hh"
 #include "progress.hh"
+#include "refresh_queue.hh"
+#include "resilience.hh"
+#include "scheduler.hh"
 
 namespace ranktracker {
   namespace ranking {
@@ -15,12 +21,26 @@ namespace ranktracker {
     using namespace ranktracker::persistence;
     using namespace ranktracker::progress;
 
+    /**
+     * The search depth of the domain and, for the adaptive search, the
+     * last rank of the keyword on the engine; expects a transaction to
+     * be opened.
+     */
+    ranktracker::engine::query_options
+    domain_query_options(const DataProvider& db, const Keyword& k, const Domain& d,
+                         const ranktracker::engine::SearchEngine& e);
+
     class RankingService {
       DataProvider& _db;
+      RefreshQueue _queue;
+      ranktracker::engine::EngineResilience _resilience;
+      std::atomic<bool> _stopping;
+
+      bool engine_available(const AbstractEntity::id_type& engine_id);
 
     public:
 
-      RankingService(DataProvider& db) : _db(db) {}
+      RankingService(DataProvider& db) : _db(db), _queue(db), _stopping(false) {}
 
       /**
        * The basic functionality defined in updating the
@@ -36,6 +56,15 @@ namespace ranktracker {
        * ranking will take into consideration the position of
        * the given `Domain`, but will store into the database for
        * the `Domain` the `Keyword` was actually configured for.
+       *
+       * The queries are retried on transient failures; an engine that
+       * keeps failing or is paused because it throttles the queries is
+       * skipped and the other engines are still refreshed.
+       *
+       * The engines are queried concurrently, so the call takes about as
+       * long as the slowest engine. The rankings are stored by the
+       * calling thread once all the queries are finished, with the same
+       * ranking date. The progress goes up to 100 for each engine.
        */
       void refresh_ranking(const Keyword& k, const Domain& d, progress_updater p);
 
@@ -67,6 +96,70 @@ namespace ranktracker {
         }
         BOOST_LOG_TRIVIAL(trace) << "RankingService::refresh_ranking(domains list) exit\n";
       }
+
+      /**
+       * Add a job refreshing all the keywords of the given domains to
+       * the refresh queue. Must be called without a transaction opened.
+       */
+      void enqueue_refresh(const std::vector<Domain>& ds);
+
+      /**
+       * Add a job to the refresh queue with the keywords of the given
+       * domains selected by the `RefreshScheduler`: the rankings about
+       * to exceed the maximum staleness and the most volatile ones, up
+       * to what is left of the daily budget. Must be called without a
+       * transaction opened.
+       */
+      void enqueue_scheduled_refresh(const std::vector<Domain>& ds, const schedule_options& options);
+
+      /**
+       * Refresh the rankings waiting in the refresh queue, including the
+       * ones left by an interrupted run, until the queue is empty. Every
+       * ranking is committed as soon as it is obtained, so this must be
+       * called without a transaction opened. A failed ranking query
+       * marks its unit as failed and the refresh continues with the
+       * next unit. While an engine is paused by its circuit breaker its
+       * units are left in the queue and the units of the other engines
+       * are processed; when only paused units are left, the call waits
+       * for the first engine to become available again.
+       *
+       * The progress advances by 100 for each unit.
+       *
+       * Several threads may run the queue at the same time, each one
+       * processing different units. After `stop()` is called, the call
+       * returns as soon as the unit in flight is finished, leaving the
+       * rest of the units in the queue.
+       */
+      void run_refresh_queue(progress_updater p);
+
+      /**
+       * Refresh the rankings waiting in the refresh queue like
+       * `run_refresh_queue`, through a `RefreshPipeline`: the pages are
+       * downloaded, parsed and stored by separate threads, so the
+       * rankings of several units are in progress at the same time. The
+       * progress advances by 100 for each unit. After `stop()` is
+       * called, the pages being downloaded or parsed are finished and
+       * the rest of the units are left in the queue.
+       */
+      void run_refresh_pipeline(progress_updater p, const pipeline_options& options = pipeline_options());
+
+      /**
+       * The ranks of all the tracked domains in the results stored with
+       * a ranking, the domain of the keyword and its competitors alike;
+       * the domains that are not in the results are left out.
+       */
+      std::vector<std::pair<Domain, ranktracker::engine::rank_result_type>>
+      tracked_ranks(const Keyword& k, const ranktracker::engine::SearchEngine& e, const ptime& ranking_date);
+
+      /**
+       * Asks the `run_refresh_queue` and `run_refresh_pipeline` calls to
+       * return after their current unit; safe to call from any thread.
+       */
+      void stop() { _stopping = true; }
+
+      bool stopping() const { return _stopping; }
+
+      RefreshQueue& refresh_queue() { return _queue; }
     };
   }
 }
@@ -0,0 +1,236 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// ranktracker-worker.cc
+// crawl worker: runs the ranking queries leased by a ranktrackerd
+// coordinator and sends back the ranks
+
+#include "engines.hh"
+#include "resilience.hh"
+#include "cluster_protocol.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <curl/curl.h>
+
+using namespace ranktracker::engine;
+using namespace ranktracker::cluster;
+
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+  stop_requested = 1;
+}
+
+static void usage(const char *program);
+static void init_log(bool verbose);
+static bool work(const std::string& host, const std::string& port, const std::string& name,
+                 EngineResilience& resilience);
+
+/**
+ worker entry point
+*/
+int main(int argc, char **argv) {
+  std::string server;
+  std::string name;
+  bool verbose = false;
+  for(int i = 1; i < argc; i++) {
+    if(std::strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      server = argv[++i];
+    } else if(std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      name = argv[++i];
+    } else if(std::strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  auto colon = server.rfind(':');
+  if(server.empty() || colon == std::string::npos) {
+    usage(argv[0]);
+    return 2;
+  }
+  std::string host = server.substr(0, colon);
+  std::string port = server.substr(colon + 1);
+  if(name.empty()) {
+    char hostname[256] = {0};
+    gethostname(hostname, sizeof(hostname) - 1);
+    name = std::string(hostname) + "-" + std::to_string(getpid());
+  }
+
+  init_log(verbose);
+  BOOST_LOG_TRIVIAL(info) << "Worker " << name << " start";
+
+  auto curl_result = curl_global_init(CURL_GLOBAL_ALL);
+  if(curl_result != 0) {
+    BOOST_LOG_TRIVIAL(error) << "curl library failed to initialize with the code: " << curl_result << std::endl;
+    return 1;
+  }
+  init_search_engines();
+
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+
+  // the circuit breakers are kept between the connections: they follow
+  // how the engines treat this worker's address
+  EngineResilience resilience;
+  auto reconnect = std::chrono::seconds(5);
+  while(!stop_requested) {
+    if(work(host, port, name, resilience)) {
+      reconnect = std::chrono::seconds(5);
+    } else {
+      reconnect = std::min<std::chrono::seconds>(reconnect * 2, std::chrono::minutes(5));
+    }
+    if(stop_requested) break;
+    BOOST_LOG_TRIVIAL(info) << "Reconnecting to " << server << " in " << reconnect.count() << "s\n";
+    for(auto s = reconnect.count(); s > 0 && !stop_requested; s--) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+  }
+
+  curl_global_cleanup();
+  auto traffic = transfer_totals();
+  BOOST_LOG_TRIVIAL(info) << "Fetched " << traffic.pages << " pages: " << traffic.wire_bytes
+                          << " bytes received, " << traffic.decoded_bytes << " bytes decoded\n";
+  BOOST_LOG_TRIVIAL(info) << "Worker end";
+  return 0;
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " -s host:port [-n name] [-v]\n"
+            << "  -s  address of the ranktrackerd coordinator (its listen setting)\n"
+            << "  -n  worker name shown in the coordinator's statistics (default: host name and pid)\n"
+            << "  -v  verbose (trace) logging\n";
+}
+
+// sends a request and reads the first line of the reply
+static bool request(boost::asio::ip::tcp::iostream& conn, const std::string& command,
+                    const std::vector<std::string>& fields,
+                    std::string& reply, std::vector<std::string>& reply_fields) {
+  conn << format_message(command, fields) << std::flush;
+  std::string line;
+  if(!std::getline(conn, line)) return false;
+  if(!parse_message(line, reply, reply_fields)) return false;
+  if(reply == message::ERROR) {
+    throw protocol_exception(reply_fields.empty() ? "unknown error" : reply_fields[0]);
+  }
+  return true;
+}
+
+// runs the leased queries over one connection; returns false if the
+// connection could not be opened
+static bool work(const std::string& host, const std::string& port, const std::string& name,
+                 EngineResilience& resilience) {
+  boost::asio::ip::tcp::iostream conn(host, port);
+  if(!conn) {
+    BOOST_LOG_TRIVIAL(error) << "Can not connect to " << host << ":" << port << std::endl;
+    return false;
+  }
+
+  std::string reply;
+  std::vector<std::string> fields;
+  try {
+    if(!request(conn, message::HELLO, {name}, reply, fields)) goto disconnected;
+    BOOST_LOG_TRIVIAL(info) << "Connected to " << host << ":" << port << std::endl;
+
+    while(!stop_requested) {
+      // no units are leased for the engines paused by the breakers
+      std::vector<std::string> paused;
+      for(auto& e: search_engines()) {
+        if(!resilience.available(*e.second)) {
+          paused.push_back(boost::uuids::to_string(e.first));
+        }
+      }
+      if(!request(conn, message::LEASE, paused, reply, fields)) goto disconnected;
+
+      if(reply == message::WAIT) {
+        long seconds = fields.empty() ? 30 : std::strtol(fields[0].c_str(), NULL, 10);
+        BOOST_LOG_TRIVIAL(trace) << "Nothing to do; asking again in " << seconds << "s\n";
+        for(long s = std::max(1L, seconds); s > 0 && !stop_requested; s--) {
+          std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        continue;
+      }
+      if(reply != message::UNIT || fields.size() < 6) {
+        throw protocol_exception("unexpected reply " + reply);
+      }
+
+      // `fields` is reused for the reply to the result
+      std::string lease = fields[0];
+      const std::string& domain = fields[2];
+      const std::string& keywords = fields[3];
+      query_options options;
+      options.max_depth = std::strtoul(fields[4].c_str(), NULL, 10);
+      options.last_rank = std::strtol(fields[5].c_str(), NULL, 10);
+
+      std::string outcome = message::RESULT;
+      std::vector<std::string> result = {lease};
+      try {
+        auto const& e = search_engines().at(boost::lexical_cast<Entity::id_type>(fields[1]));
+        BOOST_LOG_TRIVIAL(info) << "Lease " << lease << ": domain '" << domain << "', keywords '" << keywords
+                                << "', engine " << e.name() << std::endl;
+        progress_updater ignore_progress = [](int) {};
+        std::string page_url;
+        rank_query_result cost;
+        auto rank = resilience.perform_rank_query(*e, domain, keywords, ignore_progress, &page_url, options, &cost);
+        result.push_back(std::to_string(rank));
+        result.push_back(page_url);
+        result.push_back(format_query_cost(cost));
+        result.push_back(format_serp(cost.serp));
+      } catch (circuit_open_exception) {
+        BOOST_LOG_TRIVIAL(warning) << "Lease " << lease << ": the engine is paused\n";
+        outcome = message::FAIL;
+        result.push_back(message::THROTTLED);
+      } catch (search_exception) {
+        BOOST_LOG_TRIVIAL(error) << "Lease " << lease << ": ranking query failed\n";
+        outcome = message::FAIL;
+        result.push_back(message::FAILED);
+      } catch (std::out_of_range) {
+        BOOST_LOG_TRIVIAL(error) << "Lease " << lease << ": unknown search engine " << fields[1] << std::endl;
+        outcome = message::FAIL;
+        result.push_back(message::FAILED);
+      } catch (boost::bad_lexical_cast) {
+        throw protocol_exception("bad engine id " + fields[1]);
+      }
+
+      if(!request(conn, outcome, result, reply, fields)) goto disconnected;
+      if(reply == message::EXPIRED) {
+        BOOST_LOG_TRIVIAL(warning) << "Lease " << lease << " expired before the answer; the result was dropped\n";
+      }
+    }
+    conn << format_message(message::BYE) << std::flush;
+    return true;
+  } catch (protocol_exception e) {
+    BOOST_LOG_TRIVIAL(error) << "Protocol error: " << e.message() << std::endl;
+    return true;
+  }
+
+ disconnected:
+  BOOST_LOG_TRIVIAL(warning) << "Connection to " << host << ":" << port << " lost\n";
+  return true;
+}
+
+// log initialization; the worker logs to the console
+static void init_log(bool verbose) {
+  logging::add_console_log
+    (std::clog,
+     keywords::format = "[%TimeStamp%][%ThreadID%][%Severity%]: %Message%"
+     );
+
+  logging::core::get()->set_filter
+    (logging::trivial::severity >= (verbose ? logging::trivial::trace : logging::trivial::info));
+
+  logging::add_common_attributes();
+}
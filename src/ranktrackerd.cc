@@ -0,0 +1,363 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// ranktrackerd.cc
+// headless daemon refreshing the rankings on a schedule, without the UI
+
+#include "data_provider.hh"
+#include "engines.hh"
+#include "serp_layout.hh"
+#include "ranking.hh"
+#include "telemetry.hh"
+#include "daemon_config.hh"
+#include "coordinator.hh"
+#include "logging.hh"
+#include "app_support_folder.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <locale>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+#include <pthread.h>
+
+using namespace ranktracker::data;
+using namespace ranktracker::persistence;
+using namespace ranktracker::ranking;
+using namespace ranktracker::daemon;
+using ranktracker::cluster::LeaseCoordinator;
+using ranktracker::cluster::coordinator_options;
+using ranktracker::engine::current_serp_layout;
+using ranktracker::engine::reload_serp_layout;
+
+namespace {
+
+  // state shared by the scheduler loop, the refresh workers and the
+  // signals thread
+  struct daemon_state {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+    bool reload;
+    unsigned long generation;   // incremented when new refresh jobs are queued
+
+    daemon_state() : stop(false), reload(false), generation(1) {}
+  };
+}
+
+static void init_log(bool verbose);
+static void usage(const char *program);
+static void handle_signals(daemon_state& state, RankingService& service, sigset_t signals);
+static void refresh_worker(daemon_state& state, RankingService& service, pipeline_options options);
+static bool run_schedule(DataProvider& db, RankingService& service, const daemon_config& config,
+                         const std::tm& now);
+static void log_telemetry(DataProvider& db, const boost::gregorian::date& day);
+
+/**
+ daemon entry point
+*/
+int main(int argc, char **argv) {
+  std::string config_path;
+  bool verbose = false;
+  for(int i = 1; i < argc; i++) {
+    if(std::strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      config_path = argv[++i];
+    } else if(std::strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(config_path.empty()) {
+    char *folder = app_support_folder();
+    config_path = std::string(folder) + "/ranktrackerd.conf";
+    std::free(folder);
+  }
+
+  std::locale::global(std::locale(""));
+  init_log(verbose);
+  BOOST_LOG_TRIVIAL(info) << "Daemon start";
+
+  daemon_config config;
+  try {
+    config = load_daemon_config(config_path);
+  } catch (config_exception e) {
+    BOOST_LOG_TRIVIAL(error) << e.message();
+    return 1;
+  }
+  BOOST_LOG_TRIVIAL(info) << "Loaded " << config.entries.size() << " schedule entries from " << config_path
+                          << "; " << config.concurrency << " concurrent downloads\n";
+
+  auto curl_result = curl_global_init(CURL_GLOBAL_ALL);
+  if(curl_result != 0) {
+    BOOST_LOG_TRIVIAL(error) << "curl library failed to initialize with the code: " << curl_result << std::endl;
+    return 1;
+  }
+  ranktracker::engine::init_search_engines();
+
+  // the signals are handled by a dedicated thread; they must be blocked
+  // before any other thread is started, so the threads inherit the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  DataProvider db;
+  RankingService service(db);
+  daemon_state state;
+
+  // remote workers take units from the same queue as the local worker
+  std::unique_ptr<LeaseCoordinator> coordinator;
+  if(config.listen_port != 0) {
+    coordinator_options coptions;
+    coptions.address = config.listen_address;
+    coptions.port = config.listen_port;
+    coptions.lease_timeout = std::chrono::minutes(config.lease_timeout_minutes);
+    coordinator.reset(new LeaseCoordinator(db, service.refresh_queue(), coptions));
+    try {
+      coordinator->start();
+    } catch (const boost::system::system_error& e) {
+      BOOST_LOG_TRIVIAL(error) << "Can not listen on " << config.listen_address << ":" << config.listen_port
+                               << ": " << e.what();
+      return 1;
+    }
+  }
+
+  std::thread signals_thread(handle_signals, std::ref(state), std::ref(service), signals);
+  // the worker starts by resuming the refresh jobs left by a previous run
+  std::thread worker;
+  if(config.concurrency > 0) {
+    pipeline_options options;
+    options.network_threads = config.concurrency;
+    options.parser_threads = config.parsers;
+    worker = std::thread(refresh_worker, std::ref(state), std::ref(service), options);
+  }
+
+  auto next = std::chrono::time_point_cast<std::chrono::minutes>(std::chrono::system_clock::now())
+    + std::chrono::minutes(1);
+  auto report_day = boost::gregorian::day_clock::local_day();
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> lock(state.mutex);
+      state.cv.wait_until(lock, next, [&state]() { return state.stop || state.reload; });
+      if(state.stop) break;
+      if(state.reload) {
+        state.reload = false;
+        lock.unlock();
+        try {
+          auto previous = config;
+          config = load_daemon_config(config_path);
+          config.concurrency = previous.concurrency;
+          config.parsers = previous.parsers;
+          config.listen_address = previous.listen_address;
+          config.listen_port = previous.listen_port;
+          config.lease_timeout_minutes = previous.lease_timeout_minutes;
+          BOOST_LOG_TRIVIAL(info) << "Reloaded " << config.entries.size() << " schedule entries from "
+                                  << config_path << "; concurrency and listen changes need a restart\n";
+        } catch (config_exception e) {
+          BOOST_LOG_TRIVIAL(error) << e.message() << "; keeping the previous configuration";
+        }
+        reload_serp_layout();
+        continue;
+      }
+    }
+    if(std::chrono::system_clock::now() < next) continue;
+
+    auto t = std::chrono::system_clock::to_time_t(next);
+    std::tm now;
+    localtime_r(&t, &now);
+    auto day = boost::gregorian::date_from_tm(now);
+    if(day != report_day) {
+      log_telemetry(db, report_day);
+      report_day = day;
+    }
+    if(run_schedule(db, service, config, now)) {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      state.generation++;
+      state.cv.notify_all();
+    }
+
+    next += std::chrono::minutes(1);
+    auto crt = std::chrono::time_point_cast<std::chrono::minutes>(std::chrono::system_clock::now());
+    if(next <= crt) {
+      // the triggers missed while the system was suspended are not replayed
+      BOOST_LOG_TRIVIAL(warning) << "The schedule fell behind the clock; skipping to the current minute\n";
+      next = crt + std::chrono::minutes(1);
+    }
+  }
+
+  BOOST_LOG_TRIVIAL(info) << "Stopping: waiting for the rankings in flight to finish\n";
+  if(worker.joinable()) {
+    worker.join();
+  }
+  if(coordinator) {
+    coordinator->stop();
+  }
+  signals_thread.join();
+  curl_global_cleanup();
+  log_telemetry(db, report_day);
+
+  auto traffic = ranktracker::engine::transfer_totals();
+  BOOST_LOG_TRIVIAL(info) << "Fetched " << traffic.pages << " pages: " << traffic.wire_bytes
+                          << " bytes received, " << traffic.decoded_bytes << " bytes decoded in "
+                          << traffic.decode_time.count() / 1000 << "ms\n";
+
+  BOOST_LOG_TRIVIAL(info) << "Daemon end";
+  return 0;
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " [-c config-file] [-v]\n"
+            << "  -c  configuration and schedule file (default: ranktrackerd.conf in the data folder)\n"
+            << "  -v  verbose (trace) logging\n";
+}
+
+// waits for the termination and reload signals
+static void handle_signals(daemon_state& state, RankingService& service, sigset_t signals) {
+  for(;;) {
+    int signal = 0;
+    if(sigwait(&signals, &signal) != 0) continue;
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if(signal == SIGHUP) {
+      BOOST_LOG_TRIVIAL(info) << "SIGHUP received; reloading the configuration\n";
+      state.reload = true;
+      state.cv.notify_all();
+    } else {
+      BOOST_LOG_TRIVIAL(info) << "Signal " << signal << " received; shutting down\n";
+      state.stop = true;
+      service.stop();
+      state.cv.notify_all();
+      return;
+    }
+  }
+}
+
+// runs the refresh queue through the pipeline every time new jobs are
+// queued
+static void refresh_worker(daemon_state& state, RankingService& service, pipeline_options options) {
+  unsigned long seen = 0;
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> lock(state.mutex);
+      state.cv.wait(lock, [&state, &seen]() { return state.stop || state.generation != seen; });
+      if(state.stop) return;
+      seen = state.generation;
+    }
+    BOOST_LOG_TRIVIAL(trace) << "refresh worker running the refresh queue\n";
+    try {
+      service.run_refresh_pipeline([](int) {}, options);
+    } catch (DataProviderException) {
+      BOOST_LOG_TRIVIAL(error) << "refresh worker: database error while running the refresh queue\n";
+    } catch (...) {
+      // any error of the pipeline's stages; the units left are run with
+      // the next jobs
+      BOOST_LOG_TRIVIAL(error) << "refresh worker: error while running the refresh queue\n";
+    }
+  }
+}
+
+// the domains a schedule entry refreshes; expects a transaction to be opened
+static std::vector<Domain> entry_domains(DataProvider& db, const schedule_entry& entry) {
+  std::vector<Domain> ds;
+  switch(entry.action) {
+  case schedule_entry::REFRESH_ALL:
+    return db.domains();
+  case schedule_entry::REFRESH_DOMAIN:
+    for(auto& d: db.domains()) {
+      if(d.name() == entry.target) ds.push_back(d);
+    }
+    break;
+  case schedule_entry::REFRESH_CATEGORY:
+  case schedule_entry::SCHEDULED_REFRESH:
+    if(entry.target.empty()) return db.domains();
+    for(auto& c: db.categories()) {
+      if(c.name() == entry.target) {
+        auto cds = db.domains(c);
+        ds.insert(ds.end(), cds.begin(), cds.end());
+      }
+    }
+    break;
+  }
+  if(ds.empty()) {
+    BOOST_LOG_TRIVIAL(warning) << "Schedule entry '" << entry.target << "' matches no domain\n";
+  }
+  return ds;
+}
+
+// queues the refresh jobs triggered in the given minute; returns true if any
+static bool run_schedule(DataProvider& db, RankingService& service, const daemon_config& config,
+                         const std::tm& now) {
+  bool queued = false;
+  for(auto& entry: config.entries) {
+    if(!entry.when.matches(now)) continue;
+
+    try {
+      std::vector<Domain> ds;
+      {
+        create_transaction trans(&db, MDB_RDONLY);
+        ds = entry_domains(db, entry);
+        trans.commit();
+      }
+      if(ds.empty()) continue;
+
+      if(entry.action == schedule_entry::SCHEDULED_REFRESH) {
+        BOOST_LOG_TRIVIAL(info) << "Scheduled refresh of " << ds.size() << " domains, daily budget "
+                                << config.schedule.budget << " pages\n";
+        service.enqueue_scheduled_refresh(ds, config.schedule);
+      } else {
+        BOOST_LOG_TRIVIAL(info) << "Refresh of " << ds.size() << " domains\n";
+        service.enqueue_refresh(ds);
+      }
+      queued = true;
+    } catch (DataProviderException) {
+      BOOST_LOG_TRIVIAL(error) << "Database error while queueing a scheduled refresh\n";
+    } catch (...) {
+      BOOST_LOG_TRIVIAL(error) << "Error while queueing a scheduled refresh\n";
+    }
+  }
+  return queued;
+}
+
+// logs the cost of the queries made in a day, per engine, and the
+// counters of the layout rules
+static void log_telemetry(DataProvider& db, const boost::gregorian::date& day) {
+  try {
+    for(auto& t: telemetry_report(db, day, day + boost::gregorian::days(1))) {
+      BOOST_LOG_TRIVIAL(info) << "Query telemetry " << t;
+    }
+  } catch (DataProviderException) {
+    BOOST_LOG_TRIVIAL(error) << "Database error while reading the query telemetry\n";
+  }
+  // the pages each rule of the results pages layout worked on
+  current_serp_layout()->log_counters();
+}
+
+// log initialization
+static void init_log(bool verbose) {
+  const char *log_folder = app_support_folder();
+  std::string log_file = std::string(log_folder) + "/ranktrackerd-%N.log";
+  std::free((void *)log_folder);
+
+  logging::add_file_log
+    (keywords::file_name = std::move(log_file),
+     keywords::rotation_size = 10 * 1024 * 1024,
+     keywords::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0),
+     keywords::auto_flush = true,
+     keywords::format = "[%TimeStamp%][%ThreadID%][%Severity%]: %Message%"
+     );
+  logging::add_console_log();
+
+  logging::core::get()->set_filter
+    (logging::trivial::severity >= (verbose ? logging::trivial::trace : logging::trivial::info));
+
+  logging::add_common_attributes();
+}
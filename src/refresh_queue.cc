@@ -0,0 +1,319 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// refresh_queue.cc
+// persistent queue of the rankings waiting to be refreshed
+
+#include "refresh_queue.hh"
+
+#include <unordered_set>
+#include <boost/functional/hash.hpp>
+
+namespace ranktracker {
+  namespace ranking {
+
+    typedef std::pair<AbstractEntity::id_type, AbstractEntity::id_type> unit_id;
+
+    // removes a unit from the claimed units of its job
+    static void unclaim(std::vector<RefreshUnit>& in_flight, const RefreshUnit& unit) {
+      for(auto u = in_flight.begin(); u != in_flight.end(); u++) {
+        if(u->_seq == unit._seq) {
+          in_flight.erase(u);
+          break;
+        }
+      }
+    }
+
+    template<class F>
+    void RefreshQueue::write(F f) {
+      bool resize_retried = false;
+    retry_write:
+      try {
+        create_transaction trans(&_db);
+        f();
+        trans.commit();
+      } catch (DatabaseMapFullException) {
+        if(resize_retried) {
+          BOOST_LOG_TRIVIAL(error) << "DatabaseMapFullException raised after resizing on refresh queue update; giving up.";
+          throw;
+        }
+        BOOST_LOG_TRIVIAL(warning) << "Database map is full on refresh queue update. Resizing the database and retrying.";
+        _db.increase_mapsize();
+        resize_retried = true;
+        goto retry_write;
+      }
+    }
+
+    void RefreshQueue::load() {
+      if(_loaded) return;
+      BOOST_LOG_TRIVIAL(trace) << "RefreshQueue::load() enter\n";
+
+      std::vector<RefreshJob> finished;
+      {
+        create_transaction trans(&_db, MDB_RDONLY);
+        for(auto& job: _db.refresh_jobs()) {
+          job_state s = {job, {}, {}, 0, 0};
+          for(auto& unit: _db.refresh_units(job)) {
+            switch(unit._state) {
+            case RefreshUnit::PENDING:
+            case RefreshUnit::IN_FLIGHT:
+              // units in flight were interrupted by the application exit
+              s.pending.push_back(unit);
+              break;
+            case RefreshUnit::DONE:
+              s.done++;
+              break;
+            case RefreshUnit::FAILED:
+              s.failed++;
+              break;
+            }
+          }
+          if(s.pending.empty()) {
+            // all its units were finished before the exit
+            finished.push_back(job);
+            continue;
+          }
+          BOOST_LOG_TRIVIAL(info) << "Resuming refresh job created on " << job.createdDate()
+                                  << ": " << s.pending.size() << " of " << job.units() << " units left\n";
+          _jobs.push_back(std::move(s));
+        }
+        trans.commit();
+      }
+
+      if(!finished.empty()) {
+        BOOST_LOG_TRIVIAL(info) << "Deleting " << finished.size() << " finished refresh jobs\n";
+        write([this, &finished]() {
+            for(auto& job: finished) {
+              _db.deleteRefreshJob(job);
+            }
+          });
+      }
+      _loaded = true;
+      BOOST_LOG_TRIVIAL(trace) << "RefreshQueue::load() exit\n";
+    }
+
+    RefreshJob RefreshQueue::enqueue(const std::vector<Domain>& ds) {
+      std::vector<RefreshUnit> units;
+      {
+        create_transaction trans(&_db, MDB_RDONLY);
+        for(auto& d: ds) {
+          for(auto& k: _db.keywords(d)) {
+            for(auto& e: d.engines()) {
+              RefreshUnit unit = {k.id(), e.id(), d.id(), units.size(),
+                                  RefreshUnit::PENDING, 0, second_clock::local_time()};
+              units.push_back(unit);
+            }
+          }
+        }
+        trans.commit();
+      }
+      return enqueue(units);
+    }
+
+    RefreshJob RefreshQueue::enqueue(const std::vector<RefreshUnit>& units) {
+      BOOST_LOG_TRIVIAL(trace) << "RefreshQueue::enqueue() enter\n";
+      // held until the job is in the queue, so two jobs enqueued at the
+      // same time do not both take the same units
+      std::lock_guard<std::mutex> lock(_mutex);
+      load();
+      std::unordered_set<unit_id, boost::hash<unit_id>> queued;
+      for(auto& s: _jobs) {
+        for(auto& unit: s.pending) {
+          queued.insert({unit._kwdid, unit._engid});
+        }
+        for(auto& unit: s.in_flight) {
+          queued.insert({unit._kwdid, unit._engid});
+        }
+      }
+
+      RefreshJob job;
+      job_state s = {job, {}, {}, 0, 0};
+      for(auto unit: units) {
+        if(queued.insert({unit._kwdid, unit._engid}).second) {
+          unit._seq = s.pending.size();
+          unit._state = RefreshUnit::PENDING;
+          unit._attempts = 0;
+          unit._updated = job.createdDate();
+          s.pending.push_back(unit);
+        }
+      }
+      job.units(s.pending.size());
+      s.job = job;
+
+      if(s.pending.empty()) {
+        BOOST_LOG_TRIVIAL(info) << "RefreshQueue::enqueue(): nothing new to refresh\n";
+        return job;
+      }
+
+      write([this, &s]() {
+          _db.storeRefreshJob(s.job);
+          for(auto& unit: s.pending) {
+            _db.storeRefreshUnit(s.job, unit);
+          }
+        });
+      BOOST_LOG_TRIVIAL(info) << "Queued refresh job with " << s.pending.size() << " units\n";
+
+      _jobs.push_back(std::move(s));
+      BOOST_LOG_TRIVIAL(trace) << "RefreshQueue::enqueue() exit\n";
+      return job;
+    }
+
+    bool RefreshQueue::claim(RefreshJob& job, RefreshUnit& unit, engine_filter available) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        load();
+        bool found = false;
+        for(auto s = _jobs.begin(); s != _jobs.end() && !found; s++) {
+          for(auto u = s->pending.begin(); u != s->pending.end(); u++) {
+            if(!available || available(u->_engid)) {
+              job = s->job;
+              unit = *u;
+              s->pending.erase(u);
+              s->in_flight.push_back(unit);
+              found = true;
+              break;
+            }
+          }
+        }
+        if(!found) {
+          return false;
+        }
+        if(_run_started.is_not_a_date_time()) {
+          _run_started = second_clock::local_time();
+          _run_completed = 0;
+        }
+      }
+
+      unit._state = RefreshUnit::IN_FLIGHT;
+      unit._attempts++;
+      unit._updated = second_clock::local_time();
+      try {
+        write([this, &job, &unit]() { _db.storeRefreshUnit(job, unit); });
+      } catch (...) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to mark the refresh unit as in flight\n";
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto& s: _jobs) {
+          if(s.job.id() == job.id()) {
+            unclaim(s.in_flight, unit);
+            s.pending.push_front(unit);
+          }
+        }
+        throw;
+      }
+      return true;
+    }
+
+    bool RefreshQueue::last_unit(const RefreshJob& job) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for(auto& s: _jobs) {
+        if(s.job.id() == job.id()) {
+          // no other unit can come back to the job: it has none pending
+          // and only this one in flight
+          return s.pending.empty() && s.in_flight.size() == 1;
+        }
+      }
+      return false;
+    }
+
+    void RefreshQueue::finish_unit(const RefreshJob& job, const RefreshUnit& unit, RefreshUnit::state_t state) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto s = _jobs.begin(); s != _jobs.end(); s++) {
+          if(s->job.id() == job.id()) {
+            unclaim(s->in_flight, unit);
+            if(state == RefreshUnit::DONE) {
+              s->done++;
+            } else {
+              s->failed++;
+            }
+            _run_completed++;
+            if(s->pending.empty() && s->in_flight.empty()) {
+              BOOST_LOG_TRIVIAL(info) << "Refresh job finished: " << s->done << " units done, "
+                                      << s->failed << " failed\n";
+              _jobs.erase(s);
+            }
+            break;
+          }
+        }
+        if(_jobs.empty()) {
+          _run_started = ptime();
+        }
+      }
+    }
+
+    void RefreshQueue::store_unit(const RefreshJob& job, const RefreshUnit& unit, bool last) {
+      if(last) {
+        // the job ends with its last unit, in the same transaction
+        _db.deleteRefreshJob(job);
+      } else {
+        _db.storeRefreshUnit(job, unit);
+      }
+    }
+
+    void RefreshQueue::complete(const RefreshJob& job, RefreshUnit unit, const Keyword& k,
+                                const ranktracker::engine::SearchEngine& e, const Ranking& rank_info,
+                                const QueryTelemetry *telemetry,
+                                const std::vector<ranktracker::engine::serp_result> *serp) {
+      unit._state = RefreshUnit::DONE;
+      unit._updated = second_clock::local_time();
+      bool last = last_unit(job);
+      write([this, &job, &unit, last, &k, &e, &rank_info, telemetry, serp]() {
+          _db.storeRanking(k, e, rank_info);
+          if(telemetry) {
+            _db.storeTelemetry(k, e, rank_info._ranking_date, *telemetry);
+          }
+          if(serp && !serp->empty()) {
+            _db.storeSerp(k, e, rank_info._ranking_date, *serp);
+          }
+          store_unit(job, unit, last);
+        });
+      finish_unit(job, unit, RefreshUnit::DONE);
+    }
+
+    void RefreshQueue::fail(const RefreshJob& job, RefreshUnit unit) {
+      unit._state = RefreshUnit::FAILED;
+      unit._updated = second_clock::local_time();
+      bool last = last_unit(job);
+      write([this, &job, &unit, last]() { store_unit(job, unit, last); });
+      finish_unit(job, unit, RefreshUnit::FAILED);
+    }
+
+    void RefreshQueue::release(const RefreshJob& job, RefreshUnit unit) {
+      unit._state = RefreshUnit::PENDING;
+      unit._updated = second_clock::local_time();
+      write([this, &job, &unit]() { _db.storeRefreshUnit(job, unit); });
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      for(auto& s: _jobs) {
+        if(s.job.id() == job.id()) {
+          unclaim(s.in_flight, unit);
+          s.pending.push_back(unit);
+          break;
+        }
+      }
+    }
+
+    std::size_t RefreshQueue::remaining() {
+      return stats().remaining();
+    }
+
+    RefreshQueueStats RefreshQueue::stats() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      load();
+      RefreshQueueStats st = {0, 0, 0, 0, 0, 0, boost::posix_time::not_a_date_time};
+      for(auto& s: _jobs) {
+        st.total += s.job.units();
+        st.pending += s.pending.size();
+        st.in_flight += s.in_flight.size();
+        st.done += s.done;
+        st.failed += s.failed;
+      }
+      if(!_run_started.is_not_a_date_time() && _run_completed > 0) {
+        auto elapsed = (second_clock::local_time() - _run_started).total_seconds();
+        if(elapsed > 0) {
+          st.units_per_hour = 3600.0 * _run_completed / elapsed;
+          st.eta = boost::posix_time::seconds((long)(st.remaining() * elapsed / _run_completed));
+        }
+      }
+      return st;
+    }
+  }
+}
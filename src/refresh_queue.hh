@@ -0,0 +1,132 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// refresh_queue.hh
+// persistent queue of the (keyword, engine) rankings waiting to be
+// refreshed
+
+#ifndef RANKTRACKER_REFRESH_QUEUE_HH
+#define RANKTRACKER_REFRESH_QUEUE_HH
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "data_provider.hh"
+
+namespace ranktracker {
+  namespace ranking {
+    using namespace ranktracker::data;
+    using namespace ranktracker::persistence;
+
+    /**
+     * Progress of the refresh jobs in the queue.
+     */
+    struct RefreshQueueStats {
+      std::size_t total;        // units of the unfinished jobs
+      std::size_t pending;
+      std::size_t in_flight;
+      std::size_t done;
+      std::size_t failed;
+      double units_per_hour;    // throughput since the queue started running
+      boost::posix_time::time_duration eta; // not_a_date_time if unknown
+
+      std::size_t remaining() const { return pending + in_flight; }
+    };
+
+    /**
+     * Queue of refresh jobs persisted in the database. Each state change
+     * of a unit is committed in its own transaction, so when the
+     * application is restarted only the units that were not completed
+     * are processed again. A job is deleted in the transaction of its
+     * last unit.
+     *
+     * The queue manages its own transactions, so none of its functions
+     * may be called while the calling thread has a transaction opened.
+     * It is safe to consume the queue from several threads.
+     */
+    class RefreshQueue {
+      struct job_state {
+        RefreshJob job;
+        std::deque<RefreshUnit> pending;
+        std::vector<RefreshUnit> in_flight;  // claimed and not finished yet
+        std::size_t done;
+        std::size_t failed;
+      };
+
+      DataProvider& _db;
+      std::mutex _mutex;
+      bool _loaded;
+      std::vector<job_state> _jobs;
+
+      ptime _run_started;
+      std::size_t _run_completed;
+
+      void load();
+      bool last_unit(const RefreshJob& job);
+      void store_unit(const RefreshJob& job, const RefreshUnit& unit, bool last);
+      void finish_unit(const RefreshJob& job, const RefreshUnit& unit, RefreshUnit::state_t state);
+
+      template<class F>
+      void write(F f);
+
+    public:
+      RefreshQueue(DataProvider& db) : _db(db), _loaded(false), _run_completed(0) {}
+
+      RefreshQueue(const RefreshQueue&) = delete;
+      RefreshQueue& operator= (const RefreshQueue&) = delete;
+
+      /**
+       * Create a new job to refresh the rankings of all keywords of the
+       * given domains, on all the engines of each domain. Units already
+       * waiting or in flight in an unfinished job are not queued again.
+       */
+      RefreshJob enqueue(const std::vector<Domain>& ds);
+
+      /**
+       * Create a new job from a list of planned units (see
+       * `RefreshScheduler`). Units already waiting or in flight in an
+       * unfinished job are not queued again.
+       */
+      RefreshJob enqueue(const std::vector<RefreshUnit>& units);
+
+      typedef std::function<bool(const AbstractEntity::id_type&)> engine_filter;
+
+      /**
+       * Take the next pending unit, marking it as in flight. When an
+       * `available` filter is given, the units of the engines it rejects
+       * are skipped and stay pending. Returns false if there is no unit
+       * to take.
+       */
+      bool claim(RefreshJob& job, RefreshUnit& unit, engine_filter available = nullptr);
+
+      /**
+       * Store the ranking obtained for a claimed unit, and the cost and
+       * the results of its query when known, and mark the unit as done,
+       * in the same transaction.
+       */
+      void complete(const RefreshJob& job, RefreshUnit unit, const Keyword& k,
+                    const ranktracker::engine::SearchEngine& e, const Ranking& rank_info,
+                    const QueryTelemetry *telemetry = nullptr,
+                    const std::vector<ranktracker::engine::serp_result> *serp = nullptr);
+
+      /**
+       * Mark a claimed unit as failed.
+       */
+      void fail(const RefreshJob& job, RefreshUnit unit);
+
+      /**
+       * Put back a claimed unit, to be processed later.
+       */
+      void release(const RefreshJob& job, RefreshUnit unit);
+
+      /**
+       * Number of units, pending or in flight, of the unfinished jobs.
+       */
+      std::size_t remaining();
+
+      RefreshQueueStats stats();
+    };
+  }
+}
+
+#endif
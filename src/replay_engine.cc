@@ -0,0 +1,192 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// replay_engine.cc
+// serves recorded search result pages instead of querying the search
+// engine
+
+#include "replay_engine.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+
+namespace ranktracker {
+  namespace engine {
+
+    namespace fs = boost::filesystem;
+
+    // size of the chunks passed to the parser; the same as curl's
+    // default write buffer size
+    size_t const replay_chunk_size = 16384;
+
+    static bool env_value(const char *name, std::string& value) {
+      const char *v = std::getenv(name);
+      if(v == NULL || *v == '\0') return false;
+      value = v;
+      return true;
+    }
+
+    bool replay_options_from_env(replay_options& options) {
+      std::string value;
+      if(!env_value("RANKTRACKER_REPLAY_DIR", options.pages_dir)) {
+        return false;
+      }
+      if(env_value("RANKTRACKER_REPLAY_LATENCY_MS", value)) {
+        options.latency_ms = std::strtoul(value.c_str(), NULL, 10);
+      }
+      if(env_value("RANKTRACKER_REPLAY_JITTER_MS", value)) {
+        options.jitter_ms = std::strtoul(value.c_str(), NULL, 10);
+      }
+      if(env_value("RANKTRACKER_REPLAY_ERROR_RATE", value)) {
+        options.error_rate = std::min(1.0, std::max(0.0, std::strtod(value.c_str(), NULL)));
+      }
+      if(env_value("RANKTRACKER_REPLAY_THROTTLE_RATE", value)) {
+        options.throttle_rate = std::min(1.0, std::max(0.0, std::strtod(value.c_str(), NULL)));
+      }
+      if(env_value("RANKTRACKER_REPLAY_SEED", value)) {
+        options.seed = std::strtoul(value.c_str(), NULL, 10);
+      }
+      return true;
+    }
+
+    // decoded value of a parameter of the query string of an url; empty
+    // if the parameter is not present
+    static std::string query_param(const std::string& url, const std::string& name) {
+      auto q = url.find('?');
+      while(q != std::string::npos) {
+        auto start = q + 1;
+        if(url.compare(start, name.size() + 1, name + "=") == 0) {
+          start += name.size() + 1;
+          auto end = url.find('&', start);
+          std::string value = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+          std::string decoded;
+          for(size_t i = 0; i < value.size(); i++) {
+            if(value[i] == '+') {
+              decoded += ' ';
+            } else if(value[i] == '%' && i + 2 < value.size() &&
+                      std::isxdigit((unsigned char)value[i + 1]) &&
+                      std::isxdigit((unsigned char)value[i + 2])) {
+              decoded += (char)std::strtol(value.substr(i + 1, 2).c_str(), NULL, 16);
+              i += 2;
+            } else {
+              decoded += value[i];
+            }
+          }
+          return decoded;
+        }
+        q = url.find('&', start);
+      }
+      return std::string();
+    }
+
+    static std::string keywords_folder_name(const std::string& keywords) {
+      std::string name;
+      for(auto c: keywords) {
+        name += std::isalnum((unsigned char)c) ? (char)std::tolower((unsigned char)c) : '-';
+      }
+      return name;
+    }
+
+    void ReplayEngine::configure(const replay_options& options) {
+      std::lock_guard<std::mutex> lock(_rng_mutex);
+      _options = options;
+      _rng.seed(options.seed);
+    }
+
+    std::vector<std::string> ReplayEngine::recorded_pages(const std::string& keywords) const {
+      std::vector<std::string> pages;
+      fs::path folder = fs::path(_options.pages_dir) / keywords_folder_name(keywords);
+      if(!fs::is_directory(folder)) {
+        folder = _options.pages_dir;
+      }
+      try {
+        for(fs::directory_iterator i(folder); i != fs::directory_iterator(); i++) {
+          if(fs::is_regular_file(i->path()) && i->path().extension() == ".html") {
+            pages.push_back(i->path().string());
+          }
+        }
+      } catch (const fs::filesystem_error& e) {
+        BOOST_LOG_TRIVIAL(error) << "ReplayEngine: failed to read the recorded pages folder: " << e.what() << std::endl;
+      }
+      std::sort(pages.begin(), pages.end());
+      return pages;
+    }
+
+    void ReplayEngine::simulate_network() const {
+      unsigned latency;
+      bool fail, throttle;
+      {
+        std::lock_guard<std::mutex> lock(_rng_mutex);
+        latency = _options.latency_ms;
+        if(_options.jitter_ms > 0) {
+          latency += std::uniform_int_distribution<unsigned>(0, _options.jitter_ms)(_rng);
+        }
+        fail = std::uniform_real_distribution<double>(0, 1)(_rng) < _options.error_rate;
+        throttle = std::uniform_real_distribution<double>(0, 1)(_rng) < _options.throttle_rate;
+      }
+      if(latency > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+      }
+      if(fail) {
+        BOOST_LOG_TRIVIAL(warning) << "ReplayEngine: injected fetch failure\n";
+        throw http_request_failed_exception(CURLE_OPERATION_TIMEDOUT);
+      }
+      if(throttle) {
+        BOOST_LOG_TRIVIAL(warning) << "ReplayEngine: injected rate limited answer\n";
+        throw throttled_exception(throttled_exception::RATE_LIMITED);
+      }
+    }
+
+    transfer_stats ReplayEngine::fetch_page(CURL *,
+                                            const std::string& page_url,
+                                            curl_write_callback rcv,
+                                            void *rcv_data) const {
+      BOOST_LOG_TRIVIAL(trace) << "ReplayEngine::fetch_page(): " << page_url << std::endl;
+      auto pages = recorded_pages(query_param(page_url, "q"));
+      if(pages.empty()) {
+        BOOST_LOG_TRIVIAL(error) << "ReplayEngine: no recorded pages in " << _options.pages_dir << std::endl;
+        throw http_request_failed_exception(CURLE_REMOTE_FILE_NOT_FOUND);
+      }
+
+      auto request_start = std::chrono::steady_clock::now();
+      simulate_network();
+      auto first_byte = std::chrono::steady_clock::now();
+
+      // google result pages hold 10 results each
+      auto page_idx = std::strtoul(query_param(page_url, "start").c_str(), NULL, 10) / 10;
+      auto const& page_file = pages[page_idx % pages.size()];
+      BOOST_LOG_TRIVIAL(trace) << "ReplayEngine::fetch_page(): serving " << page_file << std::endl;
+
+      std::ifstream in(page_file, std::ios_base::in | std::ios_base::binary);
+      if(!in) {
+        BOOST_LOG_TRIVIAL(error) << "ReplayEngine: could not open " << page_file << std::endl;
+        throw http_request_failed_exception(CURLE_READ_ERROR);
+      }
+      // the recorded pages are served uncompressed
+      transfer_stats stats;
+      stats.pages = 1;
+      std::vector<char> chunk(replay_chunk_size);
+      while(in) {
+        in.read(chunk.data(), chunk.size());
+        size_t len = in.gcount();
+        if(len > 0 && rcv(chunk.data(), 1, len, rcv_data) != len) {
+          throw http_request_failed_exception(CURLE_WRITE_ERROR);
+        }
+        stats.wire_bytes += len;
+        stats.decoded_bytes += len;
+      }
+      stats.http_status = 200;
+      stats.first_byte_time = std::chrono::duration_cast<std::chrono::microseconds>(first_byte - request_start);
+      stats.transfer_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()
+                                                                                   - request_start);
+      return stats;
+    }
+
+    std::chrono::milliseconds ReplayEngine::page_delay() const {
+      // the synthetic latency of fetch_page stands for the network
+      return std::chrono::milliseconds(0);
+    }
+  }
+}
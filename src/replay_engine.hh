@@ -0,0 +1,90 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// replay_engine.hh
+// search engine serving recorded result pages from a local folder;
+// used to run the ranking code offline
+
+#ifndef RANKTRACKER_REPLAY_ENGINE_HH
+#define RANKTRACKER_REPLAY_ENGINE_HH
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+
+#include "engines.hh"
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * Configuration of the replay engine.
+     */
+    struct replay_options {
+      std::string pages_dir;  // folder with the recorded *.html pages
+      unsigned latency_ms;    // synthetic latency added to every page
+      unsigned jitter_ms;     // random extra latency, between 0 and jitter_ms
+      double error_rate;      // probability of a page fetch failing (0..1)
+      double throttle_rate;   // probability of a rate limited answer (0..1)
+      unsigned seed;          // seed of the latency and error generator
+
+      replay_options() :
+        latency_ms(0),
+        jitter_ms(0),
+        error_rate(0),
+        throttle_rate(0),
+        seed(0)
+      {}
+    };
+
+    /**
+     * Reads the replay options from the environment:
+     *
+     *   RANKTRACKER_REPLAY_DIR           - folder with the recorded pages
+     *   RANKTRACKER_REPLAY_LATENCY_MS    - latency of each page fetch
+     *   RANKTRACKER_REPLAY_JITTER_MS     - maximum random extra latency
+     *   RANKTRACKER_REPLAY_ERROR_RATE    - probability of a failed fetch
+     *   RANKTRACKER_REPLAY_THROTTLE_RATE - probability of a rate limited fetch
+     *   RANKTRACKER_REPLAY_SEED          - seed for latency and errors
+     *
+     * Returns false if no replay folder is configured.
+     */
+    bool replay_options_from_env(replay_options& options);
+
+    /**
+     * Search engine answering the queries with recorded Google result
+     * pages. The pages are parsed exactly as the live ones, so the parser
+     * and the database writes are exercised without any network access.
+     *
+     * For a query, the pages are taken from the sub-folder named after
+     * the keywords (lower case, non alphanumeric characters replaced by
+     * '-'), if it exists, or from the replay folder itself. The pages are
+     * served in file name order, the n-th result page being selected by
+     * the `start` parameter of the next page link; when the recorded pages
+     * are exhausted they are served again from the first one.
+     */
+    class ReplayEngine : public GoogleEngine {
+      replay_options _options;
+      mutable std::mutex _rng_mutex;
+      mutable std::mt19937 _rng;
+
+      std::vector<std::string> recorded_pages(const std::string& keywords) const;
+      void simulate_network() const;
+
+    public:
+      using GoogleEngine::GoogleEngine;
+
+      void configure(const replay_options& options);
+      const replay_options& options() const { return _options; }
+
+    protected:
+      transfer_stats fetch_page(CURL *session,
+                                const std::string& page_url,
+                                curl_write_callback rcv,
+                                void *rcv_data) const override;
+
+      std::chrono::milliseconds page_delay() const override;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,227 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// resilience.cc
+// retries with backoff and circuit breakers for the ranking queries
+
+#include "resilience.hh"
+
+#include <algorithm>
+#include <thread>
+
+namespace ranktracker {
+  namespace engine {
+
+    failure_class classify_current_failure() {
+      try {
+        throw;
+      } catch (const throttled_exception&) {
+        return FAILURE_THROTTLED;
+      } catch (const http_status_exception& e) {
+        if(e.status() == 429) return FAILURE_THROTTLED;
+        if(e.status() >= 500) return FAILURE_TRANSIENT;
+        return FAILURE_PERMANENT;
+      } catch (const http_request_failed_exception& e) {
+        switch(e.result_code()) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+          return FAILURE_TRANSIENT;
+        case CURLE_WRITE_ERROR:
+          // the parser refused a chunk of the page
+          return FAILURE_PARSE;
+        default:
+          return FAILURE_PERMANENT;
+        }
+      } catch (const parse_exception&) {
+        return FAILURE_PARSE;
+      } catch (const dom_exception&) {
+        return FAILURE_PARSE;
+      } catch (...) {
+        return FAILURE_PERMANENT;
+      }
+    }
+
+    bool circuit_breaker::allow(resilience_clock::time_point now) {
+      switch(_state) {
+      case CLOSED:
+        return true;
+      case OPEN:
+        if(now < _open_until) return false;
+        BOOST_LOG_TRIVIAL(info) << "circuit breaker cooldown expired; sending a probe query\n";
+        _state = HALF_OPEN;
+        return true;
+      case HALF_OPEN:
+        // only the probe query is allowed until it completes
+        return false;
+      }
+      return false;
+    }
+
+    void circuit_breaker::success() {
+      if(_state != CLOSED) {
+        BOOST_LOG_TRIVIAL(info) << "circuit breaker closed\n";
+      }
+      _state = CLOSED;
+      _throttled = 0;
+      _cooldown = std::chrono::seconds(0);
+    }
+
+    bool circuit_breaker::throttled(const resilience_options& options, resilience_clock::time_point now) {
+      _throttled++;
+      if(_state == HALF_OPEN) {
+        _cooldown = std::min(_cooldown * 2, options.breaker_max_cooldown);
+      } else if(_throttled >= options.breaker_threshold) {
+        _cooldown = options.breaker_cooldown;
+      } else {
+        return false;
+      }
+      _state = OPEN;
+      _open_until = now + _cooldown;
+      BOOST_LOG_TRIVIAL(warning) << "circuit breaker opened for " << _cooldown.count() << "s\n";
+      return true;
+    }
+
+    EngineResilience::EngineResilience(const resilience_options& options) :
+      _options(options),
+      _rng(std::random_device()())
+    {}
+
+    std::chrono::milliseconds EngineResilience::backoff(unsigned attempt) {
+      // full jitter: a random delay up to the exponential backoff limit
+      auto limit = _options.backoff_base.count() << std::min(attempt, 16u);
+      limit = std::min<decltype(limit)>(limit, _options.backoff_max.count());
+      std::lock_guard<std::mutex> lock(_mutex);
+      return std::chrono::milliseconds(std::uniform_int_distribution<decltype(limit)>(limit / 2, limit)(_rng));
+    }
+
+    bool EngineResilience::available(const SearchEngine& e) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& breaker = _breakers[e.id()];
+      auto now = resilience_clock::now();
+      return breaker.state() == circuit_breaker::CLOSED ||
+        (breaker.state() == circuit_breaker::OPEN && breaker.open_until() <= now);
+    }
+
+    resilience_clock::time_point EngineResilience::next_probe() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto next = resilience_clock::time_point::max();
+      for(auto& b: _breakers) {
+        if(b.second.state() == circuit_breaker::OPEN) {
+          next = std::min(next, b.second.open_until());
+        }
+      }
+      return next;
+    }
+
+    bool EngineResilience::admit(const SearchEngine& e) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _breakers[e.id()].allow(resilience_clock::now());
+    }
+
+    failure_class EngineResilience::failed(const SearchEngine& e) {
+      auto failure = classify_current_failure();
+      if(failure == FAILURE_THROTTLED) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_breakers[e.id()].throttled(_options, resilience_clock::now())) {
+          BOOST_LOG_TRIVIAL(warning) << "pausing the queries to " << e.name() << std::endl;
+        }
+      }
+      return failure;
+    }
+
+    void EngineResilience::succeeded(const SearchEngine& e) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _breakers[e.id()].success();
+    }
+
+    void EngineResilience::abandoned(const SearchEngine& e) {
+      // a failed probe must not leave the breaker half open
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto& breaker = _breakers[e.id()];
+      if(breaker.state() == circuit_breaker::HALF_OPEN) {
+        breaker.success();
+      }
+    }
+
+    rank_result_type EngineResilience::perform_rank_query(const SearchEngine& e,
+                                                          std::string domain,
+                                                          std::string keywords,
+                                                          progress_updater& p,
+                                                          std::string *page_url,
+                                                          const query_options& options,
+                                                          rank_query_result *details) {
+      BOOST_LOG_TRIVIAL(trace) << "EngineResilience::perform_rank_query() enter\n";
+      bool parse_retried = false;
+      for(unsigned attempt = 0; ; attempt++) {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          auto& breaker = _breakers[e.id()];
+          // the retries of a probe query keep the breaker half open
+          bool allowed = attempt == 0 ?
+            breaker.allow(resilience_clock::now()) :
+            breaker.state() != circuit_breaker::OPEN;
+          if(!allowed) {
+            BOOST_LOG_TRIVIAL(trace) << "EngineResilience::perform_rank_query(): circuit open for "
+                                     << e.name() << std::endl;
+            throw circuit_open_exception(breaker.open_until());
+          }
+        }
+
+        failure_class failure;
+        try {
+          auto rank = e.perform_rank_query(domain, keywords, p, page_url, options, details);
+          std::lock_guard<std::mutex> lock(_mutex);
+          _breakers[e.id()].success();
+          BOOST_LOG_TRIVIAL(trace) << "EngineResilience::perform_rank_query() exit\n";
+          return rank;
+        } catch (...) {
+          failure = classify_current_failure();
+          bool retry = attempt + 1 < _options.max_attempts;
+          switch(failure) {
+          case FAILURE_THROTTLED:
+            {
+              std::lock_guard<std::mutex> lock(_mutex);
+              auto& breaker = _breakers[e.id()];
+              if(breaker.throttled(_options, resilience_clock::now())) {
+                BOOST_LOG_TRIVIAL(warning) << "pausing the queries to " << e.name() << std::endl;
+                throw circuit_open_exception(breaker.open_until());
+              }
+            }
+            break;
+          case FAILURE_TRANSIENT:
+            break;
+          case FAILURE_PARSE:
+            retry = retry && !parse_retried;
+            parse_retried = true;
+            break;
+          case FAILURE_PERMANENT:
+            retry = false;
+            break;
+          }
+          if(!retry) {
+            BOOST_LOG_TRIVIAL(error) << "ranking query for '" << keywords << "' on " << e.name()
+                                     << " failed after " << attempt + 1 << " attempts\n";
+            {
+              // a failed probe must not leave the breaker half open
+              std::lock_guard<std::mutex> lock(_mutex);
+              auto& breaker = _breakers[e.id()];
+              if(breaker.state() == circuit_breaker::HALF_OPEN && failure != FAILURE_THROTTLED) {
+                breaker.success();
+              }
+            }
+            throw;
+          }
+        }
+
+        auto delay = backoff(attempt);
+        BOOST_LOG_TRIVIAL(warning) << "ranking query for '" << keywords << "' on " << e.name()
+                                   << " failed; retrying in " << delay.count() << "ms\n";
+        std::this_thread::sleep_for(delay);
+      }
+    }
+  }
+}
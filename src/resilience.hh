@@ -0,0 +1,174 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// resilience.hh
+// retries with backoff and circuit breakers for the ranking queries
+
+#ifndef RANKTRACKER_RESILIENCE_HH
+#define RANKTRACKER_RESILIENCE_HH
+
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+
+#include "engines.hh"
+
+namespace ranktracker {
+  namespace engine {
+
+    typedef std::chrono::steady_clock resilience_clock;
+
+    /**
+     * How a failed ranking query should be handled.
+     */
+    enum failure_class {
+      FAILURE_TRANSIENT,   // network errors and server errors; retry
+      FAILURE_THROTTLED,   // the engine refuses our queries; back off
+      FAILURE_PARSE,       // the page could not be processed; retry once
+      FAILURE_PERMANENT    // retrying will not help
+    };
+
+    /**
+     * Classifies the exception currently being handled. Must be called
+     * from inside a catch block.
+     */
+    failure_class classify_current_failure();
+
+    struct resilience_options {
+      unsigned max_attempts;                      // attempts of a query, including the first
+      std::chrono::milliseconds backoff_base;     // delay before the first retry
+      std::chrono::milliseconds backoff_max;      // upper limit of the retry delay
+      unsigned breaker_threshold;                 // consecutive throttled answers opening the breaker
+      std::chrono::seconds breaker_cooldown;      // how long an opened breaker stays open
+      std::chrono::seconds breaker_max_cooldown;  // limit for the cooldown, doubled on each failed probe
+
+      resilience_options() :
+        max_attempts(4),
+        backoff_base(std::chrono::seconds(5)),
+        backoff_max(std::chrono::minutes(5)),
+        breaker_threshold(2),
+        breaker_cooldown(std::chrono::minutes(10)),
+        breaker_max_cooldown(std::chrono::hours(2))
+      {}
+    };
+
+    /**
+     * Circuit breaker guarding the queries sent to one search engine.
+     * After `breaker_threshold` consecutive throttled answers the breaker
+     * opens and no queries are sent to the engine until the cooldown
+     * expires. Then one probe query is allowed: if it succeeds the breaker
+     * closes, otherwise it opens again with a doubled cooldown.
+     */
+    class circuit_breaker {
+    public:
+      enum state_t {
+        CLOSED,
+        OPEN,
+        HALF_OPEN
+      };
+
+    private:
+      state_t _state;
+      unsigned _throttled;
+      std::chrono::seconds _cooldown;
+      resilience_clock::time_point _open_until;
+
+    public:
+      circuit_breaker() : _state(CLOSED), _throttled(0), _cooldown(0) {}
+
+      state_t state() const { return _state; }
+      resilience_clock::time_point open_until() const { return _open_until; }
+
+      /**
+       * Checks if a query may be sent now; moves an open breaker to half
+       * open when its cooldown expired.
+       */
+      bool allow(resilience_clock::time_point now);
+
+      void success();
+
+      /**
+       * Records a throttled answer. Returns true if the breaker is open
+       * after it.
+       */
+      bool throttled(const resilience_options& options, resilience_clock::time_point now);
+    };
+
+    /**
+     * Thrown instead of running a query when the circuit breaker of the
+     * engine is open.
+     */
+    class circuit_open_exception : public search_exception {
+      resilience_clock::time_point _until;
+    public:
+      circuit_open_exception(resilience_clock::time_point until) : _until(until) {}
+
+      resilience_clock::time_point until() const { return _until; }
+    };
+
+    /**
+     * Runs the ranking queries with retries, jittered exponential backoff
+     * and a circuit breaker for each search engine.
+     */
+    class EngineResilience {
+      resilience_options _options;
+      std::mutex _mutex;
+      std::unordered_map<Entity::id_type, circuit_breaker, boost::hash<Entity::id_type>> _breakers;
+      std::mt19937 _rng;
+
+    public:
+      EngineResilience(const resilience_options& options = resilience_options());
+
+      EngineResilience(const EngineResilience&) = delete;
+      EngineResilience& operator= (const EngineResilience&) = delete;
+
+      /**
+       * Performs the ranking query, retrying the transient failures.
+       * Throws `circuit_open_exception` if the engine's breaker is open
+       * or it opens while retrying; other failures are rethrown after the
+       * retries are exhausted. `details` gets the cost of the attempt
+       * that succeeded.
+       */
+      rank_result_type perform_rank_query(const SearchEngine& e,
+                                          std::string domain,
+                                          std::string keywords,
+                                          progress_updater& p,
+                                          std::string *page_url = nullptr,
+                                          const query_options& options = query_options(),
+                                          rank_query_result *details = nullptr);
+
+      /**
+       * Checks if queries may be sent to the engine now.
+       */
+      bool available(const SearchEngine& e);
+
+      /**
+       * The earliest time an open breaker allows a probe query;
+       * `resilience_clock::time_point::max()` if no breaker is open.
+       */
+      resilience_clock::time_point next_probe();
+
+      const resilience_options& options() const { return _options; }
+
+      /**
+       * The jittered delay before the given retry of a query.
+       */
+      std::chrono::milliseconds backoff(unsigned attempt);
+
+      /**
+       * For the queries run one page at a time, without
+       * `perform_rank_query` (see `RefreshPipeline`): `admit` checks the
+       * breaker before the query is started, like the first attempt of
+       * `perform_rank_query`; `failed` classifies the exception being
+       * handled and counts the throttled answers, and must be called from
+       * inside a catch block; `succeeded` or `abandoned` is called when
+       * the query is finished or given up.
+       */
+      bool admit(const SearchEngine& e);
+      failure_class failed(const SearchEngine& e);
+      void succeeded(const SearchEngine& e);
+      void abandoned(const SearchEngine& e);
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,122 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// scheduler.cc
+// volatility driven selection of the rankings to refresh
+
+#include "scheduler.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace ranktracker {
+  namespace ranking {
+
+    // rank used for "not in the results" when measuring changes
+    double const not_ranked = 101;
+
+    static double rank_value(ranktracker::engine::rank_result_type rank) {
+      return rank < 0 ? not_ranked : rank;
+    }
+
+    // how likely a ranking in a position is to move
+    static double rank_bucket_weight(ranktracker::engine::rank_result_type rank) {
+      if(rank < 0) return 0.3;   // not in the top 100
+      if(rank <= 3) return 0.2;  // top positions are stable
+      if(rank <= 7) return 0.6;
+      if(rank <= 30) return 1.0; // bottom of the first page up to the third page
+      return 0.5;
+    }
+
+    double refresh_priority(const std::vector<Ranking>& history,
+                            const ptime& now,
+                            const schedule_options& options) {
+      if(history.empty()) {
+        return std::numeric_limits<double>::infinity();
+      }
+
+      auto const& last = history.back();
+      auto age = now - last._ranking_date;
+      if(age + options.run_interval >= options.max_staleness) {
+        return std::numeric_limits<double>::infinity();
+      }
+      double staleness = (double)age.total_seconds() / options.max_staleness.total_seconds();
+
+      // variance of the recent ranks
+      auto first = history.size() > options.history ? history.end() - options.history : history.begin();
+      double n = history.end() - first;
+      double mean = 0;
+      for(auto r = first; r != history.end(); r++) mean += rank_value(r->_rank);
+      mean /= n;
+      double variance = 0;
+      for(auto r = first; r != history.end(); r++) {
+        variance += (rank_value(r->_rank) - mean) * (rank_value(r->_rank) - mean);
+      }
+      variance /= n;
+
+      double delta = 0;
+      if(history.size() > 1) {
+        delta = std::fabs(rank_value(last._rank) - rank_value(history[history.size() - 2]._rank));
+      }
+
+      double volatility = std::min(3.0, (std::sqrt(variance) + 2 * delta) / 10);
+      return staleness * (0.5 + rank_bucket_weight(last._rank) + volatility);
+    }
+
+    std::vector<RefreshUnit> RefreshScheduler::plan(const std::vector<Domain>& ds,
+                                                    const schedule_options& options,
+                                                    std::size_t queued,
+                                                    const ptime& now) const {
+      BOOST_LOG_TRIVIAL(trace) << "RefreshScheduler::plan() enter\n";
+      struct candidate {
+        RefreshUnit unit;
+        double priority;
+      };
+      std::vector<candidate> candidates;
+
+      for(auto& d: ds) {
+        for(auto& k: _db.keywords(d)) {
+          for(auto& e: d.engines()) {
+            auto history = _db.rankings(k, *e);
+            std::sort(history.begin(), history.end(), [](const Ranking& a, const Ranking& b) {
+                return a._ranking_date < b._ranking_date;
+              });
+            RefreshUnit unit = {k.id(), e.id(), d.id(), 0, RefreshUnit::PENDING, 0, now};
+            candidates.push_back({unit, refresh_priority(history, now, options)});
+          }
+        }
+      }
+
+      std::stable_sort(candidates.begin(), candidates.end(), [](const candidate& a, const candidate& b) {
+          return a.priority > b.priority;
+        });
+
+      // the pages fetched today by the earlier runs and the other
+      // refreshes, and the ones the queued units will fetch
+      DayCost cost = _db.day_cost(now.date());
+      double pages_per_query = cost._queries == 0 ? 1 : std::max(1.0, (double)cost._pages / cost._queries);
+      double spent = cost._pages + queued * pages_per_query;
+      std::size_t budget = spent < options.budget ? (std::size_t)((options.budget - spent) / pages_per_query) : 0;
+
+      std::vector<RefreshUnit> units;
+      std::size_t overdue = 0;
+      for(auto& c: candidates) {
+        bool is_overdue = std::isinf(c.priority);
+        if(!is_overdue && units.size() >= budget) break;
+        if(is_overdue) overdue++;
+        c.unit._seq = units.size();
+        units.push_back(c.unit);
+      }
+
+      if(overdue > budget) {
+        BOOST_LOG_TRIVIAL(warning) << "RefreshScheduler: " << overdue << " rankings are due, over the "
+                                   << budget << " queries left of the daily budget of " << options.budget
+                                   << " pages; increase the budget to keep the rankings fresh\n";
+      }
+      BOOST_LOG_TRIVIAL(info) << "RefreshScheduler: selected " << units.size() << " of "
+                              << candidates.size() << " rankings (" << overdue << " overdue); "
+                              << cost._pages << " pages fetched today, " << queued << " rankings queued\n";
+      BOOST_LOG_TRIVIAL(trace) << "RefreshScheduler::plan() exit\n";
+      return units;
+    }
+  }
+}
@@ -0,0 +1,74 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// scheduler.hh
+// chooses which rankings to refresh, spending a limited number of
+// ranking queries where the rankings are most likely to change
+
+#ifndef RANKTRACKER_SCHEDULER_HH
+#define RANKTRACKER_SCHEDULER_HH
+
+#include <vector>
+
+#include "data_provider.hh"
+
+namespace ranktracker {
+  namespace ranking {
+    using namespace ranktracker::data;
+    using namespace ranktracker::persistence;
+
+    struct schedule_options {
+      std::size_t budget;                                 // result pages fetched a day, all the refreshes together
+      boost::posix_time::time_duration max_staleness;     // maximum age of a ranking
+      boost::posix_time::time_duration run_interval;      // time between two scheduled runs
+      std::size_t history;                                // rankings used to measure volatility
+
+      schedule_options() :
+        budget(200),
+        max_staleness(boost::posix_time::hours(7 * 24)),
+        run_interval(boost::posix_time::hours(24)),
+        history(10)
+      {}
+    };
+
+    /**
+     * Priority of refreshing a ranking, computed from its history
+     * (sorted by date, as returned by `DataProvider::rankings`). It grows
+     * with the age of the last ranking, the variance of the recent ranks
+     * and the last rank change, and is higher for the ranks around the
+     * first pages' boundaries, where the rankings move the most. It is
+     * infinite when the ranking is overdue, i.e. it would exceed the
+     * maximum staleness before the next scheduled run, or when there is
+     * no ranking yet.
+     */
+    double refresh_priority(const std::vector<Ranking>& history,
+                            const ptime& now,
+                            const schedule_options& options);
+
+    /**
+     * Plans the refresh units of a scheduled run.
+     */
+    class RefreshScheduler {
+      DataProvider& _db;
+
+    public:
+      RefreshScheduler(DataProvider& db) : _db(db) {}
+
+      /**
+       * Selects the (keyword, engine) units of the given domains to be
+       * refreshed: all the overdue units, then the units with the
+       * highest priority, up to what is left of the day's budget. The
+       * pages fetched since midnight by the queries whose costs were
+       * stored, whatever refresh made them, and the `queued` units still
+       * waiting in the refresh queue are taken from the budget; a unit
+       * is counted for the average pages of the day's queries. The
+       * overdue units are selected even if they exceed the budget.
+       * Expects a transaction to be opened.
+       */
+      std::vector<RefreshUnit> plan(const std::vector<Domain>& ds,
+                                    const schedule_options& options,
+                                    std::size_t queued = 0,
+                                    const ptime& now = second_clock::local_time()) const;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,403 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp-bench.cc
+// benchmarks of the parsing of the recorded google result pages: the
+// streaming scanner and the DOM extraction, at several chunk sizes,
+// compared with a stored baseline
+
+#include "engines.hh"
+#include "serp_scanner.hh"
+#include "byte_scan.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/uuid/nil_generator.hpp>
+#include <lexbor/core/lexbor.h>
+
+using namespace ranktracker::engine;
+namespace fs = boost::filesystem;
+
+// the heap allocations of the process: by operator new, and by lexbor
+// through the memory functions it is given
+static std::atomic<unsigned long> heap_allocations(0);
+
+void *operator new(std::size_t size) {
+  heap_allocations++;
+  void *p = std::malloc(size ? size : 1);
+  if(!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+static void *counting_malloc(size_t size) {
+  heap_allocations++;
+  return std::malloc(size);
+}
+
+static void *counting_realloc(void *p, size_t size) {
+  heap_allocations++;
+  return std::realloc(p, size);
+}
+
+static void *counting_calloc(size_t n, size_t size) {
+  heap_allocations++;
+  return std::calloc(n, size);
+}
+
+static void counting_free(void *p) {
+  std::free(p);
+}
+
+static void usage(const char *program);
+static void init_log(bool verbose);
+
+struct bench_page {
+  std::string name;     // the file name, the key of the page in the baseline
+  std::string body;
+};
+
+// what is measured for a page, a parser and a chunk size
+struct bench_case {
+  std::string page;
+  std::string parser;
+  std::size_t chunk;    // 0 for the whole page at once
+  double pages_per_sec;
+  double mb_per_sec;
+  double allocations;   // per page, once the parser state of the thread exists
+  double p50_us;
+  double p99_us;
+
+  std::tuple<std::string, std::string, std::size_t> key() const {
+    return std::make_tuple(page, parser, chunk);
+  }
+};
+
+static double percentile(std::vector<double>& v, double p) {
+  if(v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  std::size_t i = (std::size_t)std::ceil(p * v.size());
+  return v[std::min(v.size(), std::max((std::size_t)1, i)) - 1];
+}
+
+static serp_page parse(const GoogleEngine& engine, const bench_page& page,
+                       const std::string& domain, int limit, std::size_t chunk, bool& failed) {
+  failed = false;
+  try {
+    return chunk == 0 ?
+      engine.parse_page(page.body, domain, limit) :
+      engine.receive_page(page.body, domain, limit, chunk);
+  } catch (search_exception) {
+    failed = true;
+  }
+  return serp_page();
+}
+
+static bench_case run(const GoogleEngine& engine, const bench_page& page,
+                      const std::string& domain, int limit, unsigned runs, std::size_t chunk) {
+  bool failed;
+  // the first parse creates the parser state of the thread
+  parse(engine, page, domain, limit, chunk, failed);
+
+  std::vector<double> latencies;
+  latencies.reserve(runs);
+  auto allocations = heap_allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for(unsigned i = 0; i < runs; i++) {
+    auto page_start = std::chrono::steady_clock::now();
+    parse(engine, page, domain, limit, chunk, failed);
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>
+                        (std::chrono::steady_clock::now() - page_start).count() / 1000.0);
+  }
+  double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - start).count() / 1e9;
+  allocations = heap_allocations.load() - allocations;
+
+  bench_case c;
+  c.page = page.name;
+  c.parser = engine.name();
+  c.chunk = chunk;
+  c.pages_per_sec = runs / seconds;
+  c.mb_per_sec = page.body.size() * c.pages_per_sec / 1e6;
+  c.allocations = double(allocations) / runs;
+  c.p50_us = percentile(latencies, 0.5);
+  c.p99_us = percentile(latencies, 0.99);
+  return c;
+}
+
+static bool same_page(const serp_page& a, bool a_failed, const serp_page& b, bool b_failed) {
+  return a_failed == b_failed &&
+    a.results == b.results &&
+    a.found == b.found &&
+    a.page_url == b.page_url &&
+    a.next_link == b.next_link &&
+    a.urls == b.urls;
+}
+
+static void print_page(const serp_page& page, bool failed) {
+  std::cout << page.results << " results, found " << page.found << ", url '" << page.page_url
+            << "', next '" << page.next_link << "', " << page.urls.size() << " urls"
+            << (failed ? ", failed" : "");
+}
+
+// the baseline has a line for each case:
+// page parser chunk pages/s MB/s allocations/page p50 p99
+static bool read_baseline(const std::string& file, std::vector<bench_case>& cases) {
+  std::ifstream in(file);
+  if(!in) return false;
+  std::string line;
+  while(std::getline(in, line)) {
+    if(line.empty() || line[0] == '#') continue;
+    std::istringstream fields(line);
+    bench_case c;
+    if(fields >> c.page >> c.parser >> c.chunk >> c.pages_per_sec >> c.mb_per_sec
+       >> c.allocations >> c.p50_us >> c.p99_us) {
+      cases.push_back(c);
+    }
+  }
+  return true;
+}
+
+static bool write_baseline(const std::string& file, const std::vector<bench_case>& cases) {
+  std::ofstream out(file);
+  if(!out) return false;
+  out << "# serp-bench baseline: page parser chunk pages/s MB/s allocations/page p50-us p99-us\n";
+  out << std::fixed << std::setprecision(1);
+  for(auto& c: cases) {
+    out << c.page << ' ' << c.parser << ' ' << c.chunk << ' ' << c.pages_per_sec << ' ' << c.mb_per_sec
+        << ' ' << c.allocations << ' ' << c.p50_us << ' ' << c.p99_us << '\n';
+  }
+  return bool(out);
+}
+
+// the cases slower, or allocating more, than in the baseline; the cases
+// missing from the baseline are not compared
+static unsigned compare(const std::vector<bench_case>& cases, const std::vector<bench_case>& baseline,
+                        double tolerance) {
+  std::map<std::tuple<std::string, std::string, std::size_t>, bench_case> base;
+  for(auto& b: baseline) base[b.key()] = b;
+  unsigned regressions = 0;
+  std::cout << std::setprecision(1);
+  for(auto& c: cases) {
+    auto i = base.find(c.key());
+    if(i == base.end()) continue;
+    auto const& b = i->second;
+    std::ostringstream worse;
+    worse << std::fixed << std::setprecision(1);
+    if(c.pages_per_sec < b.pages_per_sec * (1 - tolerance)) {
+      worse << " pages/s " << b.pages_per_sec << " -> " << c.pages_per_sec << ";";
+    }
+    if(c.p99_us > b.p99_us * (1 + tolerance)) {
+      worse << " p99 " << b.p99_us << " -> " << c.p99_us << " us;";
+    }
+    // the allocations do not depend on the machine
+    if(c.allocations > b.allocations + 1) {
+      worse << " allocations " << b.allocations << " -> " << c.allocations << ";";
+    }
+    if(!worse.str().empty()) {
+      regressions++;
+      std::cout << "REGRESSION " << c.page << ' ' << c.parser << " chunk " << c.chunk << ':' << worse.str() << '\n';
+    }
+  }
+  return regressions;
+}
+
+static bool parse_chunks(const char *list, std::vector<std::size_t>& chunks) {
+  chunks.clear();
+  std::istringstream in(list);
+  std::string chunk;
+  while(std::getline(in, chunk, ',')) {
+    char *end;
+    unsigned long c = std::strtoul(chunk.c_str(), &end, 10);
+    if(chunk.empty() || *end != 0) return false;
+    chunks.push_back(c);
+  }
+  return !chunks.empty();
+}
+
+/**
+ bench entry point
+*/
+int main(int argc, char **argv) {
+  std::vector<std::string> files;
+  std::string domain = "no-such-domain.invalid";
+  std::string baseline_file, new_baseline_file;
+  int limit = 100;
+  unsigned runs = 200;
+  double tolerance = 0.25;
+  bool verbose = false;
+  std::vector<std::size_t> chunks = {0, 1024, CURL_MAX_WRITE_SIZE};
+  for(int i = 1; i < argc; i++) {
+    if(std::strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      domain = argv[++i];
+    } else if(std::strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      limit = std::atoi(argv[++i]);
+    } else if(std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = std::max(1, std::atoi(argv[++i]));
+    } else if(std::strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      if(!parse_chunks(argv[++i], chunks)) {
+        usage(argv[0]);
+        return 2;
+      }
+    } else if(std::strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+      std::vector<std::string> corpus;
+      try {
+        for(fs::directory_iterator f(argv[++i]); f != fs::directory_iterator(); f++) {
+          if(f->path().extension() == ".html") corpus.push_back(f->path().string());
+        }
+      } catch (fs::filesystem_error& e) {
+        std::cerr << "Can not read the folder " << argv[i] << ": " << e.what() << std::endl;
+        return 1;
+      }
+      std::sort(corpus.begin(), corpus.end());
+      files.insert(files.end(), corpus.begin(), corpus.end());
+    } else if(std::strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if(std::strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      new_baseline_file = argv[++i];
+    } else if(std::strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      tolerance = std::atof(argv[++i]);
+    } else if(std::strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if(argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if(files.empty()) {
+    files.push_back("../search-result01.html");
+    files.push_back("../search-result02.html");
+  }
+  // before lexbor allocates anything
+  lexbor_memory_setup(counting_malloc, counting_realloc, counting_calloc, counting_free);
+  init_log(verbose);
+
+  std::vector<bench_page> pages;
+  for(auto& f: files) {
+    std::ifstream in(f, std::ios::binary);
+    if(!in) {
+      std::cerr << "Can not read " << f << std::endl;
+      return 1;
+    }
+    std::ostringstream body;
+    body << in.rdbuf();
+    pages.push_back({fs::path(f).filename().string(), body.str()});
+  }
+
+  GoogleEngine dom(boost::uuids::nil_uuid(), "dom", "DOM extraction", "http://bench.invalid");
+  dom.serp_parser(GoogleEngine::DOM_PARSER);
+  GoogleEngine stream(boost::uuids::nil_uuid(), "stream", "Streaming scanner", "http://bench.invalid");
+  stream.serp_parser(GoogleEngine::STREAM_PARSER);
+  const GoogleEngine *engines[] = {&dom, &stream};
+
+  // both parsers find the same, however the page is received
+  bool all_same = true;
+  for(auto& p: pages) {
+    bool expected_failed;
+    auto expected = parse(dom, p, domain, limit, 0, expected_failed);
+    std::cout << p.name << " (" << p.body.size() << " bytes): " << expected.urls.size() << " results"
+              << (expected.found ? ", domain found" : "") << (expected.next_link.empty() ? "" : ", next link")
+              << (expected_failed ? ", not a results page" : "") << '\n';
+    for(auto engine: engines) {
+      for(auto chunk: chunks) {
+        bool failed;
+        auto page = parse(*engine, p, domain, limit, chunk, failed);
+        if(!same_page(expected, expected_failed, page, failed)) {
+          all_same = false;
+          std::cout << "  MISMATCH " << engine->name() << " chunk " << chunk << ": ";
+          print_page(page, failed);
+          std::cout << "\n    dom, whole page: ";
+          print_page(expected, expected_failed);
+          std::cout << '\n';
+        }
+      }
+    }
+  }
+
+  std::vector<bench_case> cases;
+  std::cout << "\nbyte searches: " << byte_scan_instructions() << '\n';
+  std::cout << '\n' << std::left << std::setw(28) << "page" << std::right << std::setw(7) << "parser"
+            << std::setw(7) << "chunk" << std::setw(10) << "pages/s" << std::setw(8) << "MB/s"
+            << std::setw(13) << "allocs/page" << std::setw(9) << "p50 us" << std::setw(9) << "p99 us" << '\n'
+            << std::fixed;
+  for(auto& p: pages) {
+    for(auto engine: engines) {
+      for(auto chunk: chunks) {
+        auto c = run(*engine, p, domain, limit, runs, chunk);
+        cases.push_back(c);
+        std::cout << std::left << std::setw(28) << c.page << std::right << std::setw(7) << c.parser
+                  << std::setw(7) << c.chunk << std::setprecision(0) << std::setw(10) << c.pages_per_sec
+                  << std::setprecision(1) << std::setw(8) << c.mb_per_sec << std::setw(13) << c.allocations
+                  << std::setw(9) << c.p50_us << std::setw(9) << c.p99_us << '\n';
+      }
+    }
+  }
+
+  int status = all_same ? 0 : 1;
+  if(!baseline_file.empty()) {
+    std::vector<bench_case> baseline;
+    if(!read_baseline(baseline_file, baseline)) {
+      std::cout << "No baseline in " << baseline_file << "; record one with -w\n";
+    } else {
+      unsigned regressions = compare(cases, baseline, tolerance);
+      std::cout << regressions << " regressions against " << baseline_file << " (tolerance "
+                << std::setprecision(0) << tolerance * 100 << "%)\n";
+      if(regressions) status = 1;
+    }
+  }
+  if(!new_baseline_file.empty()) {
+    if(!write_baseline(new_baseline_file, cases)) {
+      std::cerr << "Can not write " << new_baseline_file << std::endl;
+      return 1;
+    }
+    std::cout << "Baseline written to " << new_baseline_file << '\n';
+  }
+  return status;
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " [-d domain] [-l limit] [-n runs] [-c chunks] [-D folder]\n"
+            << "       [-b baseline] [-w baseline] [-t tolerance] [-v] [page.html...]\n"
+            << "  -d  domain looked for on the pages (default: none of the results)\n"
+            << "  -l  results looked at on each page (default: 100)\n"
+            << "  -n  parses of each page by each parser, for each chunk size (default: 200)\n"
+            << "  -c  comma separated sizes of the chunks the pages are received in; 0 parses\n"
+            << "      the whole page at once (default: 0,1024," << CURL_MAX_WRITE_SIZE << ")\n"
+            << "  -D  adds the .html pages of a folder\n"
+            << "  -b  fails if slower, or allocating more, than the baseline in the file\n"
+            << "  -w  writes the results to the file, as the new baseline\n"
+            << "  -t  tolerance of the times compared with the baseline (default: 0.25)\n"
+            << "  -v  verbose (trace) logging\n"
+            << "  the pages default to the search-result*.html fixtures of the repository\n";
+}
+
+// log initialization; the bench logs to the console, warnings only
+static void init_log(bool verbose) {
+  logging::add_console_log
+    (std::clog,
+     keywords::format = "[%TimeStamp%][%ThreadID%][%Severity%]: %Message%"
+     );
+
+  logging::core::get()->set_filter
+    (logging::trivial::severity >= (verbose ? logging::trivial::trace : logging::trivial::warning));
+
+  logging::add_common_attributes();
+}
@@ -0,0 +1,439 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp-fuzz.cc
+// differential fuzzing of the parsers of the google result pages: on
+// mutated pages, the streaming scanner must find what the DOM extraction
+// finds, however the page is received, in a time proportional to the
+// size of the page
+
+#include "engines.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/uuid/nil_generator.hpp>
+
+using namespace ranktracker::engine;
+namespace fs = boost::filesystem;
+
+static void init_log(bool verbose);
+
+// what a parser found on a page, or the error it threw, and how long it
+// took
+struct outcome {
+  serp_page page;
+  std::string error;
+  double us;
+};
+
+// the time a parse may take, in microseconds per KB of the page and at
+// least, for the small pages
+static double budget_us_per_kb = 1000;
+static const double BUDGET_FLOOR_US = 50000;
+
+static const GoogleEngine& dom_engine() {
+  static GoogleEngine engine(boost::uuids::nil_uuid(), "dom", "DOM extraction", "http://fuzz.invalid");
+  engine.serp_parser(GoogleEngine::DOM_PARSER);
+  return engine;
+}
+
+static const GoogleEngine& stream_engine() {
+  static GoogleEngine engine(boost::uuids::nil_uuid(), "stream", "Streaming scanner", "http://fuzz.invalid");
+  engine.serp_parser(GoogleEngine::STREAM_PARSER);
+  return engine;
+}
+
+static outcome parse(const GoogleEngine& engine, const std::string& body,
+                     const std::string& domain, int limit, std::size_t chunk) {
+  outcome o;
+  auto start = std::chrono::steady_clock::now();
+  try {
+    o.page = chunk == 0 ?
+      engine.parse_page(body, domain, limit) :
+      engine.receive_page(body, domain, limit, chunk);
+  } catch (throttled_exception e) {
+    o.error = e.reason() == throttled_exception::CAPTCHA ? "captcha page" :
+      e.reason() == throttled_exception::CONSENT ? "consent page" : "rate limited";
+  } catch (unrecognized_page_exception) {
+    o.error = "not a results page";
+  } catch (parse_exception) {
+    o.error = "parse error";
+  } catch (search_exception) {
+    o.error = "search error";
+  }
+  o.us = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now() - start).count() / 1000.0;
+  return o;
+}
+
+static bool same_outcome(const outcome& a, const outcome& b) {
+  return a.error == b.error &&
+    a.page.results == b.page.results &&
+    a.page.found == b.page.found &&
+    a.page.page_url == b.page.page_url &&
+    a.page.next_link == b.page.next_link &&
+    a.page.urls == b.page.urls;
+}
+
+static std::string describe(const outcome& o) {
+  std::ostringstream s;
+  if(!o.error.empty()) {
+    s << o.error;
+  } else {
+    s << o.page.results << " results, found " << o.page.found << ", url '" << o.page.page_url
+      << "', next '" << o.page.next_link << "', " << o.page.urls.size() << " urls";
+    for(auto& u: o.page.urls) s << "\n      " << u;
+  }
+  return s.str();
+}
+
+// FNV-1a: the parameters of the parses depend on the input only, so a
+// failing input fails again when it is replayed
+static std::uint64_t input_hash(const std::string& body) {
+  std::uint64_t h = 14695981039346656037ull;
+  for(unsigned char c: body) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+enum verdict_t {
+  PASSED,
+  MISMATCH,
+  SLOW
+};
+
+struct verdict {
+  verdict_t result;
+  std::string report;
+  double slowest_us;    // of the parses of the input
+  double budget_us;
+};
+
+/**
+ * Parses an input with the DOM extraction, whole, and compares with it
+ * the parses by the scanner, whole and in chunks, and by the DOM in
+ * chunks. The domain looked for and the limit of results come from the
+ * input, so the early end of the parses is fuzzed too.
+ */
+static verdict check(const std::string& body) {
+  static const char * const domains[] = {"no-such-domain.invalid", "wikipedia.org", "tradegecko.com"};
+  std::uint64_t h = input_hash(body);
+  std::string domain = domains[h % 3];
+  int limit = (h >> 8) % 4 == 0 ? 1 + (h >> 16) % 10 : 100;
+  std::size_t odd_chunk = 1 + (h >> 24) % 61;
+
+  struct parse_case {
+    const GoogleEngine *engine;
+    std::size_t chunk;
+  };
+  const parse_case cases[] = {
+    {&stream_engine(), 0}, {&stream_engine(), odd_chunk}, {&stream_engine(), 1024},
+    {&stream_engine(), CURL_MAX_WRITE_SIZE}, {&dom_engine(), odd_chunk}
+  };
+
+  verdict v;
+  v.result = PASSED;
+  double budget = std::max(BUDGET_FLOOR_US, budget_us_per_kb * body.size() / 1024);
+  v.budget_us = budget;
+  std::ostringstream report;
+
+  outcome expected = parse(dom_engine(), body, domain, limit, 0);
+  v.slowest_us = expected.us;
+  if(expected.us > budget) {
+    v.result = SLOW;
+    report << "dom, whole page: " << expected.us << " us, over the budget of " << budget << " us\n";
+  }
+  for(auto& c: cases) {
+    outcome o = parse(*c.engine, body, domain, limit, c.chunk);
+    v.slowest_us = std::max(v.slowest_us, o.us);
+    if(!same_outcome(expected, o)) {
+      v.result = MISMATCH;
+      report << c.engine->name() << ", chunk " << c.chunk << ": " << describe(o) << '\n';
+    } else if(o.us > budget) {
+      if(v.result == PASSED) v.result = SLOW;
+      report << c.engine->name() << ", chunk " << c.chunk << ": " << o.us << " us, over the budget of "
+             << budget << " us\n";
+    }
+  }
+  if(v.result == MISMATCH) {
+    report << "dom, whole page: " << describe(expected) << '\n';
+  }
+  if(v.result != PASSED) {
+    report << "  (" << body.size() << " bytes, domain " << domain << ", limit " << limit << ")\n";
+  }
+  v.report = report.str();
+  return v;
+}
+
+#ifdef RT_LIBFUZZER
+
+// built with RT_LIBFUZZER=1: libFuzzer (or AFL++'s driver of the
+// libFuzzer harnesses) mutates the inputs; a failed check aborts
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void)argc;
+  (void)argv;
+  init_log(std::getenv("RANKTRACKER_FUZZ_VERBOSE") != NULL);
+  if(const char *budget = std::getenv("RANKTRACKER_FUZZ_BUDGET")) {
+    budget_us_per_kb = std::atof(budget);
+  }
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+  verdict v = check(std::string((const char *)data, size));
+  if(v.result != PASSED) {
+    std::cerr << (v.result == MISMATCH ? "MISMATCH" : "SLOW") << '\n' << v.report;
+    std::abort();
+  }
+  return 0;
+}
+
+#else
+
+// html fragments inserted by the mutations
+static const char * const fragments[] = {
+  "<", ">", "/>", "\"", "'", "=", " ", "&amp;", "&#x26;", "&", "<!--", "-->", "--!>", "<!", "<?", "</",
+  "<div>", "</div>", "<div id=\"main\">", "<div id=main>", "<a href=\"/url?q=http://example.com/&amp;sa=U\">",
+  "<a href=/url?q=https://example.org/%7e>", "</a>", "<footer>", "</footer>", "<p>", "</p>", "<li>",
+  "<ul>", "<table>", "<tr>", "<td>", "<th>", "<svg>", "</svg>", "<math>", "<script>", "</script>",
+  "<style>", "</style>", "<textarea>", "<title>", "<br/>", "<img src=x>", "<h3>", "</h3>", "<option>",
+  "<dd>", "<dt>", "<form id=\"captcha-form\">", "<form action=\"https://consent.google.com/s\">"
+};
+
+/**
+ * Mutates the seed pages, the way their bytes could be broken on the
+ * way or their markup changed by google: bytes flipped, fragments of
+ * html inserted, ranges removed, duplicated or taken from another
+ * page, pages cut short, and the pathological ones, giant attributes,
+ * deep nesting and tags with thousands of attributes.
+ */
+class mutator {
+  std::mt19937 _random;
+  const std::vector<std::string>& _seeds;
+
+  std::size_t below(std::size_t n) {
+    return n == 0 ? 0 : std::uniform_int_distribution<std::size_t>(0, n - 1)(_random);
+  }
+
+  std::size_t position(const std::string& page) {
+    return below(page.size() + 1);
+  }
+
+  // the place after the name of a start tag, from a random place
+  std::size_t in_tag(const std::string& page) {
+    std::size_t p = position(page);
+    while((p = page.find('<', p)) != std::string::npos) {
+      if(p + 1 < page.size() && std::isalpha((unsigned char)page[p + 1])) {
+        return std::min(page.size(), page.find_first_of(" />", p + 1));
+      }
+      p++;
+    }
+    return position(page);
+  }
+
+  void mutate(std::string& page) {
+    std::size_t at = position(page);
+    std::size_t len = 1 + below(std::min<std::size_t>(page.size(), 4096));
+    switch(below(10)) {
+    case 0:
+      if(!page.empty()) page[below(page.size())] = (char)below(256);
+      break;
+    case 1:
+      page.insert(at, fragments[below(sizeof(fragments) / sizeof(fragments[0]))]);
+      break;
+    case 2:
+      page.erase(at, len);
+      break;
+    case 3:
+      page.insert(position(page), page.substr(at, len));
+      break;
+    case 4:
+      page.resize(at);
+      break;
+    case 5:
+      page.insert(in_tag(page), " data-fuzz=\"" + std::string((std::size_t)1 << (10 + below(11)), 'x') + "\"");
+      break;
+    case 6: {
+      std::string nesting;
+      for(std::size_t i = 1 + below(20000); i > 0; i--) nesting += "<div>";
+      page.insert(at, nesting);
+      break;
+    }
+    case 7: {
+      std::string attributes;
+      for(std::size_t i = 1 + below(5000); i > 0; i--) attributes += " a" + std::to_string(i) + "=1";
+      page.insert(in_tag(page), attributes);
+      break;
+    }
+    case 8:
+      for(std::size_t i = at; i < std::min(page.size(), at + len); i++) {
+        page[i] = std::toupper((unsigned char)page[i]);
+      }
+      break;
+    default: {
+      auto& other = _seeds[below(_seeds.size())];
+      std::size_t from = below(other.size() + 1);
+      page.replace(at, len, other, from, len);
+      break;
+    }
+    }
+  }
+
+public:
+  mutator(const std::vector<std::string>& seeds, unsigned seed) : _random(seed), _seeds(seeds) {}
+
+  std::string next() {
+    std::string page = _seeds[below(_seeds.size())];
+    for(std::size_t n = 1 + below(4); n > 0; n--) mutate(page);
+    return page;
+  }
+};
+
+static void usage(const char *program);
+
+static bool read_file(const std::string& file, std::string& body) {
+  std::ifstream in(file, std::ios::binary);
+  if(!in) return false;
+  std::ostringstream s;
+  s << in.rdbuf();
+  body = s.str();
+  return true;
+}
+
+/**
+ fuzzer entry point
+*/
+int main(int argc, char **argv) {
+  std::vector<std::string> files;
+  std::string failures_dir = ".";
+  unsigned inputs = 1000;
+  unsigned seed = 1;
+  bool abort_on_failure = false;
+  bool verbose = false;
+  for(int i = 1; i < argc; i++) {
+    if(std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      inputs = std::max(0, std::atoi(argv[++i]));
+    } else if(std::strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], NULL, 10);
+    } else if(std::strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      budget_us_per_kb = std::atof(argv[++i]);
+    } else if(std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      failures_dir = argv[++i];
+    } else if(std::strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+      std::vector<std::string> corpus;
+      try {
+        for(fs::directory_iterator f(argv[++i]); f != fs::directory_iterator(); f++) {
+          if(f->path().extension() == ".html") corpus.push_back(f->path().string());
+        }
+      } catch (fs::filesystem_error& e) {
+        std::cerr << "Can not read the folder " << argv[i] << ": " << e.what() << std::endl;
+        return 1;
+      }
+      std::sort(corpus.begin(), corpus.end());
+      files.insert(files.end(), corpus.begin(), corpus.end());
+    } else if(std::strcmp(argv[i], "-a") == 0) {
+      abort_on_failure = true;
+    } else if(std::strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if(argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if(files.empty()) {
+    files.push_back("../search-result01.html");
+    files.push_back("../search-result02.html");
+  }
+  init_log(verbose);
+
+  std::vector<std::string> seeds;
+  for(auto& f: files) {
+    std::string body;
+    if(!read_file(f, body)) {
+      std::cerr << "Can not read " << f << std::endl;
+      return 1;
+    }
+    seeds.push_back(body);
+  }
+
+  unsigned mismatches = 0, slow = 0;
+  double slowest_us = 0, budget_used = 0;
+  std::size_t slowest_size = 0;
+  auto record = [&](const std::string& input, const std::string& name) {
+    verdict v = check(input);
+    if(v.slowest_us > slowest_us) {
+      slowest_us = v.slowest_us;
+      slowest_size = input.size();
+    }
+    budget_used = std::max(budget_used, v.slowest_us / v.budget_us);
+    if(v.result == PASSED) return;
+
+    (v.result == MISMATCH ? mismatches : slow)++;
+    std::cout << (v.result == MISMATCH ? "MISMATCH " : "SLOW ") << name << '\n' << v.report;
+    if(abort_on_failure) std::abort();
+    // the input, to be replayed: ./serp-fuzz -n 0 file
+    std::string file = (fs::path(failures_dir) / ((v.result == MISMATCH ? "mismatch-" : "slow-") + name + ".html")).string();
+    std::ofstream out(file, std::ios::binary);
+    out << input;
+    std::cout << "  written to " << file << '\n';
+  };
+
+  // the pages given, as they are, then the mutated ones
+  for(std::size_t i = 0; i < seeds.size(); i++) {
+    record(seeds[i], fs::path(files[i]).stem().string());
+  }
+  mutator m(seeds, seed);
+  for(unsigned i = 0; i < inputs; i++) {
+    record(m.next(), std::to_string(seed) + "-" + std::to_string(i));
+  }
+
+  std::cout << seeds.size() + inputs << " inputs: " << mismatches << " mismatches, " << slow << " over the time budget; "
+            << "slowest parse " << (unsigned long)slowest_us << " us (" << slowest_size << " bytes), "
+            << (unsigned)(budget_used * 100) << "% of the time budget at most\n";
+  return mismatches || slow ? 1 : 0;
+}
+
+static void usage(const char *program) {
+  std::cerr << "usage: " << program << " [-n inputs] [-s seed] [-t budget] [-o folder] [-D folder] [-a] [-v]\n"
+            << "       [page.html...]\n"
+            << "  -n  mutated pages checked, after the pages given (default: 1000); 0 checks\n"
+            << "      the pages as they are\n"
+            << "  -s  seed of the mutations (default: 1)\n"
+            << "  -t  time a parse may take, in microseconds per KB (default: 1000)\n"
+            << "  -o  folder the failing inputs are written to (default: .)\n"
+            << "  -D  adds the .html pages of a folder\n"
+            << "  -a  aborts on the first failing input, for AFL\n"
+            << "  -v  verbose (trace) logging\n"
+            << "  the pages default to the search-result*.html fixtures of the repository\n";
+}
+
+#endif
+
+// log initialization; the fuzzer logs to the console, errors only: the
+// mutated pages make the parsers warn
+static void init_log(bool verbose) {
+  logging::add_console_log
+    (std::clog,
+     keywords::format = "[%TimeStamp%][%ThreadID%][%Severity%]: %Message%"
+     );
+
+  logging::core::get()->set_filter
+    (logging::trivial::severity >= (verbose ? logging::trivial::trace : logging::trivial::error));
+
+  logging::add_common_attributes();
+}
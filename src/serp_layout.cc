@@ -0,0 +1,469 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp_layout.cc
+// the rules that find the results and the next page link on a google
+// results page, loaded from a file and evaluated on the elements of the
+// page in document order
+
+#include "serp_layout.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+
+namespace ranktracker {
+  namespace engine {
+
+    // the paths are evaluated with a bit for each step
+    static const std::size_t MAX_STEPS = 32;
+
+    const char * const serp_layout::default_layout =
+      "# the results pages of google\n"
+      "page     #main[0]\n"
+      "results  #main[0] > * > *:first > *:first > *:first @href(/url?q=)http\n"
+      "next     footer[0] div[2] a[2] @href | footer[0] div[2] a[1] @href | footer[0] div[2] a[0] @href\n";
+
+    const char *serp_layout::rule_name(rule_t rule) {
+      switch(rule) {
+      case PAGE: return "page";
+      case RESULTS: return "results";
+      case NEXT: return "next";
+      default: return "?";
+      }
+    }
+
+    static bool is_name_char(char c) {
+      return std::isalnum((unsigned char)c) || c == '-' || c == '_';
+    }
+
+    static std::string lower(const std::string& s) {
+      std::string l(s);
+      for(auto& c: l) c = std::tolower((unsigned char)c);
+      return l;
+    }
+
+    // one step of a path: [tag|*][#id][:first][[n]]
+    static serp_layout::step parse_step(const std::string& token, bool child, const std::string& where) {
+      serp_layout::step s;
+      s.child = child;
+      s.first = false;
+      s.index = -1;
+
+      std::size_t i = 0;
+      bool any = false;
+      if(i < token.size() && token[i] == '*') {
+        any = true;
+        i++;
+      } else {
+        while(i < token.size() && is_name_char(token[i])) s.tag += std::tolower((unsigned char)token[i++]);
+      }
+      if(i < token.size() && token[i] == '#') {
+        i++;
+        while(i < token.size() && token[i] != ':' && token[i] != '[') s.id += token[i++];
+        if(s.id.empty()) throw layout_exception(where + ": empty id in \"" + token + "\"");
+      }
+      if(token.compare(i, 6, ":first") == 0) {
+        s.first = true;
+        i += 6;
+      }
+      if(i < token.size() && token[i] == '[') {
+        std::size_t close = token.find(']', i);
+        std::string digits = token.substr(i + 1, close == std::string::npos ? std::string::npos : close - i - 1);
+        if(close == std::string::npos || digits.empty() ||
+           digits.find_first_not_of("0123456789") != std::string::npos) {
+          throw layout_exception(where + ": bad index in \"" + token + "\"");
+        }
+        s.index = std::atoi(digits.c_str());
+        i = close + 1;
+      }
+      if(i != token.size() || (!any && s.tag.empty() && s.id.empty())) {
+        throw layout_exception(where + ": bad step \"" + token + "\"");
+      }
+      return s;
+    }
+
+    std::shared_ptr<serp_layout> serp_layout::compile(std::istream& in, const std::string& source) {
+      std::shared_ptr<serp_layout> layout(new serp_layout(source));
+      layout->_attributes.push_back("id");
+      for(auto& a: layout->_alternatives) a = 0;
+
+      std::string line;
+      unsigned line_number = 0;
+      bool seen[RULE_COUNT] = {false, false, false};
+      while(std::getline(in, line)) {
+        line_number++;
+        std::istringstream tokens(line);
+        std::string name;
+        if(!(tokens >> name) || name[0] == '#') continue;
+
+        std::ostringstream where_stream;
+        where_stream << source << ":" << line_number;
+        std::string where = where_stream.str();
+
+        rule_t rule;
+        if(name == "page") {
+          rule = PAGE;
+        } else if(name == "results") {
+          rule = RESULTS;
+        } else if(name == "next") {
+          rule = NEXT;
+        } else {
+          throw layout_exception(where + ": unknown rule \"" + name + "\"");
+        }
+        if(seen[rule]) throw layout_exception(where + ": the " + name + " rule is given twice");
+        seen[rule] = true;
+
+        // the paths, separated by '|'
+        std::string token;
+        path p;
+        p.rule = rule;
+        p.alternative = 0;
+        p.attribute = -1;
+        p.parameter = false;
+        bool child = false;
+        bool more = true;
+        while(more) {
+          more = static_cast<bool>(tokens >> token);
+          if(!more || token == "|") {
+            if(p.steps.empty() || child) throw layout_exception(where + ": incomplete path");
+            if(p.steps.size() > MAX_STEPS) throw layout_exception(where + ": a path has too many steps");
+            layout->_paths.push_back(p);
+            p.alternative++;
+            p.steps.clear();
+            p.attribute = -1;
+            p.strip.clear();
+            p.required.clear();
+            p.parameter = false;
+            continue;
+          }
+          if(p.attribute >= 0) throw layout_exception(where + ": the attribute must end the path");
+          if(token == ">") {
+            if(p.steps.empty() || child) throw layout_exception(where + ": misplaced '>'");
+            child = true;
+          } else if(token[0] == '@') {
+            // @name(strip)required
+            std::size_t i = 1;
+            while(i < token.size() && is_name_char(token[i])) i++;
+            std::string attribute = lower(token.substr(1, i - 1));
+            if(attribute.empty() || p.steps.empty() || child) {
+              throw layout_exception(where + ": bad attribute \"" + token + "\"");
+            }
+            if(i < token.size() && token[i] == '(') {
+              std::size_t close = token.find(')', i);
+              if(close == std::string::npos) throw layout_exception(where + ": unclosed '(' in \"" + token + "\"");
+              p.strip = token.substr(i + 1, close - i - 1);
+              i = close + 1;
+            }
+            p.required = p.strip + token.substr(i);
+            p.parameter = !p.strip.empty() && p.strip.back() == '=';
+
+            auto a = std::find(layout->_attributes.begin(), layout->_attributes.end(), attribute);
+            p.attribute = a - layout->_attributes.begin();
+            if(a == layout->_attributes.end()) layout->_attributes.push_back(attribute);
+          } else {
+            p.steps.push_back(parse_step(token, child, where));
+            child = false;
+          }
+        }
+        layout->_alternatives[rule] = p.alternative;
+      }
+
+      if(!seen[PAGE]) throw layout_exception(source + ": the page rule is missing");
+      if(!seen[RESULTS]) throw layout_exception(source + ": the results rule is missing");
+      for(auto& p: layout->_paths) {
+        if(p.rule != PAGE && p.attribute < 0) {
+          throw layout_exception(source + ": the " + rule_name(p.rule) + " paths must end with an attribute");
+        }
+      }
+
+      layout->_matched.reset(new std::atomic<unsigned long>[layout->_paths.size()]);
+      for(std::size_t i = 0; i < layout->_paths.size(); i++) layout->_matched[i].store(0);
+      return layout;
+    }
+
+    void serp_layout::count_page(bool recognized, const std::vector<char>& matched) const {
+      _pages++;
+      if(!recognized) return;
+      _recognized++;
+      for(std::size_t i = 0; i < _paths.size(); i++) {
+        if(matched[i]) _matched[i]++;
+      }
+    }
+
+    void serp_layout::log_counters() const {
+      unsigned long recognized = _recognized.load();
+      BOOST_LOG_TRIVIAL(info) << "SERP layout " << _source << ": " << recognized << " results pages of "
+                              << _pages.load() << " pages" << std::endl;
+      for(std::size_t i = 0; i < _paths.size(); i++) {
+        auto const& p = _paths[i];
+        unsigned long matched = _matched[i].load();
+        // a results rule that stopped matching is a changed layout; the
+        // next link is missing on the last pages
+        if(recognized && !matched && p.rule != NEXT) {
+          BOOST_LOG_TRIVIAL(warning) << "SERP layout " << _source << ": the " << rule_name(p.rule)
+                                     << " path " << p.alternative + 1 << " matched on no results page"
+                                     << std::endl;
+        } else {
+          BOOST_LOG_TRIVIAL(info) << "SERP layout " << _source << ": the " << rule_name(p.rule)
+                                  << " path " << p.alternative + 1 << " matched on " << matched
+                                  << " results pages" << std::endl;
+        }
+      }
+    }
+
+    /**
+     * The current layout, and the file it was loaded from.
+     */
+    struct layout_registry {
+      std::mutex mutex;
+      std::shared_ptr<const serp_layout> layout;
+      std::string file;
+      std::time_t modified;
+      std::chrono::steady_clock::time_point checked;
+    };
+
+    static layout_registry& registry() {
+      static layout_registry r;
+      return r;
+    }
+
+    // the file is looked at again at most this often
+    static const std::chrono::seconds CHECK_INTERVAL(5);
+
+    static std::shared_ptr<const serp_layout> builtin_layout() {
+      std::istringstream in(serp_layout::default_layout);
+      return serp_layout::compile(in, "built-in");
+    }
+
+    static std::shared_ptr<const serp_layout> read_layout(const std::string& file, std::time_t& modified) {
+      boost::system::error_code ec;
+      modified = boost::filesystem::last_write_time(file, ec);
+      std::ifstream in(file);
+      if(ec || !in) throw layout_exception(file + ": can not be read");
+      return serp_layout::compile(in, file);
+    }
+
+    std::shared_ptr<const serp_layout> current_serp_layout() {
+      auto& r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      if(!r.layout) r.layout = builtin_layout();
+
+      auto now = std::chrono::steady_clock::now();
+      if(!r.file.empty() && now - r.checked >= CHECK_INTERVAL) {
+        r.checked = now;
+        boost::system::error_code ec;
+        std::time_t modified = boost::filesystem::last_write_time(r.file, ec);
+        if(!ec && modified != r.modified) {
+          try {
+            r.layout = read_layout(r.file, r.modified);
+            BOOST_LOG_TRIVIAL(info) << "SERP layout reloaded from " << r.file << std::endl;
+          } catch(layout_exception e) {
+            // not again until the file changes
+            r.modified = modified;
+            BOOST_LOG_TRIVIAL(error) << "Error reloading the SERP layout: " << e.message() << std::endl;
+          }
+        }
+      }
+      return r.layout;
+    }
+
+    void load_serp_layout(const std::string& file) {
+      std::time_t modified;
+      auto layout = read_layout(file, modified);
+
+      auto& r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.layout = layout;
+      r.file = file;
+      r.modified = modified;
+      r.checked = std::chrono::steady_clock::now();
+      BOOST_LOG_TRIVIAL(info) << "SERP layout loaded from " << file << std::endl;
+    }
+
+    void reload_serp_layout() {
+      std::string file;
+      {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        file = r.file;
+      }
+      if(file.empty()) return;
+      try {
+        load_serp_layout(file);
+      } catch(layout_exception e) {
+        BOOST_LOG_TRIVIAL(error) << "Error reloading the SERP layout: " << e.message() << std::endl;
+      }
+    }
+
+    serp_matcher::serp_matcher() : _limit(0), _page_seen(false) {
+      _domain_matcher.add(_domain);
+      reset(std::string(), 0);
+    }
+
+    void serp_matcher::reset(const std::string& domain, int limit) {
+      auto layout = current_serp_layout();
+      std::size_t paths = layout->paths().size();
+      if(layout != _layout) {
+        _layout = layout;
+        _counters.assign(paths * MAX_STEPS, 0);
+        _matched.assign(paths, 0);
+        _next_set.assign(_layout->alternatives(serp_layout::NEXT), 0);
+        _next_links.resize(_next_set.size());
+        _masks.reserve(paths * 2 * 64);
+        _has_nodes.reserve(64);
+      }
+      if(domain != _domain) {
+        // the pages of a query are all searched for the same domain
+        _domain = domain;
+        _domain_matcher.clear();
+        _domain_matcher.add(_domain);
+      }
+      _limit = limit;
+
+      // the document: nothing matched, nothing in it
+      _masks.assign(paths * 2, 0);
+      _has_nodes.assign(1, false);
+      std::fill(_counters.begin(), _counters.end(), 0);
+      std::fill(_matched.begin(), _matched.end(), 0);
+      std::fill(_next_set.begin(), _next_set.end(), 0);
+      for(auto& l: _next_links) l.clear();
+      _page_seen = false;
+
+      // the strings keep their buffers for the next page
+      _page.results = 0;
+      _page.found = false;
+      _page.page_url.clear();
+      _page.next_link.clear();
+      _page.urls.clear();
+    }
+
+    void serp_matcher::start(const std::string& tag, const std::vector<const std::string *>& values, bool is_void) {
+      auto const& paths = _layout->paths();
+      std::size_t n = paths.size();
+      std::size_t parent = (_has_nodes.size() - 1) * n * 2;
+      std::size_t element = parent + n * 2;
+      bool first = !_has_nodes.back();
+      _has_nodes.back() = true;
+      if(!is_void) {
+        _masks.resize(element + n * 2);
+        _has_nodes.push_back(false);
+      }
+
+      for(std::size_t p = 0; p < n; p++) {
+        // the steps matched by the parent, and by the elements above it
+        std::uint32_t parent_mask = _masks[parent + p * 2];
+        std::uint32_t above = _masks[parent + p * 2 + 1] | parent_mask;
+        auto const& steps = paths[p].steps;
+        unsigned *counters = &_counters[p * MAX_STEPS];
+
+        std::uint32_t mask = 0;
+        for(std::size_t k = 0; k < steps.size(); k++) {
+          auto const& s = steps[k];
+          if(k > 0 && !((s.child ? parent_mask : above) & (1u << (k - 1)))) continue;
+          if(!s.tag.empty() && s.tag != tag) continue;
+          if(!s.id.empty() && !(values[0] && boost::algorithm::iequals(*values[0], s.id))) continue;
+          if(s.first && !first) continue;
+          if(s.index >= 0 && (int)counters[k]++ != s.index) continue;
+          mask |= 1u << k;
+          // the next step counts the elements under this one
+          if(k + 1 < steps.size()) counters[k + 1] = 0;
+        }
+
+        if(!is_void) {
+          _masks[element + p * 2] = mask;
+          _masks[element + p * 2 + 1] = above;
+        }
+        if(mask & (1u << (steps.size() - 1))) complete(p, values);
+      }
+    }
+
+    void serp_matcher::text() {
+      _has_nodes.back() = true;
+    }
+
+    void serp_matcher::end() {
+      if(_has_nodes.size() == 1) return;
+      _has_nodes.pop_back();
+      _masks.resize(_masks.size() - _layout->paths().size() * 2);
+    }
+
+    void serp_matcher::complete(std::size_t p, const std::vector<const std::string *>& values) {
+      auto const& path = _layout->paths()[p];
+      const std::string *value = path.attribute >= 0 ? values[path.attribute] : NULL;
+      bool accepted = value && boost::algorithm::starts_with(*value, path.required);
+
+      switch(path.rule) {
+      case serp_layout::PAGE:
+        if(path.attribute >= 0 && !accepted) return;
+        _page_seen = true;
+        break;
+      case serp_layout::RESULTS:
+        if(!accepted) return;
+        result_line(*value, path);
+        break;
+      case serp_layout::NEXT:
+        // the first element matched by the path is the link
+        if(_next_set[path.alternative]) return;
+        _next_set[path.alternative] = true;
+        if(accepted) {
+          _next_links[path.alternative].assign(*value, path.strip.size(), std::string::npos);
+        } else {
+          _next_links[path.alternative].clear();
+        }
+        break;
+      default:
+        break;
+      }
+      _matched[p] = true;
+    }
+
+    void serp_matcher::result_line(const std::string& href, const serp_layout::path& path) {
+      if((int)_page.urls.size() >= _limit) return;
+
+      // the canonical url is matched and stored
+      _page.urls.push_back(_canonicalizer.canonical(href.data() + path.strip.size(), href.data() + href.size(),
+                                                    path.parameter));
+      if(_page.found) return;
+      _page.results++;
+      if(_domain_matcher.matches(_page.urls.back())) {
+        _page.found = true;
+        _page.page_url = _page.urls.back();
+        BOOST_LOG_TRIVIAL(trace) << "serp_matcher: domain found; url: " << _page.page_url << std::endl;
+      }
+    }
+
+    serp_page serp_matcher::finish() {
+      _layout->count_page(_page_seen, _matched);
+      if(!_page_seen) return _page;
+
+      bool results_matched = false;
+      auto const& paths = _layout->paths();
+      for(std::size_t p = 0; p < paths.size(); p++) {
+        if(paths[p].rule == serp_layout::RESULTS && _matched[p]) results_matched = true;
+      }
+      if(!results_matched) {
+        BOOST_LOG_TRIVIAL(warning) << "serp_matcher: the results rule of the SERP layout " << _layout->source()
+                                   << " matched nothing on a results page" << std::endl;
+      }
+
+      if(!_page.found && (int)_page.results < _limit) {
+        // the paths of the next rule, in their order
+        std::size_t alternative = 0;
+        while(alternative < _next_set.size() && !_next_set[alternative]) alternative++;
+        if(alternative < _next_set.size() && !_next_links[alternative].empty()) {
+          _page.next_link = _next_links[alternative];
+        } else {
+          BOOST_LOG_TRIVIAL(trace) << "serp_matcher: no next page on google search\n";
+        }
+      }
+      return _page;
+    }
+  }
+}
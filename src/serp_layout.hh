@@ -0,0 +1,217 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp_layout.hh
+// the rules that find the results and the next page link on a google
+// results page, loaded from a file and evaluated on the elements of the
+// page in document order
+
+#ifndef RANKTRACKER_SERP_LAYOUT_HH
+#define RANKTRACKER_SERP_LAYOUT_HH
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "engines.hh"
+#include "domain_matcher.hh"
+#include "url_canonicalizer.hh"
+
+namespace ranktracker {
+  namespace engine {
+
+    class layout_exception {
+      std::string _message;
+    public:
+      layout_exception(std::string message) : _message(message) {}
+
+      const std::string& message() const { return _message; }
+    };
+
+    /**
+     * The layout of the results pages, a rule on each line:
+     *
+     *   page     #main[0]
+     *   results  #main[0] > * > *:first > *:first > *:first @href(/url?q=)http
+     *   next     footer[0] div[2] a[2] @href | footer[0] div[2] a[1] @href | footer[0] div[2] a[0] @href
+     *
+     * `page` recognizes a results page, `results` finds the result urls,
+     * in the page order, and `next` the href of the next page link. A
+     * rule has one or more paths, separated by " | "; for `next` the
+     * first path, in their order, that matches an element decides.
+     *
+     * A path is a list of steps, like a css selector: `tag`, `*` for any
+     * element, `#id` or `tag#id`, followed by `:first` if the element
+     * must be the first node of its parent (no text before it) and by
+     * `[n]` to take only the n-th element matching the step, from 0, in
+     * the last element matched by the previous step. A step is under the
+     * previous one, or its child when they are separated by " > ".
+     *
+     * `@name` at the end of a path gives the value of the attribute of
+     * the element; `@name(prefix)text` only takes the values starting
+     * with "prefixtext", without the prefix. When the prefix ends with
+     * '=' the value is a url parameter, like the target of google's
+     * redirect links: it ends at the next '&' and is decoded. The
+     * result urls are given in their canonical form (see
+     * `url_canonicalizer`).
+     *
+     * The lines starting with '#' are comments.
+     */
+    class serp_layout {
+    public:
+      enum rule_t {
+        PAGE,
+        RESULTS,
+        NEXT,
+        RULE_COUNT
+      };
+
+      struct step {
+        std::string tag;        // empty for any element
+        std::string id;         // empty for any id
+        bool child;             // a child of the previous step's element, or else under it
+        bool first;             // the first node of its parent
+        int index;              // the n-th matching element; -1 for all of them
+      };
+
+      struct path {
+        rule_t rule;
+        unsigned alternative;   // the place of the path in its rule
+        std::vector<step> steps;
+        int attribute;          // index in `attributes()`; -1 for none
+        std::string strip;      // removed from the start of the value
+        std::string required;   // the start of the value, with `strip`
+        bool parameter;         // the value is a url parameter, after `strip`
+      };
+
+      static const char * const default_layout;
+
+    private:
+      std::string _source;
+      std::vector<path> _paths;
+      std::vector<std::string> _attributes;   // "id" first
+      unsigned _alternatives[RULE_COUNT];
+
+      // the pages seen, and for each path the pages it matched on
+      mutable std::atomic<unsigned long> _pages;
+      mutable std::atomic<unsigned long> _recognized;
+      std::unique_ptr<std::atomic<unsigned long>[]> _matched;
+
+      serp_layout(const std::string& source) : _source(source), _pages(0), _recognized(0) {}
+
+    public:
+      /**
+       * Compiles the rules; throws `layout_exception` if they are
+       * malformed or a rule is missing.
+       */
+      static std::shared_ptr<serp_layout> compile(std::istream& in, const std::string& source);
+
+      const std::string& source() const { return _source; }
+      const std::vector<path>& paths() const { return _paths; }
+      unsigned alternatives(rule_t rule) const { return _alternatives[rule]; }
+
+      /**
+       * The attributes the paths need, the id first.
+       */
+      const std::vector<std::string>& attributes() const { return _attributes; }
+
+      /**
+       * Counts a parsed page: `matched` has a flag for each path.
+       */
+      void count_page(bool recognized, const std::vector<char>& matched) const;
+
+      /**
+       * Logs, for each path, the results pages it matched on.
+       */
+      void log_counters() const;
+
+      static const char *rule_name(rule_t rule);
+    };
+
+    /**
+     * The layout the pages are parsed with: the built-in one, or the one
+     * loaded by `load_serp_layout`, reloaded when its file changes.
+     */
+    std::shared_ptr<const serp_layout> current_serp_layout();
+
+    /**
+     * Loads the layout from a file, to be used for the next pages;
+     * throws `layout_exception` if it can not be read or compiled.
+     */
+    void load_serp_layout(const std::string& file);
+
+    /**
+     * Reads again the layout file; the current layout is kept, and the
+     * error logged, if the file is not a valid layout.
+     */
+    void reload_serp_layout();
+
+    /**
+     * Evaluates the rules of a layout on the elements of a page, given
+     * in document order, and collects the results looked at for a
+     * domain: the elements are opened by `start` and closed by `end`,
+     * `text` tells of the text and comment nodes between them.
+     */
+    class serp_matcher {
+      std::shared_ptr<const serp_layout> _layout;
+      std::string _domain;
+      domain_matcher _domain_matcher;
+      url_canonicalizer _canonicalizer;
+      int _limit;
+
+      // for each open element, and the document first: the steps of each
+      // path matched by the element, and by the elements it is under
+      std::vector<std::uint32_t> _masks;
+      std::vector<char> _has_nodes;         // a node was added to the element
+      std::vector<unsigned> _counters;      // of the indexed steps, for each path
+      std::vector<char> _matched;           // the paths that matched an element
+      std::vector<char> _next_set;          // for each path of the next rule
+      std::vector<std::string> _next_links;
+      bool _page_seen;
+
+      serp_page _page;
+
+      void complete(std::size_t p, const std::vector<const std::string *>& values);
+      void result_line(const std::string& href, const serp_layout::path& path);
+
+    public:
+      serp_matcher();
+
+      /**
+       * Prepares the matcher for a new page, with the current layout.
+       */
+      void reset(const std::string& domain, int limit);
+
+      const serp_layout& layout() const { return *_layout; }
+
+      /**
+       * Opens an element; `values` has the values of the attributes of
+       * the layout (NULL for the missing ones). A void element is closed
+       * right away.
+       */
+      void start(const std::string& tag, const std::vector<const std::string *>& values, bool is_void);
+      void text();
+      void end();
+
+      /**
+       * The page was recognized as a results page.
+       */
+      bool page_seen() const { return _page_seen; }
+
+      /**
+       * True when the rest of the page cannot change the result: the
+       * limit of results was reached.
+       */
+      bool done() const { return _page_seen && (int)_page.urls.size() >= _limit; }
+
+      /**
+       * The results of the page, after its last element; counts the
+       * page in the counters of the layout.
+       */
+      serp_page finish();
+    };
+  }
+}
+
+#endif
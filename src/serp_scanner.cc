@@ -0,0 +1,679 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp_scanner.cc
+// extraction of the results and of the next page link from the html of
+// a google results page, as it arrives, without building the DOM
+
+#include "serp_scanner.hh"
+#include "byte_scan.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+namespace ranktracker {
+  namespace engine {
+
+    static inline bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+    }
+
+    static inline bool is_alpha(char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static inline char to_lower(char c) {
+      return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    static inline void append_lower(std::string& s, const char *first, const char *last) {
+      for(const char *p = first; p < last; p++) s += to_lower(*p);
+    }
+
+    // the bytes that end the names and the unquoted values in a tag
+    static const byte_set tag_name_end(" \t\n\r\f/>");
+    static const byte_set attr_name_end(" \t\n\r\f/=>");
+    static const byte_set unquoted_value_end(" \t\n\r\f>");
+
+    // what the tree construction does with an element
+    enum tag_flag {
+      VOID_ELEMENT = 1,         // no content, no end tag
+      RAW_TEXT_ELEMENT = 2,     // its content is text up to its end tag
+      CLOSES_P = 4,             // its start tag closes an open p
+      HEADING = 8,
+      SCOPE_BOUNDARY = 16,      // an implied end tag does not look past it
+      LIST_BOUNDARY = 32,
+      ROW_BOUNDARY = 64,
+      SECTION_BOUNDARY = 128,
+      FOREIGN = 256,            // svg and math, where "/>" ends an element
+      IMPLIES_END = 512,        // its start tag may close an open element of its kind
+      PARAGRAPH = 1024
+    };
+
+    struct tag_info {
+      const char *name;
+      unsigned flags;
+    };
+
+    static const tag_info tags[] = {
+      {"area", VOID_ELEMENT}, {"base", VOID_ELEMENT}, {"br", VOID_ELEMENT}, {"col", VOID_ELEMENT},
+      {"embed", VOID_ELEMENT}, {"hr", VOID_ELEMENT | CLOSES_P}, {"img", VOID_ELEMENT},
+      {"input", VOID_ELEMENT}, {"keygen", VOID_ELEMENT}, {"link", VOID_ELEMENT}, {"meta", VOID_ELEMENT},
+      {"param", VOID_ELEMENT}, {"source", VOID_ELEMENT}, {"track", VOID_ELEMENT}, {"wbr", VOID_ELEMENT},
+
+      {"script", RAW_TEXT_ELEMENT}, {"style", RAW_TEXT_ELEMENT}, {"textarea", RAW_TEXT_ELEMENT},
+      {"title", RAW_TEXT_ELEMENT}, {"xmp", RAW_TEXT_ELEMENT | CLOSES_P}, {"iframe", RAW_TEXT_ELEMENT},
+      {"noembed", RAW_TEXT_ELEMENT}, {"noframes", RAW_TEXT_ELEMENT},
+
+      {"address", CLOSES_P}, {"article", CLOSES_P}, {"aside", CLOSES_P}, {"blockquote", CLOSES_P},
+      {"center", CLOSES_P}, {"details", CLOSES_P}, {"dialog", CLOSES_P}, {"dir", CLOSES_P},
+      {"div", CLOSES_P}, {"dl", CLOSES_P}, {"fieldset", CLOSES_P}, {"figcaption", CLOSES_P},
+      {"figure", CLOSES_P}, {"footer", CLOSES_P}, {"form", CLOSES_P}, {"header", CLOSES_P},
+      {"hgroup", CLOSES_P}, {"main", CLOSES_P}, {"menu", CLOSES_P}, {"nav", CLOSES_P},
+      {"ol", CLOSES_P | LIST_BOUNDARY}, {"p", CLOSES_P | PARAGRAPH}, {"section", CLOSES_P}, {"summary", CLOSES_P},
+      {"ul", CLOSES_P | LIST_BOUNDARY}, {"pre", CLOSES_P}, {"listing", CLOSES_P},
+      {"li", CLOSES_P | IMPLIES_END}, {"dd", CLOSES_P | IMPLIES_END}, {"dt", CLOSES_P | IMPLIES_END},
+      {"h1", CLOSES_P | HEADING}, {"h2", CLOSES_P | HEADING}, {"h3", CLOSES_P | HEADING},
+      {"h4", CLOSES_P | HEADING}, {"h5", CLOSES_P | HEADING}, {"h6", CLOSES_P | HEADING},
+
+      {"table", CLOSES_P | SCOPE_BOUNDARY | ROW_BOUNDARY | SECTION_BOUNDARY},
+      {"html", SCOPE_BOUNDARY | ROW_BOUNDARY | SECTION_BOUNDARY},
+      {"tbody", ROW_BOUNDARY | SECTION_BOUNDARY}, {"thead", ROW_BOUNDARY | SECTION_BOUNDARY},
+      {"tfoot", ROW_BOUNDARY | SECTION_BOUNDARY}, {"tr", ROW_BOUNDARY | IMPLIES_END},
+      {"td", SCOPE_BOUNDARY | IMPLIES_END}, {"th", SCOPE_BOUNDARY | IMPLIES_END}, {"applet", SCOPE_BOUNDARY},
+      {"caption", SCOPE_BOUNDARY}, {"marquee", SCOPE_BOUNDARY}, {"object", SCOPE_BOUNDARY},
+      {"template", SCOPE_BOUNDARY}, {"button", SCOPE_BOUNDARY},
+      {"svg", SCOPE_BOUNDARY | FOREIGN}, {"math", SCOPE_BOUNDARY | FOREIGN},
+
+      {"a", IMPLIES_END}, {"option", IMPLIES_END}
+    };
+
+    static unsigned tag_flags(const std::string& name) {
+      static const std::unordered_map<std::string, unsigned> flags = [] {
+        std::unordered_map<std::string, unsigned> m;
+        for(auto& t: tags) m.insert({t.name, t.flags});
+        return m;
+      }();
+      auto f = flags.find(name);
+      return f == flags.end() ? 0 : f->second;
+    }
+
+    // the named references found in attribute values; the others are
+    // left as they are
+    struct named_reference {
+      const char *name;
+      const char *text;
+    };
+
+    static const named_reference references[] = {
+      {"amp;", "&"}, {"lt;", "<"}, {"gt;", ">"}, {"quot;", "\""}, {"apos;", "'"},
+      {"nbsp;", "\xc2\xa0"}
+    };
+
+    static void append_utf8(std::string& out, unsigned long cp) {
+      if(cp == 0 || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) cp = 0xfffd;
+      if(cp < 0x80) {
+        out += (char)cp;
+      } else if(cp < 0x800) {
+        out += (char)(0xc0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3f));
+      } else if(cp < 0x10000) {
+        out += (char)(0xe0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+      } else {
+        out += (char)(0xf0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+      }
+    }
+
+    // the value of an attribute, with its character references
+    // replaced; `value` keeps its buffer between the tags
+    static void decode_attribute(const std::string& raw, std::string& value) {
+      if(raw.find('&') == std::string::npos) {
+        value.assign(raw);
+        return;
+      }
+
+      value.clear();
+      for(std::size_t i = 0; i < raw.size(); i++) {
+        if(raw[i] != '&') {
+          value += raw[i];
+          continue;
+        }
+        const char *ref = raw.c_str() + i + 1;
+        if(*ref == '#') {
+          bool hex = ref[1] == 'x' || ref[1] == 'X';
+          const char *digits = ref + (hex ? 2 : 1);
+          char *end;
+          unsigned long cp = std::strtoul(digits, &end, hex ? 16 : 10);
+          if(end != digits && (hex ? std::isxdigit((unsigned char)*digits) : std::isdigit((unsigned char)*digits))) {
+            append_utf8(value, cp);
+            if(*end == ';') end++;
+            i = end - raw.c_str() - 1;
+            continue;
+          }
+        } else {
+          bool replaced = false;
+          for(auto& r: references) {
+            auto len = std::strlen(r.name);
+            if(raw.compare(i + 1, len, r.name) == 0) {
+              value += r.text;
+              i += len;
+              replaced = true;
+              break;
+            }
+          }
+          if(replaced) continue;
+        }
+        value += '&';
+      }
+    }
+
+    serp_scanner::serp_scanner() : _attributes_layout(NULL) {
+      _open.reserve(64);
+      reset(std::string(), 0);
+    }
+
+    void serp_scanner::reset(const std::string& domain, int limit) {
+      _matcher.reset(domain, limit);
+      if(&_matcher.layout() != _attributes_layout) {
+        // a new layout may need other attributes
+        _attributes_layout = &_matcher.layout();
+        _names = _attributes_layout->attributes();
+        _action = _names.size();
+        _names.push_back("action");
+        _values.resize(_names.size());
+        _set.assign(_names.size(), NULL);
+
+        // the values of the result links, in double quotes; the ones
+        // with a character reference are written in another way
+        _anchors.clear();
+        for(auto& path: _attributes_layout->paths()) {
+          if(path.rule != serp_layout::RESULTS || path.attribute < 0 || path.required.empty() ||
+             path.required.find_first_of("&\"") != std::string::npos) {
+            continue;
+          }
+          std::string anchor = _names[path.attribute] + "=\"" + path.required;
+          if(std::find(_anchors.begin(), _anchors.end(), anchor) == _anchors.end()) _anchors.push_back(anchor);
+        }
+      }
+
+      _state = DATA;
+      _tag.clear();
+      _end_tag = false;
+      _self_closing = false;
+      _attr.clear();
+      _value.clear();
+      _keep_value = false;
+      std::fill(_set.begin(), _set.end(), nullptr);
+      _text = false;
+      _dashes = 0;
+      _raw_end.clear();
+      _raw_matched = 0;
+
+      _anchor_tail.clear();
+      _anchors_seen = 0;
+
+      _open.clear();
+      _foreign = 0;
+      _paragraphs = 0;
+
+      _captcha_form = false;
+      _consent_form = false;
+    }
+
+    void serp_scanner::begin_tag(bool end_tag, char c) {
+      _tag.clear();
+      _tag += to_lower(c);
+      _end_tag = end_tag;
+      _self_closing = false;
+      std::fill(_set.begin(), _set.end(), nullptr);
+      _state = TAG_NAME;
+    }
+
+    void serp_scanner::begin_attr(char c) {
+      _attr.clear();
+      _attr += to_lower(c);
+      _state = ATTR_NAME;
+    }
+
+    int serp_scanner::attribute_index() const {
+      for(std::size_t i = 0; i < _names.size(); i++) {
+        if(_attr == _names[i]) return i;
+      }
+      return -1;
+    }
+
+    void serp_scanner::end_attr() {
+      // the first of the attributes with the same name is kept
+      if(!_end_tag) {
+        int i = attribute_index();
+        if(i >= 0 && !_set[i]) {
+          if(_keep_value) {
+            decode_attribute(_value, _values[i]);
+          } else {
+            // an attribute without value
+            _values[i].clear();
+          }
+          _set[i] = &_values[i];
+        }
+      }
+      _keep_value = false;
+      _attr.clear();
+    }
+
+    void serp_scanner::emit_text() {
+      // a text or comment node
+      _text = false;
+      _matcher.text();
+    }
+
+    void serp_scanner::emit_tag() {
+      if(_text) emit_text();
+      _state = DATA;
+      if(_end_tag) {
+        end_tag();
+      } else {
+        start_tag();
+      }
+    }
+
+    void serp_scanner::pop_to(std::size_t depth) {
+      while(_open.size() > depth) {
+        if(_open.back().flags & FOREIGN) _foreign--;
+        if(_open.back().flags & PARAGRAPH) _paragraphs--;
+        _open.pop_back();
+        _matcher.end();
+      }
+    }
+
+    // finds the open element with one of the names, looking up to the
+    // first element with one of the boundary flags; returns its depth or 0
+    static std::size_t in_scope(const std::vector<serp_scanner::open_element>& open,
+                                const char *name, const char *other_name, unsigned boundaries) {
+      for(std::size_t i = open.size(); i > 0; i--) {
+        auto& e = open[i - 1];
+        if(e.name == name || (other_name && e.name == other_name)) return i;
+        if(e.flags & boundaries) return 0;
+      }
+      return 0;
+    }
+
+    void serp_scanner::close_implied(unsigned flags) {
+      std::size_t depth;
+
+      if(_foreign) return;
+      if(flags & IMPLIES_END) {
+        if(_tag == "li") {
+          if((depth = in_scope(_open, "li", NULL, LIST_BOUNDARY))) pop_to(depth - 1);
+        } else if(_tag == "dd" || _tag == "dt") {
+          if((depth = in_scope(_open, "dd", "dt", SCOPE_BOUNDARY))) pop_to(depth - 1);
+        } else if(_tag == "a") {
+          if((depth = in_scope(_open, "a", NULL, SCOPE_BOUNDARY))) pop_to(depth - 1);
+        } else if(_tag == "td" || _tag == "th") {
+          if((depth = in_scope(_open, "td", "th", ROW_BOUNDARY))) pop_to(depth - 1);
+        } else if(_tag == "tr") {
+          if((depth = in_scope(_open, "td", "th", ROW_BOUNDARY))) pop_to(depth - 1);
+          if((depth = in_scope(_open, "tr", NULL, SECTION_BOUNDARY))) pop_to(depth - 1);
+        } else if(_tag == "option") {
+          if(!_open.empty() && _open.back().name == "option") pop_to(_open.size() - 1);
+        }
+      }
+      if((flags & CLOSES_P) && _paragraphs) {
+        // without an open p, the search would go down the whole stack
+        // for most of the tags
+        if((depth = in_scope(_open, "p", NULL, SCOPE_BOUNDARY))) pop_to(depth - 1);
+      }
+      if((flags & HEADING) && !_open.empty() && (_open.back().flags & HEADING)) {
+        pop_to(_open.size() - 1);
+      }
+    }
+
+    void serp_scanner::start_tag() {
+      unsigned flags = tag_flags(_tag);
+      close_implied(flags);
+
+      bool is_void = (flags & VOID_ELEMENT) || (_self_closing && _foreign);
+      _matcher.start(_tag, _set, is_void);
+
+      if(_set[0] && *_set[0] == "captcha-form") _captcha_form = true;
+      if(_tag == "form" && _set[_action] && _set[_action]->find("consent.") != std::string::npos) _consent_form = true;
+
+      if(is_void) return;
+      _open.push_back(open_element(_tag, flags));
+      if(flags & FOREIGN) _foreign++;
+      if(flags & PARAGRAPH) _paragraphs++;
+      if(!_foreign && (flags & RAW_TEXT_ELEMENT)) {
+        _raw_end.assign("</");
+        _raw_end.append(_tag);
+        _raw_matched = 0;
+        _state = RAW_TEXT;
+      }
+    }
+
+    void serp_scanner::end_tag() {
+      // the end of the body and of the document only come with the
+      // end of the page
+      if(_tag == "body" || _tag == "html") return;
+      for(std::size_t i = _open.size(); i > 0; i--) {
+        if(_open[i - 1].name == _tag) {
+          pop_to(i - 1);
+          return;
+        }
+      }
+    }
+
+    void serp_scanner::count_anchors(const char *data, std::size_t len) {
+      const char *end = data + len;
+      std::size_t longest = 0;
+      for(auto& anchor: _anchors) {
+        std::size_t n = anchor.size() - 1;
+        longest = std::max(longest, n);
+        if(!_anchor_tail.empty()) {
+          // the anchors split between the previous chunk and this one
+          _anchor_window.assign(_anchor_tail, _anchor_tail.size() - std::min(_anchor_tail.size(), n), n);
+          _anchor_window.append(data, std::min(len, n));
+          const char *w = _anchor_window.data();
+          const char *w_end = w + _anchor_window.size();
+          for(; (w = find_bytes(w, w_end, anchor.data(), anchor.size())) != w_end; w += anchor.size()) {
+            _anchors_seen++;
+          }
+        }
+        for(const char *p = data; (p = find_bytes(p, end, anchor.data(), anchor.size())) != end; p += anchor.size()) {
+          _anchors_seen++;
+        }
+      }
+
+      if(len >= longest) {
+        _anchor_tail.assign(end - longest, longest);
+      } else {
+        _anchor_tail.append(data, len);
+        if(_anchor_tail.size() > longest) _anchor_tail.erase(0, _anchor_tail.size() - longest);
+      }
+    }
+
+    void serp_scanner::feed(const char *data, std::size_t len) {
+      const char *end = data + len;
+      if(!done() && !_anchors.empty()) count_anchors(data, len);
+      for(const char *p = data; p < end; p++) {
+        char c = *p;
+        switch(_state) {
+        case DATA:
+          if(done()) return;
+          if(c != '<') {
+            // the text up to the next tag
+            _text = true;
+            p = (const char *)std::memchr(p, '<', end - p);
+            if(!p) return;
+          }
+          _state = TAG_OPEN;
+          break;
+
+        case TAG_OPEN:
+          if(c == '!') {
+            _dashes = 0;
+            _state = MARKUP_DECLARATION;
+          } else if(c == '/') {
+            _state = END_TAG_OPEN;
+          } else if(is_alpha(c)) {
+            begin_tag(false, c);
+          } else if(c == '?') {
+            _state = BOGUS_COMMENT;
+          } else {
+            // a '<' in the text
+            _text = true;
+            _state = DATA;
+            p--;
+          }
+          break;
+
+        case END_TAG_OPEN:
+          if(is_alpha(c)) {
+            begin_tag(true, c);
+          } else if(c == '>') {
+            _state = DATA;
+          } else {
+            _state = BOGUS_COMMENT;
+          }
+          break;
+
+        case TAG_NAME: {
+          // the rest of the name
+          const char *name_end = tag_name_end.find(p, end);
+          append_lower(_tag, p, name_end);
+          if(name_end == end) return;
+          p = name_end;
+          if(*p == '/') {
+            _state = SELF_CLOSING_START_TAG;
+          } else if(*p == '>') {
+            emit_tag();
+          } else {
+            _state = BEFORE_ATTR_NAME;
+          }
+          break;
+        }
+
+        case BEFORE_ATTR_NAME:
+          if(is_space(c)) {
+          } else if(c == '/') {
+            _state = SELF_CLOSING_START_TAG;
+          } else if(c == '>') {
+            emit_tag();
+          } else {
+            begin_attr(c);
+          }
+          break;
+
+        case ATTR_NAME: {
+          // the rest of the name
+          const char *name_end = attr_name_end.find(p, end);
+          append_lower(_attr, p, name_end);
+          if(name_end == end) return;
+          p = name_end;
+          if(*p == '/') {
+            end_attr();
+            _state = SELF_CLOSING_START_TAG;
+          } else if(*p == '=') {
+            _state = BEFORE_ATTR_VALUE;
+          } else if(*p == '>') {
+            end_attr();
+            emit_tag();
+          } else {
+            _state = AFTER_ATTR_NAME;
+          }
+          break;
+        }
+
+        case AFTER_ATTR_NAME:
+          if(is_space(c)) {
+          } else if(c == '/') {
+            end_attr();
+            _state = SELF_CLOSING_START_TAG;
+          } else if(c == '=') {
+            _state = BEFORE_ATTR_VALUE;
+          } else if(c == '>') {
+            end_attr();
+            emit_tag();
+          } else {
+            end_attr();
+            begin_attr(c);
+          }
+          break;
+
+        case BEFORE_ATTR_VALUE:
+          if(is_space(c)) break;
+          _value.clear();
+          _keep_value = !_end_tag && attribute_index() >= 0;
+          if(c == '"') {
+            _state = ATTR_VALUE_DOUBLE_QUOTED;
+          } else if(c == '\'') {
+            _state = ATTR_VALUE_SINGLE_QUOTED;
+          } else if(c == '>') {
+            end_attr();
+            emit_tag();
+          } else {
+            _state = ATTR_VALUE_UNQUOTED;
+            p--;
+          }
+          break;
+
+        case ATTR_VALUE_DOUBLE_QUOTED:
+        case ATTR_VALUE_SINGLE_QUOTED: {
+          // the value up to the closing quote
+          const char *quote = (const char *)std::memchr(p, _state == ATTR_VALUE_DOUBLE_QUOTED ? '"' : '\'', end - p);
+          const char *value_end = quote ? quote : end;
+          if(_keep_value) _value.append(p, value_end - p);
+          if(!quote) return;
+          p = quote;
+          end_attr();
+          _state = AFTER_ATTR_VALUE_QUOTED;
+          break;
+        }
+
+        case ATTR_VALUE_UNQUOTED: {
+          // the value up to a space or the end of the tag
+          const char *value_end = unquoted_value_end.find(p, end);
+          if(_keep_value) _value.append(p, value_end - p);
+          if(value_end == end) return;
+          p = value_end;
+          end_attr();
+          if(*p == '>') {
+            emit_tag();
+          } else {
+            _state = BEFORE_ATTR_NAME;
+          }
+          break;
+        }
+
+        case AFTER_ATTR_VALUE_QUOTED:
+          if(is_space(c)) {
+            _state = BEFORE_ATTR_NAME;
+          } else if(c == '/') {
+            _state = SELF_CLOSING_START_TAG;
+          } else if(c == '>') {
+            emit_tag();
+          } else {
+            _state = BEFORE_ATTR_NAME;
+            p--;
+          }
+          break;
+
+        case SELF_CLOSING_START_TAG:
+          if(c == '>') {
+            _self_closing = true;
+            emit_tag();
+          } else {
+            _state = BEFORE_ATTR_NAME;
+            p--;
+          }
+          break;
+
+        case MARKUP_DECLARATION:
+          // "<!--" starts a comment; a doctype or anything else ends at '>'
+          if(c == '-' && _dashes == 0) {
+            _dashes = 1;
+          } else if(c == '-' && _dashes == 1) {
+            _dashes = 0;
+            _state = COMMENT;
+          } else {
+            _state = BOGUS_COMMENT;
+            p--;
+          }
+          break;
+
+        case COMMENT:
+          if(c == '-') {
+            _dashes++;
+          } else if(c == '>' && _dashes >= 2) {
+            _text = true;
+            emit_text();
+            _state = DATA;
+          } else {
+            // the text of the comment, up to the next '-'
+            _dashes = 0;
+            const char *dash = (const char *)std::memchr(p, '-', end - p);
+            if(!dash) return;
+            p = dash - 1;
+          }
+          break;
+
+        case BOGUS_COMMENT: {
+          const char *gt = (const char *)std::memchr(p, '>', end - p);
+          if(!gt) return;
+          p = gt;
+          _text = true;
+          emit_text();
+          _state = DATA;
+          break;
+        }
+
+        case RAW_TEXT:
+          if(_raw_matched == 0) {
+            const char *lt = (const char *)std::memchr(p, '<', end - p);
+            if(lt != p) _text = true;
+            if(!lt) return;
+            p = lt;
+            _raw_matched = 1;
+          } else if(to_lower(c) == _raw_end[_raw_matched]) {
+            if(++_raw_matched == _raw_end.size()) _state = RAW_TEXT_END;
+          } else {
+            // not the end tag: the text goes on
+            _text = true;
+            _raw_matched = 0;
+            p--;
+          }
+          break;
+
+        case RAW_TEXT_END:
+          if(is_space(c) || c == '/' || c == '>') {
+            if(_text) emit_text();
+            _tag.assign(_raw_end, 2, std::string::npos);
+            _end_tag = true;
+            _self_closing = false;
+            std::fill(_set.begin(), _set.end(), nullptr);
+            _raw_matched = 0;
+            if(c == '>') {
+              emit_tag();
+            } else {
+              _state = c == '/' ? SELF_CLOSING_START_TAG : BEFORE_ATTR_NAME;
+            }
+          } else {
+            _text = true;
+            _raw_matched = 0;
+            _state = RAW_TEXT;
+            p--;
+          }
+          break;
+        }
+      }
+    }
+
+    serp_page serp_scanner::finish() {
+      serp_page page = _matcher.finish();
+      if(!_matcher.page_seen()) {
+        BOOST_LOG_TRIVIAL(warning) << "serp_scanner: the page rule of the SERP layout " << _matcher.layout().source()
+                                   << " does not match the page\n";
+        if(_captcha_form) {
+          BOOST_LOG_TRIVIAL(warning) << "google returned a captcha page\n";
+          throw throttled_exception(throttled_exception::CAPTCHA);
+        }
+        if(_consent_form) {
+          BOOST_LOG_TRIVIAL(warning) << "google returned a consent page\n";
+          throw throttled_exception(throttled_exception::CONSENT);
+        }
+        // not a results page: the rank is unknown, not "over 100"
+        throw unrecognized_page_exception();
+      }
+      if(page.urls.empty() && _anchors_seen > 0) {
+        BOOST_LOG_TRIVIAL(warning) << "serp_scanner: the results rule of the SERP layout " << _matcher.layout().source()
+                                   << " found no results; the page has " << _anchors_seen << " result links\n";
+      }
+      return page;
+    }
+  }
+}
@@ -0,0 +1,155 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// serp_scanner.hh
+// extraction of the results and of the next page link from the html of
+// a google results page, as it arrives, without building the DOM
+
+#ifndef RANKTRACKER_SERP_SCANNER_HH
+#define RANKTRACKER_SERP_SCANNER_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "engines.hh"
+#include "serp_layout.hh"
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * Tokenizes the html of a results page chunk by chunk and gives its
+     * elements, as their tags arrive, to a `serp_matcher`, which finds
+     * the results and the next page link with the rules of the current
+     * `serp_layout`, like `extract_page` does on the DOM.
+     *
+     * Only the stack of the open elements is kept, with the implied end
+     * tags of the html tree construction that occur on google's pages
+     * (p, li, a, table cells, headings). The attributes the layout does
+     * not need are skipped; the scan ends as soon as the limit of
+     * results is reached.
+     *
+     * The result links are also looked for in the raw bytes of the
+     * chunks: when the results rule finds none of them, the layout no
+     * longer fits the pages and a warning says so.
+     *
+     * An instance is reused for the pages of a query: `reset` before
+     * each page, `feed` the chunks, then `finish`.
+     */
+    class serp_scanner {
+    public:
+      enum state_t {
+        DATA,
+        TAG_OPEN,
+        END_TAG_OPEN,
+        TAG_NAME,
+        BEFORE_ATTR_NAME,
+        ATTR_NAME,
+        AFTER_ATTR_NAME,
+        BEFORE_ATTR_VALUE,
+        ATTR_VALUE_DOUBLE_QUOTED,
+        ATTR_VALUE_SINGLE_QUOTED,
+        ATTR_VALUE_UNQUOTED,
+        AFTER_ATTR_VALUE_QUOTED,
+        SELF_CLOSING_START_TAG,
+        MARKUP_DECLARATION,
+        COMMENT,
+        BOGUS_COMMENT,
+        RAW_TEXT,
+        RAW_TEXT_END
+      };
+
+      struct open_element {
+        std::string name;
+        unsigned flags;
+
+        open_element(const std::string& n, unsigned f) : name(n), flags(f) {}
+      };
+
+    private:
+      serp_matcher _matcher;
+
+      // tokenizer
+      state_t _state;
+      std::string _tag;             // lower case name of the tag being read
+      bool _end_tag;
+      bool _self_closing;
+      std::string _attr;            // lower case name of the attribute being read
+      std::string _value;           // raw value, for the attributes the extraction uses
+      bool _keep_value;
+      bool _text;                   // text read since the last token
+      unsigned _dashes;             // '-' read at the end of a comment, or at its start
+      std::string _raw_end;         // "</script" while in the text of a script
+      std::size_t _raw_matched;
+
+      // the attributes kept: the layout's ones, the id first, then
+      // "action"; the values of the tag being read, NULL if it has not
+      // the attribute
+      const serp_layout *_attributes_layout;
+      std::vector<std::string> _names;
+      std::vector<std::string> _values;
+      std::vector<const std::string *> _set;
+      std::size_t _action;
+
+      // tree
+      std::vector<open_element> _open;  // the open elements
+      std::size_t _foreign;             // open svg and math elements
+      std::size_t _paragraphs;          // open p elements
+
+      // the starts of the result links in the raw html, like
+      // `href="/url?q=http`, found by a vectorized search of the chunks
+      // as a cross-check of the results rule
+      std::vector<std::string> _anchors;
+      std::string _anchor_tail;         // the end of the previous chunk
+      std::string _anchor_window;
+      unsigned _anchors_seen;
+
+      // blocked pages
+      bool _captcha_form;
+      bool _consent_form;
+
+      void begin_tag(bool end_tag, char c);
+      void begin_attr(char c);
+      void end_attr();
+      void emit_tag();
+      void emit_text();
+      void start_tag();
+      void end_tag();
+      void close_implied(unsigned flags);
+      void pop_to(std::size_t depth);
+      int attribute_index() const;
+      void count_anchors(const char *data, std::size_t len);
+
+    public:
+      serp_scanner();
+
+      /**
+       * Prepares the scanner for a new page, looking for the domain in
+       * up to `limit` results.
+       */
+      void reset(const std::string& domain, int limit);
+
+      /**
+       * Scans the next chunk of the page.
+       */
+      void feed(const char *data, std::size_t len);
+
+      /**
+       * True when the rest of the page cannot change the result: the
+       * limit of results was reached. The results after the domain's
+       * one are still read, for the snapshot of the results.
+       */
+      bool done() const {
+        return _matcher.done();
+      }
+
+      /**
+       * The results of the page, after the last chunk. Throws
+       * `throttled_exception` for the captcha and consent pages and
+       * `unrecognized_page_exception` if it is not a results page.
+       */
+      serp_page finish();
+    };
+  }
+}
+
+#endif
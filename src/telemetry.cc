@@ -0,0 +1,124 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// telemetry.cc
+// reports on the cost of the ranking queries
+
+#include "telemetry.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <boost/uuid/uuid_io.hpp>
+
+namespace ranktracker {
+  namespace ranking {
+
+    static time_percentiles percentiles(std::vector<std::uint32_t>& values) {
+      time_percentiles p;
+      if(values.empty()) return p;
+      std::sort(values.begin(), values.end());
+      auto rank = [&values](unsigned percent) {
+        std::size_t n = (values.size() * percent + 99) / 100;
+        return std::chrono::microseconds(values[std::max<std::size_t>(n, 1) - 1]);
+      };
+      p.p50 = rank(50);
+      p.p90 = rank(90);
+      p.p99 = rank(99);
+      p.max = std::chrono::microseconds(values.back());
+      return p;
+    }
+
+    namespace {
+      // the samples of one engine and day
+      struct day_samples {
+        engine_day_telemetry summary;
+        std::vector<std::uint32_t> name_lookup, connect, tls, first_byte, transfer;
+        std::vector<std::uint32_t> decode, fetch, extract, wait, total;
+
+        void add(const QueryTelemetry& t) {
+          summary.queries++;
+          summary.pages += t._pages;
+          summary.wire_bytes += t._wire_bytes;
+          summary.decoded_bytes += t._decoded_bytes;
+          if(t._pages > 0) {
+            name_lookup.push_back(t._name_lookup / t._pages);
+            connect.push_back(t._connect / t._pages);
+            tls.push_back(t._tls / t._pages);
+            first_byte.push_back(t._first_byte / t._pages);
+            transfer.push_back(t._transfer / t._pages);
+          }
+          decode.push_back(t._decode);
+          fetch.push_back(t._fetch);
+          extract.push_back(t._extract);
+          wait.push_back(t._wait);
+          total.push_back(t._total);
+        }
+
+        engine_day_telemetry finish() {
+          summary.name_lookup = percentiles(name_lookup);
+          summary.connect = percentiles(connect);
+          summary.tls = percentiles(tls);
+          summary.first_byte = percentiles(first_byte);
+          summary.transfer = percentiles(transfer);
+          summary.decode = percentiles(decode);
+          summary.fetch = percentiles(fetch);
+          summary.extract = percentiles(extract);
+          summary.wait = percentiles(wait);
+          summary.total = percentiles(total);
+          return summary;
+        }
+      };
+    }
+
+    std::vector<engine_day_telemetry> telemetry_report(DataProvider& db,
+                                                       const boost::gregorian::date& from,
+                                                       const boost::gregorian::date& to) {
+      std::vector<std::pair<RankingKey, QueryTelemetry>> records;
+      {
+        create_transaction trans(&db, MDB_RDONLY);
+        records = db.telemetry(ptime(from), ptime(to));
+        trans.commit();
+      }
+
+      std::map<std::pair<boost::gregorian::date, AbstractEntity::id_type>, day_samples> days;
+      for(auto& r: records) {
+        auto day = r.first._ranking_date.date();
+        auto& samples = days[{day, r.first._engid}];
+        samples.summary.engine = r.first._engid;
+        samples.summary.day = day;
+        samples.add(r.second);
+      }
+
+      std::vector<engine_day_telemetry> report;
+      for(auto& d: days) {
+        report.push_back(d.second.finish());
+      }
+      return report;
+    }
+
+    static std::ostream& operator<<(std::ostream& out, const time_percentiles& p) {
+      return out << "p50 " << p.p50.count() / 1000.0 << "ms, p90 " << p.p90.count() / 1000.0
+                 << "ms, p99 " << p.p99.count() / 1000.0 << "ms, max " << p.max.count() / 1000.0 << "ms";
+    }
+
+    std::ostream& operator<<(std::ostream& out, const engine_day_telemetry& t) {
+      auto const& engines = ranktracker::engine::search_engines();
+      auto e = engines.find(t.engine);
+      out << boost::gregorian::to_iso_extended_string(t.day) << " "
+          << (e == engines.end() ? boost::uuids::to_string(t.engine) : e->second.name())
+          << ": " << t.queries << " queries, " << t.pages << " pages, " << t.wire_bytes << " bytes received, "
+          << t.decoded_bytes << " bytes decoded\n"
+          << "  per page: name lookup " << t.name_lookup << "\n"
+          << "            connect " << t.connect << "\n"
+          << "            tls " << t.tls << "\n"
+          << "            first byte " << t.first_byte << "\n"
+          << "            transfer " << t.transfer << "\n"
+          << "  per query: decode " << t.decode << "\n"
+          << "             fetch " << t.fetch << "\n"
+          << "             extract " << t.extract << "\n"
+          << "             wait " << t.wait << "\n"
+          << "             total " << t.total << "\n";
+      return out;
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// telemetry.hh
+// reports on the cost of the ranking queries, from the telemetry stored
+// with the rankings
+
+#ifndef RANKTRACKER_TELEMETRY_HH
+#define RANKTRACKER_TELEMETRY_HH
+
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include <boost/date_time/gregorian/gregorian.hpp>
+
+#include "data_provider.hh"
+
+namespace ranktracker {
+  namespace ranking {
+    using namespace ranktracker::data;
+    using namespace ranktracker::persistence;
+
+    /**
+     * Distribution of a measured time (nearest rank percentiles).
+     */
+    struct time_percentiles {
+      std::chrono::microseconds p50;
+      std::chrono::microseconds p90;
+      std::chrono::microseconds p99;
+      std::chrono::microseconds max;
+
+      time_percentiles() : p50(0), p90(0), p99(0), max(0) {}
+    };
+
+    /**
+     * The cost of the queries sent to a search engine in one day. The
+     * network times are per page, to compare the queries that fetched a
+     * different number of pages; the others are per query.
+     */
+    struct engine_day_telemetry {
+      AbstractEntity::id_type engine;
+      boost::gregorian::date day;
+      std::size_t queries;
+      std::size_t pages;
+      std::size_t wire_bytes;
+      std::size_t decoded_bytes;
+
+      time_percentiles name_lookup;
+      time_percentiles connect;
+      time_percentiles tls;
+      time_percentiles first_byte;
+      time_percentiles transfer;
+
+      time_percentiles decode;
+      time_percentiles fetch;
+      time_percentiles extract;
+      time_percentiles wait;
+      time_percentiles total;
+
+      engine_day_telemetry() : queries(0), pages(0), wire_bytes(0), decoded_bytes(0) {}
+    };
+
+    /**
+     * Summarizes, per engine and per day, the telemetry of the rankings
+     * made in the days [from, to). Opens its own transaction.
+     */
+    std::vector<engine_day_telemetry> telemetry_report(DataProvider& db,
+                                                       const boost::gregorian::date& from,
+                                                       const boost::gregorian::date& to);
+
+    /**
+     * One line per measure, for the logs.
+     */
+    std::ostream& operator<<(std::ostream& out, const engine_day_telemetry& t);
+  }
+}
+
+#endif
@@ -0,0 +1,198 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// url_canonicalizer.cc
+// the canonical form of the result urls, so the same landing page is
+// matched and stored under the same url
+
+#include "url_canonicalizer.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ranktracker {
+  namespace engine {
+
+    static inline char to_lower(char c) {
+      return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    static inline char to_upper(char c) {
+      return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+    }
+
+    static inline int hex_value(char c) {
+      if(c >= '0' && c <= '9') return c - '0';
+      if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    }
+
+    // the escape at p, if it is one; -1 otherwise
+    static inline int escaped(const char *p, const char *last) {
+      if(*p != '%' || last - p < 3) return -1;
+      int high = hex_value(p[1]);
+      int low = hex_value(p[2]);
+      return high < 0 || low < 0 ? -1 : high * 16 + low;
+    }
+
+    static inline bool is_unreserved(int c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '.' || c == '_' || c == '~';
+    }
+
+    // appends [first, last) with the unreserved characters decoded and
+    // the other escapes in upper case
+    static void append_normalized(std::string& out, const char *first, const char *last) {
+      for(const char *p = first; p < last; p++) {
+        int c = escaped(p, last);
+        if(c < 0) {
+          out += *p;
+        } else if(is_unreserved(c)) {
+          out += (char)c;
+          p += 2;
+        } else {
+          out += '%';
+          out += to_upper(p[1]);
+          out += to_upper(p[2]);
+          p += 2;
+        }
+      }
+    }
+
+    // the query parameters added to the links to follow the visitors
+    static const char * const tracking_parameters[] = {
+      "gclid", "gclsrc", "dclid", "fbclid", "msclkid", "yclid", "mc_cid", "mc_eid", "_ga", "_gl", "srsltid"
+    };
+
+    static bool is_tracking(const char *first, const char *last) {
+      std::size_t len = last - first;
+      if(len > 4 && std::equal(first, first + 4, "utm_", [](char a, char b) { return to_lower(a) == b; })) {
+        return true;
+      }
+      for(auto name: tracking_parameters) {
+        if(std::strlen(name) == len && std::equal(first, last, name, [](char a, char b) { return to_lower(a) == b; })) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    url_canonicalizer::url_canonicalizer(std::size_t capacity) :
+      _capacity(std::max<std::size_t>(1, capacity)),
+      _hits(0),
+      _misses(0)
+    {
+      _cache.reserve(_capacity);
+    }
+
+    std::string url_canonicalizer::decode_parameter(const char *first, const char *last) {
+      std::string out;
+      out.reserve(last - first);
+      for(const char *p = first; p < last; p++) {
+        int c = escaped(p, last);
+        if(c < 0) {
+          out += *p;
+        } else if(c <= 0x20 || c == 0x7f) {
+          // a url with a space or a line break would not be a url anymore
+          out += '%';
+          out += to_upper(p[1]);
+          out += to_upper(p[2]);
+          p += 2;
+        } else {
+          out += (char)c;
+          p += 2;
+        }
+      }
+      return out;
+    }
+
+    std::string url_canonicalizer::canonicalize(const std::string& url) {
+      std::size_t scheme_end = url.find("://");
+      if(scheme_end == std::string::npos || scheme_end == 0 ||
+         url.find_first_of("/?#") < scheme_end) {
+        // not an absolute url
+        return url;
+      }
+      const char *s = url.data();
+      const char *end = s + url.size();
+
+      std::string out;
+      out.reserve(url.size());
+      for(std::size_t i = 0; i < scheme_end; i++) out += to_lower(s[i]);
+      out += "://";
+
+      // the host, without the userinfo, the default port and a trailing dot
+      std::size_t host_begin = scheme_end + 3;
+      std::size_t authority_end = std::min(url.find_first_of("/?#", host_begin), url.size());
+      std::size_t at = url.find('@', host_begin);
+      if(at < authority_end) host_begin = at + 1;
+      std::size_t port_search = host_begin;
+      if(port_search < authority_end && s[port_search] == '[') {
+        // an IPv6 address
+        port_search = std::min(url.find(']', port_search), authority_end);
+      }
+      std::size_t host_end = std::min(url.find(':', port_search), authority_end);
+      std::size_t host_last = host_end;
+      while(host_last > host_begin && s[host_last - 1] == '.') host_last--;
+      for(std::size_t i = host_begin; i < host_last; i++) out += to_lower(s[i]);
+      if(host_end + 1 < authority_end) {
+        std::string port(s + host_end + 1, s + authority_end);
+        bool default_port = (port == "80" && out.compare(0, 7, "http://") == 0) ||
+          (port == "443" && out.compare(0, 8, "https://") == 0);
+        if(!default_port) {
+          out += ':';
+          out += port;
+        }
+      }
+
+      // the path, "/" when it is empty, without a trailing '/'
+      const char *path = s + authority_end;
+      const char *path_end = path;
+      while(path_end < end && *path_end != '?' && *path_end != '#') path_end++;
+      std::size_t path_start = out.size();
+      append_normalized(out, path, path_end);
+      if(out.size() == path_start) {
+        out += '/';
+      } else if(out.size() > path_start + 1 && out.back() == '/') {
+        out.pop_back();
+      }
+
+      // the query, without the tracking parameters; the fragment is dropped
+      if(path_end < end && *path_end == '?') {
+        const char *query_end = std::find(path_end, end, '#');
+        char separator = '?';
+        for(const char *p = path_end + 1; p < query_end; ) {
+          const char *param_end = std::find(p, query_end, '&');
+          const char *name_end = std::find(p, param_end, '=');
+          if(param_end != p && !is_tracking(p, name_end)) {
+            out += separator;
+            separator = '&';
+            append_normalized(out, p, param_end);
+          }
+          p = param_end + (param_end < query_end ? 1 : 0);
+        }
+      }
+      return out;
+    }
+
+    const std::string& url_canonicalizer::canonical(const char *first, const char *last, bool parameter) {
+      // the parameters after the target of a redirect link change with
+      // every query: they are not part of the key
+      if(parameter) last = std::find(first, last, '&');
+      _key.assign(1, parameter ? 'p' : 'u');
+      _key.append(first, last);
+
+      auto cached = _cache.find(_key);
+      if(cached != _cache.end()) {
+        _hits++;
+        return cached->second;
+      }
+      _misses++;
+      if(_cache.size() >= _capacity) {
+        // emptied rather than aged: the next pages fill it again
+        _cache.clear();
+      }
+      std::string url = parameter ? decode_parameter(first, last) : std::string(first, last);
+      return _cache.emplace(_key, canonicalize(url)).first->second;
+    }
+  }
+}
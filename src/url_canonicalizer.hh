@@ -0,0 +1,69 @@
+/* -*- mode: C++; flycheck-clang-language-standard: "c++11" -*- */
+// url_canonicalizer.hh
+// the canonical form of the result urls, so the same landing page is
+// matched and stored under the same url
+
+#ifndef RANKTRACKER_URL_CANONICALIZER_HH
+#define RANKTRACKER_URL_CANONICALIZER_HH
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+namespace ranktracker {
+  namespace engine {
+
+    /**
+     * Turns the result links into the urls of their landing pages, the
+     * same string for the same page whatever link it was reached by:
+     *
+     * - the target of a redirect link (google's "/url?q=...&sa=...")
+     *   is the value of its parameter, up to the next '&', decoded;
+     * - the scheme and the host are lower case, without the userinfo,
+     *   the default port and a trailing dot;
+     * - the escapes of the unreserved characters are decoded and the
+     *   other ones are upper case;
+     * - the tracking parameters (utm_*, gclid, fbclid, srsltid, ...)
+     *   and the fragment are removed;
+     * - an empty path is "/" and the other paths lose their trailing
+     *   '/'.
+     *
+     * The landing pages come back in the results of many queries, so
+     * the canonical urls are memoized; an instance is used by one
+     * thread, with the parser state of the thread.
+     */
+    class url_canonicalizer {
+      std::unordered_map<std::string, std::string> _cache;
+      std::size_t _capacity;
+      std::string _key;
+      unsigned long _hits;
+      unsigned long _misses;
+
+    public:
+      explicit url_canonicalizer(std::size_t capacity = 8192);
+
+      /**
+       * The canonical url of the link [first, last); with `parameter`
+       * the link is the value of a redirect parameter, still encoded.
+       * The reference is valid until the next call.
+       */
+      const std::string& canonical(const char *first, const char *last, bool parameter);
+
+      /**
+       * The canonical form of a url, without the cache.
+       */
+      static std::string canonicalize(const std::string& url);
+
+      /**
+       * The value of a url parameter, decoded; the escapes that would
+       * decode to spaces or control characters are kept.
+       */
+      static std::string decode_parameter(const char *first, const char *last);
+
+      unsigned long hits() const { return _hits; }
+      unsigned long misses() const { return _misses; }
+    };
+  }
+}
+
+#endif